@@ -1,4 +1,5 @@
 #include "SymbolTable.h"
+#include "stats.h"
 #include <cassert>
 #include <cstring>
 
@@ -17,8 +18,7 @@ SymbolTable::~SymbolTable()
 */
 void SymbolTable::enterScope()
 {  
-  std::map<int, std::string>* m = new std::map<int, std::string>;
-  m_stack.push_back(*m);	
+  m_stack.push_back(Scope());
 }
 
 /*
@@ -32,6 +32,7 @@ void SymbolTable::exitScope()
 
 int SymbolTable::addSymbol(std::string sym)
 {
+  STAT_TIMER(SYMBOLS);
   assert(m_stack.size() > 0);
   auto& hTable = m_stack.back();
   
@@ -53,6 +54,9 @@ int SymbolTable::addSymbol(std::string sym)
 
 int SymbolTable::getUniqueSymbol(std::string sym)
 {
+  STAT_TIMER(SYMBOLS);
+  STAT_COUNT(LOOKUPS, 1);
+  STAT_COUNT(SCOPE_DEPTH, m_stack.size());
   for (int i = m_stack.size(); i > 0; i--)
     {
       auto stack = m_stack.at(i - 1);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "stats.h"
+
 #include <iostream>
 #include <map>
 #include <stack>
@@ -17,7 +19,10 @@ public:
   int getUniqueSymbol(std::string sym);  
   
 private:
-  std::vector<std::map<int, std::string>> m_stack;
+  typedef std::map<int, std::string, std::less<int>,
+		   AccountedAllocator<std::pair<const int, std::string>, MemoryStats::SYMBOLS> > Scope;
+
+  std::vector<Scope> m_stack;
   
 };
 
@@ -0,0 +1,28 @@
+#!/bin/bash
+# Execution time of each backend on bench/loop.mc or the programs given:
+# the bytecode VM, native code through the JIT, and the C backend built
+# with gcc -O2 as the reference for how far the native code lags.  Run
+# from the repository root after make.
+#
+#   bench/backends.sh [program.mc...]
+
+progs=${@:-bench/loop.mc}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Wall time of one run in milliseconds
+ms() {
+  local start end
+  start=$(date +%s%N)
+  "$@" > /dev/null
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+printf "%-12s %8s %10s %11s %11s %10s\n" program "--vm" "--vm -O1" "--run -O0" "--run -O1" "C gcc -O2"
+for p in $progs; do
+  ./microc --emit=c -O1 $p > $tmp/p.c && gcc -std=c99 -O2 -o $tmp/p $tmp/p.c
+  printf "%-12s %8s %10s %11s %11s %10s\n" $(basename $p) \
+    $(ms ./microc --vm $p) $(ms ./microc --vm -O1 $p) \
+    $(ms ./microc --run -O0 $p) $(ms ./microc --run -O1 $p) $(ms $tmp/p)
+done
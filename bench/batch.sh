@@ -0,0 +1,41 @@
+#!/bin/bash
+# Batch compile throughput: one microc process per file against a single
+# microc -j N over the same files.  The files are [copies] copies of each
+# sample program.  Run from the repository root after make.
+#
+#   bench/batch.sh [copies] [jobs...]
+
+copies=${1:-200}
+shift
+jobs=${@:-1 $(nproc)}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+for p in fact testcu calendar; do
+  for ((i = 0; i < copies; i++)); do
+    cp $p.mc $tmp/$p$i.mc
+  done
+done
+ls $tmp/*.mc > $tmp/list
+n=$(wc -l < $tmp/list)
+
+# Wall time of a command in milliseconds
+ms() {
+  local start end
+  start=$(date +%s%N)
+  "$@" > /dev/null 2>&1
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+perfile() {
+  for f in $(cat $tmp/list); do
+    ./microc -O1 $f > ${f%.mc}.asm
+  done
+}
+
+printf "%-24s %10s\n" "$n files, -O1" "ms"
+printf "%-24s %10s\n" "one process per file" $(ms perfile)
+for j in $jobs; do
+  printf "%-24s %10s\n" "microc -j $j" $(ms ./microc -O1 -j $j @$tmp/list)
+done
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Output cache: cold and warm compiles of the sample programs, one microc
+# process per compile as mcc runs it, with a fresh cache directory.  Run
+# from the repository root after make.
+#
+#   bench/cache.sh [rounds]
+
+rounds=${1:-50}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+export MICROC_CACHE=$tmp/cache
+
+# Wall time of rounds compiles of every sample in milliseconds
+ms() {
+  local start end
+  start=$(date +%s%N)
+  for ((i = 0; i < rounds; i++)); do
+    for p in fact testcu calendar; do
+      ./microc "$@" -O1 -c -o $tmp/$p.o $p.mc
+    done
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / 1000000 ))
+}
+
+printf "%-24s %10s\n" "$((rounds * 3)) compiles, -O1 -c" "ms"
+printf "%-24s %10s\n" "no cache" $(ms --no-cache)
+./microc --cache-clear
+printf "%-24s %10s\n" "cache" $(ms --cache)
+./microc --cache-stats
@@ -0,0 +1,244 @@
+// Generates synthetic .mc programs for the throughput benchmark.  Each
+// shape stresses one part of the compiler and grows linearly with size,
+// which is roughly the number of lines written:
+//
+//   functions  many small functions calling each other
+//   nesting    deeply parenthesized expressions
+//   ifchain    long chains of if/else
+//   locals     functions with hundreds of variables in nested scopes
+//   printf     many printf calls with varied formats
+//   comments   mostly comment lines, blank lines and indentation
+//   mixed      all of the above in turn
+//   random     random expressions, conditions and calls, for the tests
+//              that compare ways of compiling the same program
+//
+//   mcgen shape size [seed]
+//
+// The programs are meant to be compiled, not run: the locals shape
+// declares more variables than an -O0 frame holds.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+static unsigned long long state;
+
+// Deterministic across platforms, unlike rand()
+int next(int n) {
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return static_cast<int>((state >> 33) % n);
+}
+
+const char* var(int i) {
+  static const char* names[] = { "a", "b", "x", "y" };
+  return names[i & 3];
+}
+
+// A function header with the four variables every shape uses
+void begin(const char* prefix, int n) {
+  printf("function %s%d(a, b) {\n  var x, y;\n  x = a;\n  y = b;\n", prefix, n);
+}
+
+void end() {
+  printf("  return x + y;\n}\n");
+}
+
+int functions(int size) {
+  int count = size / 14 + 1;
+
+  for (int i = 0; i < count; i++) {
+    begin("f", i);
+    printf("  while (x < b) {\n    if (y > %d) {\n      y = y - %d;\n    } else {\n"
+	   "      y = y + x * 2;\n    }\n    x = x + 1;\n  }\n", next(50), next(9) + 1);
+    if (i > 0)
+      printf("  y = f%d(x, %d);\n", next(i), next(100));
+    end();
+  }
+  return count;
+}
+
+// An expression nested depth levels deep in parentheses
+void nested(int depth) {
+  static const char* ops[] = { "+", "-", "*", "+" };
+
+  for (int d = 0; d < depth; d++)
+    printf("(");
+  printf("%s", var(next(4)));
+  for (int d = 0; d < depth; d++)
+    printf(" %s %d)", ops[next(4)], next(9) + 1);
+}
+
+int nesting(int size) {
+  int count = size / 24 + 1;
+
+  for (int i = 0; i < count; i++) {
+    begin("n", i);
+    for (int s = 0; s < 20; s++) {
+      printf("  %s = ", s & 1 ? "y" : "x");
+      nested(16 + next(48));
+      printf(";\n");
+    }
+    end();
+  }
+  return count;
+}
+
+int ifchain(int size) {
+  int count = size / 130 + 1;
+  static const char* rels[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+  for (int i = 0; i < count; i++) {
+    begin("c", i);
+    // Chains of 8 nested else blocks, 4 chains per function
+    for (int c = 0; c < 4; c++) {
+      std::string close;
+      for (int k = 0; k < 8; k++) {
+	std::string indent(2 + 2 * k, ' ');
+	printf("%sif (x %s %d || y %s %d) {\n%s  y = y + %d;\n%s} else {\n", indent.c_str(),
+	       rels[next(6)], next(100), rels[next(6)], next(100), indent.c_str(), k + 1, indent.c_str());
+	close = indent + "}\n" + close;
+      }
+      printf("%s  x = x + 1;\n%s", std::string(18, ' ').c_str(), close.c_str());
+    }
+    end();
+  }
+  return count;
+}
+
+int locals(int size) {
+  int count = size / 260 + 1;
+
+  for (int i = 0; i < count; i++) {
+    begin("l", i);
+    // 200 variables over four nested scopes, each used later on
+    for (int s = 0; s < 4; s++) {
+      std::string indent(2 + 2 * s, ' ');
+      printf("%sif (x < %d) {\n", indent.c_str(), 1000 + s);
+      for (int v = 0; v < 50; v++)
+	printf("%s  var v%dx%d;\n", indent.c_str(), s, v);
+      for (int v = 0; v < 50; v++)
+	printf("%s  v%dx%d = v%dx%d + x;\n", indent.c_str(), s, v, next(s + 1), next(50));
+    }
+    for (int s = 3; s >= 0; s--)
+      printf("%s}\n", std::string(2 + 2 * s, ' ').c_str());
+    end();
+  }
+  return count;
+}
+
+int printfs(int size) {
+  int count = size / 106 + 1;
+  static const char* fmts[] = { "%d\\n", "x=%d y=%d\\n", "[%d, %d, %d]\\n", "value %d of %d\\n",
+				"no arguments here\\n", "%d%d%d%d\\n" };
+  static const int args[] = { 1, 2, 3, 2, 0, 4 };
+
+  for (int i = 0; i < count; i++) {
+    begin("p", i);
+    for (int s = 0; s < 100; s++) {
+      int f = next(6);
+      printf("  printf(\"%s\"", fmts[f]);
+      for (int k = 0; k < args[f]; k++)
+	printf(", %s + %d", var(next(4)), next(1000));
+      printf(");\n");
+    }
+    end();
+  }
+  return count;
+}
+
+int comments(int size) {
+  int count = size / 60 + 1;
+
+  for (int i = 0; i < count; i++) {
+    printf("# ------------------------------------------------------------------\n"
+	   "# m%d: a function documented at length, as generated code often is\n"
+	   "# ------------------------------------------------------------------\n\n", i);
+    begin("m", i);
+    for (int s = 0; s < 10; s++) {
+      printf("\n    # Step %d: nothing here is code; the lexer skips every byte\n"
+	     "    # of it, which is the point of this shape.  %d %d %d\n"
+	     "          # indented further, with trailing blanks        \n"
+	     "\n\n", s, next(1000), next(1000), next(1000));
+      printf("  x = x + %d;      # and a comment after a statement\n", next(100));
+    }
+    end();
+  }
+  return count;
+}
+
+// A random expression tree at most depth deep
+std::string expression(int depth) {
+  static const char* ops[] = { "+", "-", "*", "/" };
+
+  if (depth == 0 || next(3) == 0)
+    return next(2) ? var(next(4)) : std::to_string(static_cast<long long>(next(100)));
+  int op = next(4);
+  // A constant divisor, so the program never divides by zero
+  std::string right = op == 3 ? std::to_string(static_cast<long long>(next(9) + 1)) : expression(depth - 1);
+  return "(" + expression(depth - 1) + " " + ops[op] + " " + right + ")";
+}
+
+int randoms(int size) {
+  int count = size / 40 + 1;
+  static const char* rels[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+  for (int i = 0; i < count; i++) {
+    begin("r", i);
+    for (int s = 0; s < 8; s++)
+      switch (next(4)) {
+      case 0:
+	printf("  %s = %s;\n", var(next(4) | 2), expression(4).c_str());
+	break;
+      case 1:
+	printf("  if (%s %s %s) {\n    y = %s;\n  } else {\n    x = %s;\n  }\n", expression(3).c_str(),
+	       rels[next(6)], expression(3).c_str(), expression(3).c_str(), expression(3).c_str());
+	break;
+      case 2:
+	printf("  printf(\"%%d %%d\\n\", %s, %s);\n", expression(3).c_str(), expression(3).c_str());
+	break;
+      default:
+	if (i > 0)
+	  printf("  y = r%d(%s, %s);\n", next(i), expression(2).c_str(), expression(2).c_str());
+      }
+    end();
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: mcgen functions|nesting|ifchain|locals|printf|comments|mixed|random size [seed]\n");
+    return 1;
+  }
+  const char* shape = argv[1];
+  int size = atoi(argv[2]);
+  state = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+
+  int (*gen[])(int) = { functions, nesting, ifchain, locals, printfs, comments };
+  const char* names[] = { "functions", "nesting", "ifchain", "locals", "printf", "comments" };
+  const char* prefixes[] = { "f", "n", "c", "l", "p", "m" };   // Of each shape's functions
+  const int shapes = 6;
+  std::string calls;
+
+  for (int k = 0; k < shapes; k++)
+    if (!strcmp(shape, names[k]) || !strcmp(shape, "mixed")) {
+      int n = gen[k](strcmp(shape, "mixed") ? size : size / shapes);
+      char call[64];
+      snprintf(call, sizeof(call), "  x = %s%d(1, 2);\n", prefixes[k], n - 1);
+      calls += call;
+    }
+  if (!strcmp(shape, "random")) {
+    int n = randoms(size);
+    char call[64];
+    snprintf(call, sizeof(call), "  x = r%d(1, 2);\n", n - 1);
+    calls = call;
+  }
+  if (calls.empty()) {
+    fprintf(stderr, "mcgen: unknown shape %s\n", shape);
+    return 1;
+  }
+
+  printf("function main() {\n  var x;\n%s  return 0;\n}\n", calls.c_str());
+  return 0;
+}
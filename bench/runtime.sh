@@ -0,0 +1,40 @@
+#!/bin/bash
+# libc printf against the static runtime (mcrt.o), with printf calls
+# split at compile time (--runtime=mcrt).  Startup is the
+# average over [runs] runs of calendar.mc; throughput is one run of
+# bench/print.mc, two million printf calls.  Output goes to /dev/null.
+# Run from the repository root after make.
+#
+#   bench/runtime.sh [runs]
+
+runs=${1:-200}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Average wall time over $runs runs of a command, in microseconds
+avg() {
+  local start end n=$1
+  shift
+  start=$(date +%s%N)
+  for ((i = 0; i < n; i++)); do
+    "$@" > /dev/null
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / n / 1000 ))
+}
+
+for p in calendar bench/print; do
+  b=$(basename $p)
+  ./microc -O1 -c -o $tmp/$b.o $p.mc
+  ./microc -O1 --runtime=mcrt -c -o $tmp/$b.mcrt.o $p.mc
+  gcc -o $tmp/$b.libc $tmp/$b.o
+  ld -static -o $tmp/$b.mcrt $tmp/$b.mcrt.o mcrt.o
+done
+
+printf "%-28s %12s %12s\n" "" "libc" "mcrt"
+printf "%-28s %12s %12s\n" "calendar startup (us)" \
+  $(avg $runs $tmp/calendar.libc) $(avg $runs $tmp/calendar.mcrt)
+printf "%-28s %12s %12s\n" "print.mc, 2M printf (us)" \
+  $(avg 1 $tmp/print.libc) $(avg 1 $tmp/print.mcrt)
+printf "%-28s %12s %12s\n" "binary size (bytes)" \
+  $(stat -c %s $tmp/calendar.libc) $(stat -c %s $tmp/calendar.mcrt)
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Startup latency: time from source to program output, JIT vs the mcc
+# pipeline.  Run from the repository root after make.
+#
+#   bench/startup.sh [runs] [program...]
+#
+# mcc is timed on its default object path and, when nasm is installed, on
+# the nasm path as well (MCC_NASM=1).
+
+runs=${1:-20}
+shift
+progs=${@:-fact testcu calendar}
+export PATH=$PWD:$PATH
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Average wall time of a command over $runs runs, in milliseconds
+avg() {
+  local start end
+  start=$(date +%s%N)
+  for ((i = 0; i < runs; i++)); do
+    "$@" > /dev/null 2>&1
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / runs / 1000 ))
+}
+
+mccrun() {
+  cp $1.mc $tmp/ && (cd $tmp && bash $OLDPWD/mcc $1 && ./$1)
+}
+
+mccnasm() {
+  MCC_NASM=1 mccrun $1
+}
+
+printf "%-10s %12s %12s %12s\n" program "--run (us)" "mcc (us)" "mcc nasm (us)"
+for p in $progs; do
+  jit=$(avg ./microc --run $p.mc)
+  obj=$(avg mccrun $p)
+  if command -v nasm > /dev/null; then
+    asm=$(avg mccnasm $p)
+  else
+    asm="-"
+  fi
+  printf "%-10s %12s %12s %12s\n" $p $jit $obj $asm
+done
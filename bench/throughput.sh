@@ -0,0 +1,85 @@
+#!/bin/bash
+# Compiler throughput: compiles programs from bench/mcgen of every shape at
+# several sizes and reports lex, parse and codegen time, tokens and lines
+# per second and peak RSS, the best of [rounds] runs.  Throughput more
+# than $TOL percent below the baseline, or peak RSS more than $TOL percent
+# above it, is flagged and makes the script fail.  Baselines are only
+# comparable on the machine they were taken on, and a busy machine may
+# need a larger TOL; --update rewrites them.
+# Run from the repository root after make microc bench/mcgen.
+#
+#   bench/throughput.sh [--update] [rounds] [sizes...]
+
+baseline=bench/throughput.baseline
+update=0
+if [ "$1" = "--update" ]; then
+  update=1
+  shift
+fi
+rounds=${1:-5}
+shift
+sizes=${@:-1000 4000 16000}
+shapes="functions nesting ifchain locals printf comments mixed"
+tol=${TOL:-20}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Deep expressions recurse in the parser and code generator
+ulimit -s unlimited 2>/dev/null
+
+# The value of a numeric field of a line of --stats=json output
+field() {
+  sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p"
+}
+
+regressions=0
+printf "%-10s %6s %8s %8s %8s %8s %8s %10s %10s %9s\n" shape size lines tokens \
+       "lex ms" "parse ms" "cgen ms" "tokens/s" "lines/s" "RSS KiB"
+for shape in $shapes; do
+  for size in $sizes; do
+    bench/mcgen $shape $size > $tmp/p.mc
+    lines=$(wc -l < $tmp/p.mc)
+    best=
+    for ((i = 0; i < rounds; i++)); do
+      if ! ./microc --no-cache --stats=json --mem-stats=json -o $tmp/p.asm $tmp/p.mc 2> $tmp/stats; then
+	cat $tmp/stats
+	exit 1
+      fi
+      total=$(head -1 $tmp/stats | field total_ms)
+      if [ -z "$best" ] || awk "BEGIN { exit !($total < $best) }"; then
+	best=$total
+	cp $tmp/stats $tmp/best
+      fi
+    done
+    s=$(head -1 $tmp/best)
+    tokens=$(echo "$s" | field tokens)
+    rss=$(tail -1 $tmp/best | field peak_rss_kib)
+    read tps lps <<< $(awk "BEGIN { printf \"%d %d\", $tokens / $best * 1000, $lines / $best * 1000 }")
+    printf "%-10s %6d %8d %8d %8.1f %8.1f %8.1f %10d %10d %9d" $shape $size $lines $tokens \
+	   $(echo "$s" | field lex) $(echo "$s" | field parse) $(echo "$s" | field codegen) $tps $lps $rss
+    echo "$shape $size $tps $rss" >> $tmp/results
+
+    old=$(grep "^$shape $size " $baseline 2>/dev/null)
+    if [ $update = 0 ] && [ -n "$old" ]; then
+      read _ _ oldtps oldrss <<< "$old"
+      if awk "BEGIN { exit !($tps < $oldtps * (100 - $tol) / 100) }"; then
+	printf "  slower (baseline %d tokens/s)" $oldtps
+	regressions=$((regressions + 1))
+      fi
+      if awk "BEGIN { exit !($rss > $oldrss * (100 + $tol) / 100) }"; then
+	printf "  larger (baseline %d KiB)" $oldrss
+	regressions=$((regressions + 1))
+      fi
+    fi
+    echo
+  done
+done
+
+if [ $update = 1 ]; then
+  (echo "# shape size tokens/s peak-RSS-KiB, from bench/throughput.sh --update"
+   cat $tmp/results) > $baseline
+  echo "wrote $baseline"
+elif [ $regressions -gt 0 ]; then
+  echo "$regressions regressions beyond $tol%"
+  exit 1
+fi
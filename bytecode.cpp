@@ -0,0 +1,367 @@
+#include "bytecode.h"
+#include "stats.h"
+#include "compileerror.h"
+
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+
+static const char* NAMES[] = {
+  "HALT", "ENTER", "PARAM", "LOADV", "LOADL", "STORE",
+  "ADD", "SUB", "MULT", "DIV", "AND", "OR",
+  "ISEQ", "ISNE", "ISLT", "ISLE", "ISGT", "ISGE",
+  "JUMP", "JUMPF", "JUMPT", "CALL", "RET", "PRINTF",
+  "LOADVV", "ADDVL", "ADDVLS", "STOREL", "MOVV", "JCMP", "JCMPVL"
+};
+
+static const char* OPERANDS[] = {
+  "", "v", "vv", "v", "v", "v",
+  "", "", "", "", "", "",
+  "", "", "", "", "", "",
+  "t", "t", "t", "t", "", "vv",
+  "vv", "vv", "vvv", "vv", "vv", "vt", "vvvt"
+};
+
+// Strips the colon from a LABEL node's text
+static std::string labelName(const std::string& val)
+{
+  if (!val.empty() && val[val.size() - 1] == ':')
+    return val.substr(0, val.size() - 1);
+  return val;
+}
+
+static bool isRelational(int op)
+{
+  return op >= Bytecode::ISEQ && op <= Bytecode::ISGE;
+}
+
+Bytecode::Bytecode() : fused(0), m_enter(0), m_varcnt(0)
+{
+
+}
+
+Bytecode::~Bytecode()
+{
+
+}
+
+const char* Bytecode::operands(int op)
+{
+  return OPERANDS[op];
+}
+
+const char* Bytecode::name(int op)
+{
+  return NAMES[op];
+}
+
+void Bytecode::add(int op, long long a, long long b, long long c, const std::string& target)
+{
+  Instr instr;
+  instr.op = op;
+  instr.a = a;
+  instr.b = b;
+  instr.c = c;
+  instr.target = target;
+  m_instrs.push_back(instr);
+}
+
+/*
+  Post-order walk of the tree, the same order gensasm prints in.  ENTER's
+  operand grows to the highest slot the function touches.
+*/
+void Bytecode::gen(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return;
+
+  gen(node->leftChild);
+  gen(node->rightChild);
+
+  long long& nslots = m_instrs[m_enter].a;   // Invalidated by add()
+  long long slot = 0;
+
+  switch (node->op)
+    {
+    case Parser::SEQ:
+      break;
+    case Parser::LOADV:
+    case Parser::STORE:
+      slot = std::stoi(node->val);
+      if (slot > nslots)
+	nslots = slot;
+      add(node->op == Parser::LOADV ? LOADV : STORE, slot);
+      break;
+    case Parser::LOADL:
+      add(LOADL, node->literal());
+      break;
+    case Parser::ADD:
+      add(ADD);
+      break;
+    case Parser::SUB:
+      add(SUB);
+      break;
+    case Parser::MULT:
+      add(MULT);
+      break;
+    case Parser::DIV:
+      add(DIV);
+      break;
+    case Parser::AND:
+      add(AND);
+      break;
+    case Parser::OR:
+      add(OR);
+      break;
+    case Parser::ISEQ:
+    case Parser::ISNE:
+    case Parser::ISLT:
+    case Parser::ISLE:
+    case Parser::ISGT:
+    case Parser::ISGE:
+      add(ISEQ + node->op - Parser::ISEQ);
+      break;
+    case Parser::LABEL:
+      add(-1);
+      m_instrs.back().label = labelName(node->val);
+      break;
+    case Parser::JUMP:
+      add(JUMP, 0, 0, 0, node->val);
+      break;
+    case Parser::JUMPF:
+      add(JUMPF, 0, 0, 0, node->val);
+      break;
+    case Parser::JUMPT:
+      add(JUMPT, 0, 0, 0, node->val);
+      break;
+    case Parser::CALL:
+      add(CALL, 0, 0, 0, node->val);
+      break;
+    case Parser::FUNC:
+      add(-1);
+      m_instrs.back().label = node->val;
+      add(ENTER);
+      m_enter = m_instrs.size() - 1;
+      m_varcnt = 0;
+      break;
+    case Parser::RET:
+      add(RET);
+      break;
+    case Parser::PRINTF:
+      if (node->paramCount > MAXPRINTFARGS)
+	{
+	  throw CompileError("printf with more than " + std::to_string(static_cast<long long>(MAXPRINTFARGS))
+			     + " arguments is not supported by the VM");
+	}
+      strings.push_back(MBuffer::decodeString("`" + node->val + "`"));
+      add(PRINTF, strings.size() - 1, node->paramCount);
+      break;
+    case Parser::PARAM:
+      ++m_varcnt;
+      if (m_varcnt > nslots)
+	nslots = m_varcnt;
+      add(PARAM, node->paramCount + 2, m_varcnt);
+      break;
+    default:
+      throw CompileError("In bytecode: Unknown operation " + std::to_string(static_cast<long long>(node->op)));
+    }
+}
+
+/*
+  Peephole pass that replaces the most frequent instruction sequences
+  with superinstructions.  Labels are separate entries, so a sequence is
+  never fused across a branch target.
+*/
+void Bytecode::fuse()
+{
+  std::vector<Instr> out;
+  size_t n = m_instrs.size();
+
+  for (size_t i = 0; i < n; i++)
+    {
+      Instr* p = &m_instrs[i];
+      int op0 = p[0].op;
+      int op1 = i + 1 < n ? p[1].op : -1;
+      int op2 = i + 2 < n ? p[2].op : -1;
+      int op3 = i + 3 < n ? p[3].op : -1;
+      size_t used = 1;
+      Instr f = p[0];
+
+      if (op0 == LOADV && op1 == LOADL && (op2 == ADD || op2 == SUB) && p[1].a != LLONG_MIN)
+	{
+	  f.b = op2 == ADD ? p[1].a : -p[1].a;
+	  if (op3 == STORE)
+	    {
+	      f.op = ADDVLS;
+	      f.c = p[3].a;
+	      used = 4;
+	    }
+	  else
+	    {
+	      f.op = ADDVL;
+	      used = 3;
+	    }
+	}
+      else if (op0 == LOADV && op1 == LOADL && isRelational(op2) && op3 == JUMPF)
+	{
+	  f.op = JCMPVL;
+	  f.a = op2 - ISEQ;
+	  f.b = p[0].a;
+	  f.c = p[1].a;
+	  f.target = p[3].target;
+	  used = 4;
+	}
+      else if (isRelational(op0) && op1 == JUMPF)
+	{
+	  f.op = JCMP;
+	  f.a = op0 - ISEQ;
+	  f.target = p[1].target;
+	  used = 2;
+	}
+      else if (op0 == LOADV && op1 == LOADV && op2 != LOADL)
+	{
+	  f.op = LOADVV;
+	  f.b = p[1].a;
+	  used = 2;
+	}
+      else if ((op0 == LOADL || op0 == LOADV) && op1 == STORE)
+	{
+	  f.op = op0 == LOADL ? STOREL : MOVV;
+	  f.b = p[1].a;
+	  used = 2;
+	}
+
+      if (used > 1)
+	fused++;
+      out.push_back(f);
+      i += used - 1;
+    }
+
+  m_instrs.swap(out);
+}
+
+// Zigzag, then unsigned LEB128
+void Bytecode::putVarint(long long v)
+{
+  unsigned long long u = (static_cast<unsigned long long>(v) << 1) ^ static_cast<unsigned long long>(v >> 63);
+
+  while (u >= 0x80)
+    {
+      code.push_back(static_cast<unsigned char>(u | 0x80));
+      u >>= 7;
+    }
+  code.push_back(static_cast<unsigned char>(u));
+}
+
+long long Bytecode::readVarint(const unsigned char*& p)
+{
+  unsigned long long u = 0;
+  int shift = 0;
+
+  while (*p & 0x80)
+    {
+      u |= static_cast<unsigned long long>(*p++ & 0x7f) << shift;
+      shift += 7;
+    }
+  u |= static_cast<unsigned long long>(*p++) << shift;
+  return static_cast<long long>(u >> 1) ^ -static_cast<long long>(u & 1);
+}
+
+int Bytecode::readTarget(const unsigned char*& p)
+{
+  int t = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+  p += 4;
+  return t;
+}
+
+void Bytecode::encode()
+{
+  std::map<std::string, int> labels;
+  std::vector<std::pair<size_t, std::string> > fixups;
+
+  code.clear();
+  for (size_t i = 0; i < m_instrs.size(); i++)
+    {
+      Instr& instr = m_instrs[i];
+
+      if (!instr.label.empty())
+	{
+	  labels[instr.label] = code.size();
+	  continue;
+	}
+
+      long long args[] = { instr.a, instr.b, instr.c };
+      const char* kinds = OPERANDS[instr.op];
+
+      code.push_back(instr.op);
+      for (int k = 0; kinds[k]; k++)
+	{
+	  if (kinds[k] == 'v')
+	    putVarint(args[k]);
+	  else
+	    {
+	      fixups.push_back(std::make_pair(code.size(), instr.target));
+	      code.insert(code.end(), 4, 0);
+	    }
+	}
+    }
+
+  for (size_t i = 0; i < fixups.size(); i++)
+    {
+      std::map<std::string, int>::iterator it = labels.find(fixups[i].second);
+
+      if (it == labels.end())
+	{
+	  throw CompileError("undefined label or function " + fixups[i].second);
+	}
+      for (int k = 0; k < 4; k++)
+	code[fixups[i].first + k] = (it->second >> (8 * k)) & 0xff;
+    }
+}
+
+/*
+  Compiles the whole program.  A three instruction stub at offset 0 calls
+  main the way the C runtime would and halts with its result.
+*/
+void Bytecode::compile(Parser::TreeNode* program)
+{
+  STAT_TIMER(CODEGEN);
+  m_instrs.clear();
+  strings.clear();
+  fused = 0;
+
+  add(LOADL, 0);
+  add(CALL, 0, 0, 0, "main");
+  add(HALT);
+  m_enter = 0;
+  gen(program);
+  add(HALT);
+
+  fuse();
+  encode();
+  m_instrs.clear();
+}
+
+void Bytecode::disassemble(std::ostream& out)
+{
+  const unsigned char* p = code.data();
+  const unsigned char* end = p + code.size();
+
+  while (p < end)
+    {
+      int op = *p;
+      const char* kinds = OPERANDS[op];
+
+      out << (p - code.data()) << "\t" << NAMES[op];
+      p++;
+      for (int k = 0; kinds[k]; k++)
+	{
+	  out << (k == 0 ? " " : ", ");
+	  if (kinds[k] == 'v')
+	    out << readVarint(p);
+	  else
+	    out << "@" << readTarget(p);
+	}
+      out << std::endl;
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "parser.h"
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Compact binary encoding of the stack machine IR that gensasm prints.
+// Every instruction is a one byte opcode followed by its operands: signed
+// LEB128 varints for slots and literals, fixed 4-byte offsets for branch
+// and call targets.  Common sequences are fused into superinstructions
+// before encoding.
+//
+// Frames follow the -O0 code: arguments and their byte count are pushed by
+// the caller, CALL pushes the return address, ENTER saves fp and reserves
+// the locals, and slot k lives at fp-k.
+class Bytecode
+{
+public:
+  enum { MAXPRINTFARGS = 16 };
+
+  enum Op {
+    HALT,
+    ENTER,      // nslots
+    PARAM,      // src (fp relative), dst slot
+    LOADV,      // slot
+    LOADL,      // literal
+    STORE,      // slot
+    ADD, SUB, MULT, DIV, AND, OR,
+    ISEQ, ISNE, ISLT, ISLE, ISGT, ISGE,
+    JUMP,       // target
+    JUMPF,      // target
+    JUMPT,      // target
+    CALL,       // target
+    RET,
+    PRINTF,     // string, nargs
+
+    // Superinstructions
+    LOADVV,     // slot, slot: LOADV LOADV
+    ADDVL,      // slot, literal: LOADV LOADL ADD|SUB
+    ADDVLS,     // slot, literal, slot: LOADV LOADL ADD|SUB STORE
+    STOREL,     // literal, slot: LOADL STORE
+    MOVV,       // slot, slot: LOADV STORE
+    JCMP,       // relation, target: ISxx JUMPF
+    JCMPVL,     // relation, slot, literal, target: LOADV LOADL ISxx JUMPF
+
+    OPCOUNT
+  };
+
+  Bytecode();
+  ~Bytecode();
+
+  void compile(Parser::TreeNode* program);
+  void disassemble(std::ostream& out);
+
+  // Operand layout of op: 'v' varint, 't' 4-byte target
+  static const char* operands(int op);
+  static const char* name(int op);
+  static long long readVarint(const unsigned char*& p);
+  static int readTarget(const unsigned char*& p);
+
+  std::vector<unsigned char> code;
+  std::vector<std::string> strings;   // printf formats, already unescaped
+  int fused;                          // Superinstructions formed
+
+private:
+  class Instr
+  {
+  public:
+    int op;
+    long long a, b, c;
+    std::string target;   // Label or function name for 't' operands
+    std::string label;    // Non-empty: defines this label, op is unused
+  };
+
+  void gen(Parser::TreeNode* node);
+  void add(int op, long long a = 0, long long b = 0, long long c = 0,
+	   const std::string& target = "");
+  void fuse();
+  void encode();
+  void putVarint(long long v);
+
+  std::vector<Instr> m_instrs;
+  size_t m_enter;       // Index of the current function's ENTER
+  int m_varcnt;
+};
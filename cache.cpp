@@ -0,0 +1,365 @@
+#include "cache.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+const long long CompileCache::defaultLimit = 64LL << 20;
+
+// Bumped whenever the entry layout or key changes
+static const char CACHE_FORMAT[] = "microc-cache-1";
+
+// FNV-1a, 128 bits
+typedef unsigned __int128 Hash;
+
+static Hash fnvBasis()
+{
+  return (static_cast<Hash>(0x6c62272e07bb0142ULL) << 64) | 0x62b821756295c58dULL;
+}
+
+static Hash fnv(Hash h, const char* p, size_t n)
+{
+  const Hash prime = (static_cast<Hash>(1) << 88) | 0x13b;
+
+  for (size_t i = 0; i < n; i++)
+    {
+      h ^= static_cast<unsigned char>(p[i]);
+      h *= prime;
+    }
+  return h;
+}
+
+static Hash fnv(Hash h, const std::string& s)
+{
+  // The terminator keeps "ab"+"c" and "a"+"bc" apart
+  return fnv(h, s.c_str(), s.size() + 1);
+}
+
+static std::string hex(Hash h)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string s(32, '0');
+
+  for (int i = 31; i >= 0; i--, h >>= 4)
+    s[i] = digits[static_cast<int>(h & 15)];
+  return s;
+}
+
+static bool readFile(const std::string& name, std::string& data)
+{
+  std::ifstream in(name.c_str(), std::ios::in | std::ios::binary);
+  if (!in)
+    return false;
+
+  std::ostringstream s;
+  s << in.rdbuf();
+  if (in.bad())
+    return false;
+  data = s.str();
+  return true;
+}
+
+/*
+  Identifies the compiler for the key by the running executable's size
+  and modification time, so a rebuilt microc never reuses an old one's
+  output.  Hashing the binary itself would cost more than a cached
+  compile saves.
+*/
+std::string CompileCache::compilerVersion()
+{
+  struct stat st;
+  std::ostringstream version;
+
+  version << __DATE__ " " __TIME__;
+  if (stat("/proc/self/exe", &st) == 0)
+    version << " " << st.st_size << " " << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec;
+  return version.str();
+}
+
+// mkdir -p
+static bool makeDirs(const std::string& dir)
+{
+  struct stat st;
+
+  if (stat(dir.c_str(), &st) == 0)
+    return S_ISDIR(st.st_mode);
+
+  size_t slash = dir.rfind('/');
+  if (slash != std::string::npos && slash > 0 && !makeDirs(dir.substr(0, slash)))
+    return false;
+  return mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST;
+}
+
+// An entry's file name is its key: 32 hex digits
+static bool isEntry(const char* name)
+{
+  if (strlen(name) != 32)
+    return false;
+  for (int i = 0; i < 32; i++)
+    if (!isxdigit(static_cast<unsigned char>(name[i])))
+      return false;
+  return true;
+}
+
+// Holds the directory's lock file exclusively for its lifetime
+class CompileCache::Lock
+{
+public:
+  Lock(CompileCache& cache)
+  {
+    m_fd = open(cache.path("lock").c_str(), O_RDWR | O_CREAT, 0666);
+    if (m_fd >= 0)
+      while (flock(m_fd, LOCK_EX) < 0 && errno == EINTR)
+	;
+  }
+
+  ~Lock()
+  {
+    if (m_fd >= 0)
+      close(m_fd);
+  }
+
+private:
+  int m_fd;
+};
+
+CompileCache::CompileCache(const std::string& dirx, long long limitx)
+  : dir(dirx), limit(limitx)
+{
+  m_ready = makeDirs(dir);
+}
+
+// $MICROC_CACHE, else $XDG_CACHE_HOME/microc, else ~/.cache/microc
+std::string CompileCache::defaultDir()
+{
+  const char* env = getenv("MICROC_CACHE");
+  if (env && *env)
+    return env;
+  env = getenv("XDG_CACHE_HOME");
+  if (env && *env)
+    return std::string(env) + "/microc";
+  env = getenv("HOME");
+  return std::string(env && *env ? env : "/tmp") + "/.cache/microc";
+}
+
+// A byte count with an optional K, M or G suffix; -1 if malformed
+long long CompileCache::parseSize(const char* text)
+{
+  char* end;
+  long long n = strtoll(text, &end, 10);
+
+  if (end == text || n < 0)
+    return -1;
+  switch (*end)
+    {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+    }
+  return *end ? -1 : n;
+}
+
+std::string CompileCache::path(const std::string& name)
+{
+  return dir + "/" + name;
+}
+
+// 32 hex digits of the hash of data
+std::string CompileCache::digest(const std::string& data)
+{
+  return hex(fnv(fnvBasis(), data));
+}
+
+std::string CompileCache::key(const std::string& source, const std::string& options)
+{
+  Hash h = fnvBasis();
+
+  h = fnv(h, CACHE_FORMAT);
+  h = fnv(h, compilerVersion());
+  h = fnv(h, options);
+  h = fnv(h, source);
+  return hex(h);
+}
+
+/*
+  Reads the entry for key into output and marks it recently used.  A
+  missing or unreadable entry is a miss; either way the count is updated.
+*/
+bool CompileCache::lookup(const std::string& key, std::string& output)
+{
+  if (!m_ready)
+    return false;
+
+  std::string name = path(key);
+  bool hit = readFile(name, output);
+  if (hit)
+    utimes(name.c_str(), NULL);
+
+  Lock lock(*this);
+  Stats stats = readStats();
+  if (hit)
+    stats.hits++;
+  else
+    stats.misses++;
+  writeStats(stats);
+  return hit;
+}
+
+/*
+  Writes the entry through a temporary file and a rename, then evicts
+  if the cache has grown past its limit.  A failure to write only means
+  the next compile misses again, so it is not reported.
+*/
+void CompileCache::store(const std::string& key, const std::string& output)
+{
+  if (!m_ready)
+    return;
+
+  std::string tmp = path("tmp-XXXXXX");
+  std::vector<char> name(tmp.begin(), tmp.end());
+  name.push_back(0);
+
+  int fd = mkstemp(&name[0]);
+  if (fd < 0)
+    return;
+  size_t done = 0;
+  while (done < output.size())
+    {
+      ssize_t n = write(fd, output.data() + done, output.size() - done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	break;
+      done += n;
+    }
+  fchmod(fd, 0644);
+  if (close(fd) < 0 || done < output.size())
+    {
+      unlink(&name[0]);
+      return;
+    }
+
+  Lock lock(*this);
+  std::string entry = path(key);
+  struct stat st;
+  long long replaced = stat(entry.c_str(), &st) == 0 ? st.st_size : 0;
+  if (rename(&name[0], entry.c_str()) < 0)
+    {
+      unlink(&name[0]);
+      return;
+    }
+
+  Stats stats = readStats();
+  stats.bytes += output.size() - replaced;
+  if (stats.bytes > limit)
+    stats.bytes = evict(limit / 10 * 9);
+  writeStats(stats);
+}
+
+/*
+  Removes the least recently used entries until the rest fit in target
+  bytes and returns their size.  store() evicts down to 90% of the
+  limit, so a full cache does not rescan the directory on every store.
+  Temporary files an interrupted store left behind are removed once
+  they are an hour old.  Called with the lock held.
+*/
+long long CompileCache::evict(long long target)
+{
+  struct Entry {
+    std::string name;
+    long long size;
+    struct timespec used;
+  };
+  std::vector<Entry> entries;
+  long long total = 0;
+  time_t now = time(NULL);
+
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return 0;
+  while (struct dirent* e = readdir(d))
+    {
+      std::string name = path(e->d_name);
+      struct stat st;
+
+      if (stat(name.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+	continue;
+      if (!strncmp(e->d_name, "tmp-", 4) && now - st.st_mtime > 3600)
+	unlink(name.c_str());
+      else if (isEntry(e->d_name))
+	{
+	  Entry entry = { name, st.st_size, st.st_mtim };
+	  entries.push_back(entry);
+	  total += st.st_size;
+	}
+    }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+      if (a.used.tv_sec != b.used.tv_sec)
+	return a.used.tv_sec < b.used.tv_sec;
+      return a.used.tv_nsec < b.used.tv_nsec;
+    });
+  for (size_t i = 0; i < entries.size() && total > target; i++)
+    if (unlink(entries[i].name.c_str()) == 0)
+      total -= entries[i].size;
+  return total;
+}
+
+CompileCache::Stats CompileCache::readStats()
+{
+  Stats stats = { 0, 0, 0 };
+  std::ifstream in(path("stats").c_str());
+
+  in >> stats.hits >> stats.misses >> stats.bytes;
+  return stats;
+}
+
+void CompileCache::writeStats(const Stats& stats)
+{
+  std::ofstream out(path("stats").c_str(), std::ios::out | std::ios::trunc);
+
+  out << stats.hits << " " << stats.misses << " " << stats.bytes << std::endl;
+}
+
+void CompileCache::printStats(std::ostream& os)
+{
+  Stats stats = { 0, 0, 0 };
+  if (m_ready)
+    {
+      Lock lock(*this);
+      stats = readStats();
+    }
+  long long lookups = stats.hits + stats.misses;
+
+  os << "cache directory: " << dir << "\n"
+     << "size:            " << stats.bytes << " of " << limit << " bytes\n"
+     << "hits:            " << stats.hits << "\n"
+     << "misses:          " << stats.misses << "\n"
+     << "hit rate:        " << (lookups ? stats.hits * 100 / lookups : 0) << "%" << std::endl;
+}
+
+// Removes every entry and resets the statistics
+void CompileCache::clear()
+{
+  if (!m_ready)
+    return;
+
+  Lock lock(*this);
+  evict(0);
+  Stats stats = { 0, 0, 0 };
+  writeStats(stats);
+}
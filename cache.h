@@ -0,0 +1,51 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+// On-disk cache of compiler output.  An entry is keyed by a hash of the
+// source bytes, the compiler itself and the options that change the
+// output, and holds exactly what the compilation wrote: assembly, C or
+// an ELF object.
+//
+// Entries are written to a temporary file and renamed into place, so a
+// reader sees a whole entry or none, and any number of processes and
+// threads may share a directory.  A hit refreshes the entry's mtime; when
+// the entries outgrow the size limit the least recently used are removed.
+// The hit and miss counts and the total size live in a small stats file
+// that is only touched under an flock on the directory's lock file.
+class CompileCache
+{
+public:
+  CompileCache(const std::string& dirx, long long limitx);
+
+  std::string key(const std::string& source, const std::string& options);
+  bool lookup(const std::string& key, std::string& output);
+  void store(const std::string& key, const std::string& output);
+  void printStats(std::ostream& os);
+  void clear();
+
+  static std::string digest(const std::string& data);
+  static std::string compilerVersion();
+  static std::string defaultDir();
+  static long long parseSize(const char* text);
+  static const long long defaultLimit;
+
+  std::string dir;
+  long long limit;    // Bytes
+
+private:
+  class Lock;
+  struct Stats {
+    long long hits;
+    long long misses;
+    long long bytes;
+  };
+
+  std::string path(const std::string& name);
+  Stats readStats();
+  void writeStats(const Stats& stats);
+  long long evict(long long target);
+
+  bool m_ready;       // The directory exists
+};
@@ -0,0 +1,298 @@
+#include "cgen.h"
+#include "stats.h"
+#include "compileerror.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static std::string itos(long long i)
+{
+  return std::to_string(i);
+}
+
+// Strips the colon from a LABEL node's text
+static std::string labelName(const std::string& val)
+{
+  if (!val.empty() && val[val.size() - 1] == ':')
+    return val.substr(0, val.size() - 1);
+  return val;
+}
+
+CGen::CGen(std::ostream& outx) : out(outx), m_current(0), m_temps(0), m_varcnt(0), m_returned(false)
+{
+
+}
+
+CGen::~CGen()
+{
+
+}
+
+/*
+  First pass: the functions in order with their parameter counts, needed
+  for the prototypes and to map PARAM onto C parameters
+*/
+void CGen::collect(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return;
+
+  collect(node->leftChild);
+  collect(node->rightChild);
+
+  if (node->op == Parser::FUNC)
+    {
+      Function f;
+      f.name = node->val;
+      f.nparams = 0;
+      m_functions.push_back(f);
+    }
+  else if (node->op == Parser::PARAM)
+    m_functions.back().nparams++;
+}
+
+std::string CGen::pop()
+{
+  if (m_stack.empty())
+    throw CompileError("In cgen: operand stack underflow");
+
+  std::string e = m_stack.back();
+  m_stack.pop_back();
+  return e;
+}
+
+/*
+  The C type printf reads for each conversion of fmt: int, or long with
+  an 'l', and unsigned for o, u, x and X.  Arguments are cast to it, as
+  the native code passes a 64-bit value printf reads only as wide as that.
+*/
+static std::vector<std::string> argumentTypes(const std::string& fmt)
+{
+  std::vector<std::string> types;
+
+  for (size_t i = fmt.find('%'); i != std::string::npos; i = fmt.find('%', i))
+    {
+      i++;
+      if (i < fmt.size() && fmt[i] == '%')
+	{
+	  i++;
+	  continue;
+	}
+      while (i < fmt.size() && strchr("-+ #0123456789.", fmt[i]))
+	i++;
+      bool isLong = false;
+      for (; i < fmt.size() && (fmt[i] == 'l' || fmt[i] == 'h'); i++)
+	isLong |= fmt[i] == 'l';
+      bool isUnsigned = i < fmt.size() && strchr("ouxX", fmt[i]);
+      types.push_back(std::string(isUnsigned ? "unsigned " : "") + (isLong ? "long" : "int"));
+    }
+  return types;
+}
+
+std::string CGen::binary(const char* op)
+{
+  std::string b = pop();
+  std::string a = pop();
+  return "(" + a + " " + op + " " + b + ")";
+}
+
+// A binary operation done on uint64_t, where overflow wraps
+std::string CGen::wrapping(const char* op)
+{
+  std::string b = pop();
+  std::string a = pop();
+  return "(int64_t)((uint64_t)" + a + " " + op + " (uint64_t)" + b + ")";
+}
+
+/*
+  Writes out the function collected so far.  The slots and call
+  temporaries are only known at this point, so the body is buffered.
+*/
+void CGen::endFunction()
+{
+  if (m_current == 0)
+    return;
+
+  Function& f = m_functions[m_current - 1];
+
+  out << "static int64_t mc_" << f.name << "(";
+  for (int k = 0; k < f.nparams; k++)
+    out << (k ? ", " : "") << "int64_t p" << k;
+  out << (f.nparams ? ")\n{\n" : "void)\n{\n");
+
+  for (std::set<long long>::iterator it = m_slots.begin(); it != m_slots.end(); ++it)
+    out << "  int64_t v" << *it << " = 0;\n";
+  for (int k = 0; k < m_temps; k++)
+    out << "  int64_t t" << k << ";\n";
+
+  // A function can run off its end; one that ends in a return cannot
+  out << m_body.str() << (m_returned ? "" : "  return 0;\n") << "}\n\n";
+
+  m_body.str("");
+  m_slots.clear();
+  m_stack.clear();
+  m_temps = 0;
+  m_returned = false;
+}
+
+void CGen::walk(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return;
+
+  walk(node->leftChild);
+  walk(node->rightChild);
+
+  std::string e;
+  std::string v = "v" + node->val;
+
+  switch (node->op)
+    {
+    case Parser::SEQ:
+      break;
+    case Parser::LOADV:
+      m_slots.insert(atoll(node->val.c_str()));
+      m_stack.push_back(v);
+      break;
+    case Parser::LOADL:
+      e = node->val;
+      if (node->literal() > 2147483647LL)
+	e += "LL";
+      m_stack.push_back(e);
+      break;
+    case Parser::STORE:
+      m_slots.insert(atoll(node->val.c_str()));
+      m_body << "  " << v << " = " << pop() << ";\n";
+      break;
+    case Parser::ADD:
+      m_stack.push_back(wrapping("+"));
+      break;
+    case Parser::SUB:
+      m_stack.push_back(wrapping("-"));
+      break;
+    case Parser::MULT:
+      m_stack.push_back(wrapping("*"));
+      break;
+    case Parser::DIV:
+      m_stack.push_back(binary("/"));
+      break;
+    case Parser::AND:
+      m_stack.push_back(binary("&"));
+      break;
+    case Parser::OR:
+      m_stack.push_back(binary("|"));
+      break;
+    case Parser::ISEQ:
+      m_stack.push_back(binary("=="));
+      break;
+    case Parser::ISNE:
+      m_stack.push_back(binary("!="));
+      break;
+    case Parser::ISLT:
+      m_stack.push_back(binary("<"));
+      break;
+    case Parser::ISLE:
+      m_stack.push_back(binary("<="));
+      break;
+    case Parser::ISGT:
+      m_stack.push_back(binary(">"));
+      break;
+    case Parser::ISGE:
+      m_stack.push_back(binary(">="));
+      break;
+    case Parser::LABEL:
+      m_body << labelName(node->val) << ":;\n";
+      break;
+    case Parser::JUMP:
+      m_body << "  goto " << node->val << ";\n";
+      break;
+    case Parser::JUMPF:
+      m_body << "  if (!" << pop() << ") goto " << node->val << ";\n";
+      break;
+    case Parser::JUMPT:
+      m_body << "  if (" << pop() << ") goto " << node->val << ";\n";
+      break;
+    case Parser::CALL:
+      {
+	// The argument byte count is always a literal.  Calls go into a
+	// temporary right away so side effects stay in source order.
+	int nargs = atoi(pop().c_str()) / 8;
+	std::vector<std::string> args(nargs);
+	for (int k = nargs - 1; k >= 0; k--)
+	  args[k] = pop();
+
+	e = "t" + itos(m_temps++);
+	m_body << "  " << e << " = mc_" << node->val << "(";
+	for (int k = 0; k < nargs; k++)
+	  m_body << (k ? ", " : "") << args[k];
+	m_body << ");\n";
+	m_stack.push_back(e);
+      }
+      break;
+    case Parser::FUNC:
+      endFunction();
+      m_current++;
+      m_varcnt = 0;
+      break;
+    case Parser::RET:
+      m_body << "  return " << pop() << ";\n";
+      break;
+    case Parser::PRINTF:
+      {
+	int nargs = node->paramCount;
+	std::vector<std::string> args(nargs);
+	for (int k = nargs - 1; k >= 0; k--)
+	  args[k] = pop();
+
+	std::vector<std::string> types = argumentTypes(node->val);
+	m_body << "  printf(\"" << node->val << "\"";
+	for (int k = 0; k < nargs; k++)
+	  m_body << ", (" << (k < (int)types.size() ? types[k] : "long") << ")" << args[k];
+	m_body << ");\n";
+      }
+      break;
+    case Parser::PARAM:
+      {
+	// PARAM n reads the n-th argument counting back from the last one
+	// pushed, as the -O0 frame layout does
+	Function& f = m_functions[m_current - 1];
+	++m_varcnt;
+	m_slots.insert(m_varcnt);
+	m_body << "  v" << m_varcnt << " = p" << f.nparams - node->paramCount << ";\n";
+      }
+      break;
+    default:
+      throw CompileError("In cgen: Unknown operation " + itos(node->op));
+    }
+
+  if (node->op != Parser::SEQ && node->op != Parser::FUNC)
+    m_returned = node->op == Parser::RET;
+}
+
+void CGen::gen(Parser::TreeNode* program)
+{
+  STAT_TIMER(CODEGEN);
+  m_functions.clear();
+  collect(program);
+
+  out << "/* Generated by microc */\n"
+      << "#include <stdint.h>\n"
+      << "#include <stdio.h>\n\n";
+
+  for (size_t i = 0; i < m_functions.size(); i++)
+    {
+      out << "static int64_t mc_" << m_functions[i].name << "(";
+      for (int k = 0; k < m_functions[i].nparams; k++)
+	out << (k ? ", " : "") << "int64_t";
+      out << (m_functions[i].nparams ? ");\n" : "void);\n");
+    }
+  out << "\n";
+
+  m_current = 0;
+  walk(program);
+  endFunction();
+
+  out << "int main(void)\n{\n  return (int)mc_main();\n}\n";
+  out.flush();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "parser.h"
+
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Emits portable C99 for a program, as an alternative to genasm.  The tree
+// is walked in the same post-order as geninst, but the operand stack is
+// kept at compile time as C expressions, so only stores, branches, calls
+// and printf become statements.  Labels and jumps map to C labels and
+// goto; gcc rebuilds the loops from them.
+//
+// Every .mc function becomes "static int64_t mc_<name>(...)" and each slot
+// an int64_t local v<slot>.  A C main calls mc_main.  Addition,
+// subtraction and multiplication go through uint64_t, so they wrap as
+// in the other backends instead of overflowing, which C leaves undefined.
+class CGen
+{
+public:
+  CGen(std::ostream& outx);
+  ~CGen();
+
+  void gen(Parser::TreeNode* program);
+
+private:
+  class Function
+  {
+  public:
+    std::string name;
+    int nparams;
+  };
+
+  void collect(Parser::TreeNode* node);
+  void walk(Parser::TreeNode* node);
+  void endFunction();
+  std::string pop();
+  std::string binary(const char* op);
+  std::string wrapping(const char* op);
+
+  std::ostream& out;
+  std::vector<Function> m_functions;
+  size_t m_current;             // Index into m_functions, +1
+  std::vector<std::string> m_stack;
+  std::ostringstream m_body;
+  std::set<long long> m_slots;
+  int m_temps;
+  int m_varcnt;
+  bool m_returned;          // The body so far ends in a return
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Raised for any error that ends a compilation: syntax errors (all the
+// parser found, one per line), internal errors in a backend, and failures
+// while running the program under --run or --vm.  The library never
+// exits the process; CompilationContext catches this and reports the
+// message on its own error stream.
+class CompileError : public std::runtime_error
+{
+public:
+  CompileError(const std::string& message) : std::runtime_error(message) {}
+};
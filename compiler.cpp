@@ -0,0 +1,590 @@
+#include "compiler.h"
+#include "lexer.h"
+#include "unroller.h"
+#include "irbuilder.h"
+#include "iropt.h"
+#include "irgen.h"
+#include "elfwriter.h"
+#include "jit.h"
+#include "vm.h"
+#include "cgen.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+CompileOptions::CompileOptions()
+{
+  optLevel = 0;
+  unrollFactor = 4;
+  unrollTrips = 8;
+  dumpIR = false;
+  licm = true;
+  licmReport = false;
+  framePointer = false;
+  object = false;
+  run = false;
+  vm = false;
+  dumpBytecode = false;
+  emitC = false;
+  mcrt = false;
+  stream = false;
+  module = false;
+}
+
+/*
+  Applies one command line argument that selects how the source is
+  compiled; false if it is not one of those
+*/
+bool CompileOptions::parse(const char* arg)
+{
+  if (!strcmp(arg, "-O0"))
+    optLevel = 0;
+  else if (!strcmp(arg, "-O") || !strcmp(arg, "-O1"))
+    optLevel = 1;
+  else if (!strncmp(arg, "--unroll=", 9))
+    unrollFactor = atoi(arg + 9);
+  else if (!strncmp(arg, "--unroll-full=", 14))
+    unrollTrips = atoi(arg + 14);
+  else if (!strcmp(arg, "--dump-ir"))
+    dumpIR = true;
+  else if (!strcmp(arg, "--no-licm"))
+    licm = false;
+  else if (!strcmp(arg, "--licm-report"))
+    licmReport = true;
+  else if (!strcmp(arg, "-fno-omit-frame-pointer"))
+    framePointer = true;
+  else if (!strcmp(arg, "-fomit-frame-pointer"))
+    framePointer = false;
+  else if (!strcmp(arg, "-c"))
+    object = true;
+  else if (!strcmp(arg, "--run"))
+    run = true;
+  else if (!strcmp(arg, "--vm"))
+    vm = true;
+  else if (!strcmp(arg, "--dump-bytecode"))
+    dumpBytecode = true;
+  else if (!strcmp(arg, "--emit=c"))
+    emitC = true;
+  else if (!strcmp(arg, "--emit=asm"))
+    emitC = false;
+  else if (!strcmp(arg, "--runtime=mcrt"))
+    mcrt = true;
+  else if (!strcmp(arg, "--runtime=libc"))
+    mcrt = false;
+  else if (!strcmp(arg, "--stream"))
+    stream = true;
+  else if (!strcmp(arg, "--module"))
+    module = true;
+  else
+    return false;
+  return true;
+}
+
+CompilationContext::CompilationContext(std::istream& inx, std::ostream& outx, std::ostream& errx,
+				       const CompileOptions& optsx)
+  : failed(false), pool(NULL), cache(NULL), resident(NULL), stats(NULL), cached(false), in(inx), out(outx), err(errx), opts(optsx)
+{
+
+}
+
+// Makes a node pool current on this thread for its lifetime
+class PoolScope
+{
+public:
+  PoolScope(Parser::NodePool& pool) : m_previous(Parser::NodePool::current)
+  {
+    Parser::NodePool::current = &pool;
+  }
+
+  ~PoolScope()
+  {
+    Parser::NodePool::current = m_previous;
+  }
+
+private:
+  Parser::NodePool* m_previous;
+};
+
+// One function generated on the pool
+class CompilationContext::FunctionJob
+{
+public:
+  FunctionJob(Parser& parent) : shard(parent), failed(false) {}
+
+  Parser shard;
+  CompileStats stats;                     // Added to the caller's, if it keeps any
+  std::string dump;                       // --dump-ir text
+  std::vector<LICM::LoopReport> loops;    // For --licm-report
+  bool failed;
+  std::string error;
+};
+
+/*
+  Runs gen for functions 0..count-1 as tasks on the pool, each with its
+  own shard, then merges the shards into parser in source order, flushing
+  after each one if asked.  IR dumps and LICM reports are collected in the
+  same order.  An error in any function is rethrown here, the first in
+  source order.
+*/
+void CompilationContext::genFunctions(Parser& parser, size_t count, bool flush,
+				      const std::function<void(FunctionJob&, size_t)>& gen,
+				      std::vector<LICM::LoopReport>* loops)
+{
+  std::vector<FunctionJob*> jobs;
+  ThreadPool::Group group;
+  CompileStats* stats = CompileStats::current;
+
+  for (size_t i = 0; i < count; i++)
+    jobs.push_back(new FunctionJob(parser));
+  for (size_t i = 0; i < count; i++)
+    {
+      FunctionJob* job = jobs[i];
+      pool->submit([job, i, &gen, stats]() {
+	  CompileStats::Scope scope(stats ? &job->stats : NULL);
+	  try
+	    {
+	      gen(*job, i);
+	    }
+	  catch (CompileError& e)
+	    {
+	      job->failed = true;
+	      job->error = e.what();
+	    }
+	}, &group);
+    }
+  pool->wait(group);
+
+  std::string error;
+  for (size_t i = 0; i < count; i++)
+    {
+      if (jobs[i]->failed && error.empty())
+	error = jobs[i]->error;
+      if (error.empty())
+	{
+	  err << jobs[i]->dump;
+	  if (loops)
+	    loops->insert(loops->end(), jobs[i]->loops.begin(), jobs[i]->loops.end());
+	  parser.merge(jobs[i]->shard);
+	  if (flush)
+	    parser.flushCode();
+	}
+      if (stats)
+	stats->add(jobs[i]->stats);
+      delete jobs[i];
+    }
+  if (!error.empty())
+    throw CompileError(error);
+}
+
+CompilationContext::~CompilationContext()
+{
+
+}
+
+// Compiles with the stats current, if there are any, and times it
+int CompilationContext::compile()
+{
+  CompileStats::Scope scope(stats);
+  long long start = stats ? CompileStats::now() : 0;
+  int status;
+
+  if (cache && !opts.dumpIR && !opts.licmReport && !opts.run && !opts.vm && !opts.dumpBytecode)
+    status = compileCached();
+  else
+    status = compileSource();
+  if (stats)
+    stats->total += CompileStats::now() - start;
+  return status;
+}
+
+/*
+  Runs the compilation with this context's node pool current on the
+  calling thread, and turns a CompileError into a message on err
+*/
+int CompilationContext::compileSource()
+{
+  PoolScope scope(m_nodes);
+
+  try
+    {
+      return run();
+    }
+  catch (CompileError& e)
+    {
+      failed = true;
+      error = e.what();
+      err << error << std::endl;
+      return 1;
+    }
+}
+
+/*
+  The options that change the output, for the cache key.  -j does not:
+  parallel output is the same as serial.
+*/
+std::string CompilationContext::cacheOptions()
+{
+  std::ostringstream key;
+
+  key << "O" << opts.optLevel << " unroll=" << opts.unrollFactor << "," << opts.unrollTrips
+      << " licm=" << opts.licm << " fp=" << opts.framePointer << " c=" << opts.object
+      << " emitc=" << opts.emitC << " mcrt=" << opts.mcrt
+      << " stream=" << opts.stream << " module=" << opts.module;
+  return key.str();
+}
+
+/*
+  Looks the source up in the cache; on a miss compiles it with a
+  context of its own into a buffer, stores the buffer if the compile
+  succeeded and copies it to out
+*/
+int CompilationContext::compileCached()
+{
+  std::ostringstream source;
+  {
+    STAT_TIMER(READ);
+    source << in.rdbuf();
+  }
+  std::string key = cache->key(source.str(), cacheOptions());
+  std::string output;
+
+  cached = cache->lookup(key, output);
+  if (!cached) {
+    std::istringstream src(source.str());
+    std::ostringstream dst;
+    CompilationContext context(src, dst, err, opts);
+    context.pool = pool;
+    int status = context.compile();
+    if (context.failed) {
+      failed = true;
+      error = context.error;
+      return status;
+    }
+    output = dst.str();
+    cache->store(key, output);
+  }
+  STAT_TIMER(OUTPUT);
+  if (cached)     // A miss counted them as it compiled
+    STAT_COUNT(BYTES, output.size());
+  out.write(output.data(), output.size());
+  return 0;
+}
+
+/*
+  Optimizes and generates the functions one after the other, deleting
+  each when done
+*/
+void CompilationContext::genIR(Parser& parser, std::vector<IRFunction*>& functions,
+			       IROptimizer& optimizer, IRGen& irgen)
+{
+  size_t i = 0;
+
+  try
+    {
+      for (; i < functions.size(); i++)
+	{
+	  optimizer.run(functions[i]);
+	  if (opts.dumpIR)
+	    functions[i]->print(err);
+	  irgen.gen(functions[i]);
+	  if (!opts.object && !opts.run)
+	    parser.flushCode();
+	  delete functions[i];
+	}
+    }
+  catch (...)
+    {
+      for (; i < functions.size(); i++)
+	delete functions[i];
+      throw;
+    }
+}
+
+/*
+  Streaming pipeline: each function is parsed, generated and flushed
+  before the next one is read, and its tree is freed right away, so only
+  the string pool and symbol table grow with the input.  -O1 output is
+  the same as the whole-program pipeline's.  At -O0 the labels made
+  during code generation interleave with the parser's and get different
+  numbers.  After a syntax error the rest is only parsed, for its
+  diagnostics; what was flushed before it stays in the output.
+*/
+int CompilationContext::stream(Parser& parser)
+{
+  Unroller unroller(opts.unrollFactor, opts.unrollTrips);
+  IROptimizer optimizer;
+  IRGen irgen(parser);
+  optimizer.hoist = opts.licm;
+  irgen.omitFramePointer = !opts.framePointer;
+
+  parser.genheader();
+  do {
+    Parser::NodePool nodes;
+    PoolScope scope(nodes);
+    Parser::TreeNode* function = parser.function();
+
+    if (parser.failed())
+      continue;
+    if (opts.optLevel == 0) {
+      parser.geninst(function);
+      if (!opts.object && !opts.run)
+	parser.flushCode();
+    }
+    else {
+      unroller.run(function);
+      IRBuilder builder;
+      std::vector<IRFunction*> functions = builder.build(function);
+      genIR(parser, functions, optimizer, irgen);
+    }
+  } while (!parser.atEnd());
+  parser.reportErrors();
+  if (opts.licmReport)
+    optimizer.licm.report(err);
+
+  if (opts.run)
+    return runProgram(parser);
+  if (opts.object)
+    writeObject(parser);
+  else
+    parser.gendata();
+  return 0;
+}
+
+/*
+  Incremental build: functions whose tokens are unchanged since the
+  last build reuse their code, the rest are compiled one by one, and the
+  program is linked from both.  The output is the same as a
+  whole-program compile's.  The last build is the sidecar's, or with a
+  resident state whatever it kept in memory.
+*/
+int CompilationContext::incremental()
+{
+  std::ostringstream source;
+  {
+    STAT_TIMER(READ);
+    source << in.rdbuf();
+  }
+
+  IncrementalState sidecar(opts.incremental, CompileCache::compilerVersion() + "\n" + cacheOptions());
+  IncrementalState& state = resident ? *resident : sidecar;
+  std::vector<IncrementalState::Chunk> chunks;
+  if (!resident)
+    sidecar.load();
+  state.rechunk(source.str(), chunks);
+
+  // Every chunk is compiled, so all their diagnostics are reported
+  std::string errors;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    IncrementalState::Function f;
+    f.fingerprint = chunks[i].fingerprint;
+    if (const IncrementalState::Function* old = state.find(f.fingerprint)) {
+      f = *old;
+      state.reused++;
+    }
+    else {
+      try {
+	compileFunction(chunks[i], f);
+      }
+      catch (CompileError& e) {
+	errors += (errors.empty() ? "" : "\n") + std::string(e.what());
+	continue;
+      }
+    }
+    state.functions.push_back(f);
+  }
+  if (!errors.empty()) {
+    if (resident)
+      resident->commit(false);
+    throw CompileError(errors);
+  }
+
+  std::istringstream none;
+  Lexer lexer(none);
+  Parser parser(lexer, out);
+  parser.specializePrintf = opts.mcrt;
+  parser.genheader();
+  state.link(parser);
+  parser.gendata();
+  if (resident)
+    resident->commit(true);
+  else
+    sidecar.save();
+  return 0;
+}
+
+/*
+  Compiles one chunk of the source on its own into f, keeping its code
+  as text with its own label and fmt numbers
+*/
+void CompilationContext::compileFunction(const IncrementalState::Chunk& chunk, IncrementalState::Function& f)
+{
+  std::istringstream src(chunk.text);
+  std::ostringstream code;
+  Parser::NodePool nodes;
+  PoolScope scope(nodes);
+  Lexer lexer(src);
+  lexer.m_line = chunk.line;
+
+  {
+    Parser parser(lexer, code);
+    parser.specializePrintf = opts.mcrt;
+    Parser::TreeNode* program = parser.compilationunit();
+    f.parseLabels = parser.labelCount();
+
+    if (opts.optLevel == 0)
+      parser.geninst(program);
+    else {
+      Unroller unroller(opts.unrollFactor, opts.unrollTrips);
+      unroller.run(program);
+      IRBuilder builder;
+      IROptimizer optimizer;
+      IRGen irgen(parser);
+      optimizer.hoist = opts.licm;
+      irgen.omitFramePointer = !opts.framePointer;
+      std::vector<IRFunction*> functions = builder.build(program);
+      genIR(parser, functions, optimizer, irgen);
+    }
+    parser.flushCode();
+    f.codeLabels = parser.labelCount() - f.parseLabels;
+    for (int i = 0; i < parser.formatCount(); i++)
+      f.strings.push_back(parser.format(i));
+  }
+  f.code = code.str();
+}
+
+/*
+  Encodes the buffered code straight to an ELF object instead of printing
+  it for nasm
+*/
+void CompilationContext::writeObject(Parser& parser)
+{
+  ElfWriter elf(parser.mir);
+  for (int i = 0; i < parser.formatCount(); i++)
+    elf.addString("fmt" + std::to_string(static_cast<long long>(i + 1)), parser.format(i));
+  if (opts.module)
+    for (size_t i = 0; i < parser.defined.size(); i++)
+      elf.addGlobal(parser.defined[i]);
+  else
+    elf.addGlobal("main");
+  elf.write(out);
+}
+
+/*
+  Compiles the buffered code into memory and calls main; its result is
+  the exit status, as if the program had been linked and run
+*/
+int CompilationContext::runProgram(Parser& parser)
+{
+  JIT jit(parser.mir);
+  for (int i = 0; i < parser.formatCount(); i++)
+    jit.addString("fmt" + std::to_string(static_cast<long long>(i + 1)), parser.format(i));
+  jit.bind("printf", reinterpret_cast<void*>(&printf));
+  return static_cast<int>(jit.run("main"));
+}
+
+int CompilationContext::run()
+{
+  if (!opts.incremental.empty() || resident)
+    return incremental();
+
+  Lexer lexer(in);
+  Parser parser(lexer, out);
+  // The JIT binds printf to the host libc, which has no mcrt primitives
+  parser.specializePrintf = opts.mcrt && !opts.run;
+  parser.module = opts.module;
+  if (opts.stream && !opts.vm && !opts.dumpBytecode && !opts.emitC)
+    return stream(parser);
+  Parser::TreeNode* program = parser.compilationunit();
+
+  // Tree-level backends; -O1 still unrolls the tree first
+  if (opts.vm || opts.dumpBytecode || opts.emitC) {
+    if (opts.optLevel > 0) {
+      Unroller unroller(opts.unrollFactor, opts.unrollTrips);
+      unroller.run(program);
+    }
+    if (opts.emitC) {
+      CGen cgen(out);
+      cgen.gen(program);
+      return 0;
+    }
+    Bytecode bc;
+    bc.compile(program);
+    if (opts.dumpBytecode)
+      bc.disassemble(err);
+    if (!opts.vm)
+      return 0;
+    VM vm(bc);
+    return static_cast<int>(vm.run());
+  }
+
+  if (opts.optLevel == 0) {
+    parser.genheader();
+    if (pool && parser.functions.size() > 1)
+      genFunctions(parser, parser.functions.size(), false, [&parser](FunctionJob& job, size_t i) {
+	  job.shard.geninst(parser.functions[i]);
+	});
+    else
+      parser.geninst(program);
+    if (opts.run)
+      return runProgram(parser);
+    if (opts.object)
+      writeObject(parser);
+    else
+      parser.gendata();
+    return 0;
+  }
+
+  // -O1: tree-level unrolling, then the SSA middle end
+  Unroller unroller(opts.unrollFactor, opts.unrollTrips);
+  unroller.run(program);
+
+  IRBuilder builder;
+  IROptimizer optimizer;
+  IRGen irgen(parser);
+  std::vector<IRFunction*> functions = builder.build(program);
+  optimizer.hoist = opts.licm;
+  irgen.omitFramePointer = !opts.framePointer;
+
+  parser.genheader();
+  if (pool && functions.size() > 1) {
+    const CompileOptions& o = opts;
+    try {
+      genFunctions(parser, functions.size(), !opts.object && !opts.run,
+		   [&o, &functions](FunctionJob& job, size_t k) {
+	  IROptimizer optimizer;
+	  IRGen irgen(job.shard);
+	  optimizer.hoist = o.licm;
+	  irgen.omitFramePointer = !o.framePointer;
+	  optimizer.run(functions[k]);
+	  if (o.dumpIR) {
+	    std::ostringstream dump;
+	    functions[k]->print(dump);
+	    job.dump = dump.str();
+	  }
+	  irgen.gen(functions[k]);
+	  job.loops = optimizer.licm.loops;
+	}, &optimizer.licm.loops);
+    }
+    catch (...) {
+      for (size_t k = 0; k < functions.size(); k++)
+	delete functions[k];
+      throw;
+    }
+    for (size_t k = 0; k < functions.size(); k++)
+      delete functions[k];
+  }
+  else
+    genIR(parser, functions, optimizer, irgen);
+  if (opts.licmReport)
+    optimizer.licm.report(err);
+
+  if (opts.run)
+    return runProgram(parser);
+  if (opts.object)
+    writeObject(parser);
+  else
+    parser.gendata();
+  return 0;
+}
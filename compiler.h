@@ -0,0 +1,102 @@
+#pragma once
+
+#include "parser.h"
+#include "compileerror.h"
+#include "threadpool.h"
+#include "cache.h"
+#include "incremental.h"
+#include "stats.h"
+#include "licm.h"
+#include "iropt.h"
+#include "irgen.h"
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Command line settings for one compilation
+struct CompileOptions {
+  CompileOptions();
+  bool parse(const char* arg);
+
+  int optLevel;
+  int unrollFactor;
+  int unrollTrips;
+  bool dumpIR;
+  bool licm;
+  bool licmReport;
+  bool framePointer;
+  bool object;
+  bool run;
+  bool vm;
+  bool dumpBytecode;
+  bool emitC;
+  bool mcrt;
+  bool stream;
+  bool module;
+  std::string incremental;   // Sidecar file of an incremental build; empty for none
+};
+
+// One compilation of one source: lexer, parser, backends and every tree
+// node, token and buffer they allocate belong to it and are freed with it.
+// Nothing is shared with other contexts, so any number can compile at once
+// on different threads.  Errors never exit the process: compile() writes
+// them to err and returns 1.
+//
+// With a pool, every function is generated as a separate task into a
+// Parser shard, and the shards are merged in source order.  The output is
+// byte for byte the same as a serial compile.
+//
+// With a sidecar or a resident state, only the functions that changed
+// since the last build are compiled; see IncrementalState.
+//
+// With a cache, the source is read whole and looked up first; a hit
+// writes the stored output without compiling, and a successful miss
+// stores what it wrote.  Compilations that print to err (--dump-ir,
+// --licm-report, --dump-bytecode) or run the program never use it.
+//
+// libmicroc is all of the compiler except microc.cpp; the microc binary
+// only parses its arguments and runs one context per file.
+class CompilationContext
+{
+public:
+  CompilationContext(std::istream& inx, std::ostream& outx, std::ostream& errx,
+		     const CompileOptions& optsx);
+  ~CompilationContext();
+
+  // 0, or the program's exit status under --run and --vm; 1 after an error
+  int compile();
+
+  bool failed;          // compile() reported an error
+  std::string error;    // Its message, without the trailing newline
+  ThreadPool* pool;     // Runs per-function code generation; NULL for serial
+  CompileCache* cache;  // Output cache; NULL for none
+  IncrementalState* resident;  // Kept in memory between builds; NULL for none
+  CompileStats* stats;  // Gets the phase times and counts; NULL for none
+  bool cached;          // The output came from the cache
+
+private:
+  class FunctionJob;
+
+  int compileSource();
+  int run();
+  int compileCached();
+  std::string cacheOptions();
+  int stream(Parser& parser);
+  int incremental();
+  void compileFunction(const IncrementalState::Chunk& chunk, IncrementalState::Function& f);
+  void genIR(Parser& parser, std::vector<IRFunction*>& functions,
+	     IROptimizer& optimizer, IRGen& irgen);
+  void genFunctions(Parser& parser, size_t count, bool flush,
+		    const std::function<void(FunctionJob&, size_t)>& gen,
+		    std::vector<LICM::LoopReport>* loops = NULL);
+  void writeObject(Parser& parser);
+  int runProgram(Parser& parser);
+
+  std::istream& in;
+  std::ostream& out;
+  std::ostream& err;
+  CompileOptions opts;
+  Parser::NodePool m_nodes;
+};
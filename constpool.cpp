@@ -0,0 +1,34 @@
+#include "constpool.h"
+
+ConstantPool::ConstantPool() : lookups(0)
+{
+
+}
+
+ConstantPool::~ConstantPool()
+{
+
+}
+
+int ConstantPool::intern(const std::string& s)
+{
+  std::map<std::string, int>::iterator it = m_index.find(s);
+
+  lookups++;
+  if (it != m_index.end())
+    return it->second;
+
+  m_strings.push_back(s);
+  m_index[s] = m_strings.size();
+  return m_strings.size();
+}
+
+int ConstantPool::size()
+{
+  return m_strings.size();
+}
+
+const std::string& ConstantPool::at(int i)
+{
+  return m_strings[i];
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Interned string constants.  Each distinct string is stored once and
+// keeps the number it was first given, starting at 1, so equal printf
+// formats share a single fmt label.  There is no limit on the count.
+class ConstantPool
+{
+public:
+  ConstantPool();
+  ~ConstantPool();
+
+  int intern(const std::string& s);
+  int size();
+  const std::string& at(int i);   // 0-based
+
+  int lookups;   // intern() calls, including the deduplicated ones
+
+private:
+  std::vector<std::string> m_strings;
+  std::map<std::string, int> m_index;
+};
@@ -0,0 +1,231 @@
+#include "elfwriter.h"
+#include "stats.h"
+#include "x86enc.h"
+
+#include <elf.h>
+#include <cstring>
+
+// Section header indices
+enum { SH_NULL, SH_TEXT, SH_DATA, SH_RELA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE, SH_COUNT };
+
+/*
+  Pads image to the alignment and appends n bytes; returns their offset
+*/
+static size_t append(std::vector<unsigned char>& image, const void* p, size_t n, size_t align)
+{
+  while (image.size() % align)
+    image.push_back(0);
+
+  size_t offset = image.size();
+  const unsigned char* bytes = static_cast<const unsigned char*>(p);
+  image.insert(image.end(), bytes, bytes + n);
+  return offset;
+}
+
+ElfWriter::ElfWriter(MBuffer& mirx) : passes(0), mir(mirx)
+{
+
+}
+
+ElfWriter::~ElfWriter()
+{
+
+}
+
+/*
+  Adds a NUL terminated string to .data.  The text is in NASM backquote
+  syntax, the form addFormat stores.
+*/
+void ElfWriter::addString(const std::string& name, const std::string& nasmText)
+{
+  std::string s = MBuffer::decodeString(nasmText);
+
+  m_dataSyms[mir.symbol(name)] = m_data.size();
+  m_data.insert(m_data.end(), s.begin(), s.end());
+  m_data.push_back(0);
+}
+
+void ElfWriter::addGlobal(const std::string& name)
+{
+  m_globals.push_back(mir.symbol(name));
+}
+
+int ElfWriter::addName(std::vector<char>& table, const std::string& name)
+{
+  int offset = table.size();
+  table.insert(table.end(), name.begin(), name.end());
+  table.push_back(0);
+  return offset;
+}
+
+void ElfWriter::write(std::ostream& out)
+{
+  STAT_TIMER(CODEGEN);
+  X86Encoder enc(mir);
+  enc.encode();
+  passes = enc.passes;
+
+  std::vector<char> strtab(1, 0);
+  std::vector<char> shstrtab(1, 0);
+  std::vector<Elf64_Sym> syms;
+  std::map<int, int> symIndex;   // Symbol id -> symtab index
+  std::set<int> globals(m_globals.begin(), m_globals.end());
+  Elf64_Sym sym;
+
+  // Locals: the null symbol, section symbols, functions and strings
+  memset(&sym, 0, sizeof(sym));
+  syms.push_back(sym);
+  sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+  sym.st_shndx = SH_TEXT;
+  syms.push_back(sym);
+  sym.st_shndx = SH_DATA;
+  syms.push_back(sym);
+
+  for (std::map<int, size_t>::iterator it = enc.labels.begin(); it != enc.labels.end(); ++it)
+    {
+      const std::string& name = mir.name(it->first);
+
+      if (globals.count(it->first) || name.empty() || name[0] == '.')
+	continue;
+
+      memset(&sym, 0, sizeof(sym));
+      sym.st_name = addName(strtab, name);
+      sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_FUNC);
+      sym.st_shndx = SH_TEXT;
+      sym.st_value = it->second;
+      symIndex[it->first] = syms.size();
+      syms.push_back(sym);
+    }
+
+  for (std::map<int, size_t>::iterator it = m_dataSyms.begin(); it != m_dataSyms.end(); ++it)
+    {
+      memset(&sym, 0, sizeof(sym));
+      sym.st_name = addName(strtab, mir.name(it->first));
+      sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_OBJECT);
+      sym.st_shndx = SH_DATA;
+      sym.st_value = it->second;
+      symIndex[it->first] = syms.size();
+      syms.push_back(sym);
+    }
+
+  // Globals: exported functions, then everything referenced but not defined
+  size_t firstGlobal = syms.size();
+
+  for (size_t k = 0; k < m_globals.size(); k++)
+    {
+      std::map<int, size_t>::iterator def = enc.labels.find(m_globals[k]);
+
+      memset(&sym, 0, sizeof(sym));
+      sym.st_name = addName(strtab, mir.name(m_globals[k]));
+      if (def != enc.labels.end())
+	{
+	  sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+	  sym.st_shndx = SH_TEXT;
+	  sym.st_value = def->second;
+	}
+      else
+	sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+      symIndex[m_globals[k]] = syms.size();
+      syms.push_back(sym);
+    }
+
+  std::vector<Elf64_Rela> relas;
+  for (size_t i = 0; i < enc.relocs.size(); i++)
+    {
+      X86Encoder::Reloc& r = enc.relocs[i];
+
+      if (symIndex.find(r.symbol) == symIndex.end())
+	{
+	  memset(&sym, 0, sizeof(sym));
+	  sym.st_name = addName(strtab, mir.name(r.symbol));
+	  sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+	  symIndex[r.symbol] = syms.size();
+	  syms.push_back(sym);
+	}
+
+      Elf64_Rela rela;
+      rela.r_offset = r.offset;
+      rela.r_info = ELF64_R_INFO(symIndex[r.symbol], r.type);
+      rela.r_addend = r.addend;
+      relas.push_back(rela);
+    }
+
+  // Lay the file out: header, section contents, section header table
+  std::vector<unsigned char> image(sizeof(Elf64_Ehdr), 0);
+  Elf64_Shdr sh[SH_COUNT];
+  memset(sh, 0, sizeof(sh));
+
+  sh[SH_TEXT].sh_name = addName(shstrtab, ".text");
+  sh[SH_TEXT].sh_type = SHT_PROGBITS;
+  sh[SH_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[SH_TEXT].sh_addralign = 16;
+  sh[SH_TEXT].sh_size = enc.text.size();
+  sh[SH_TEXT].sh_offset = append(image, enc.text.data(), enc.text.size(), 16);
+
+  sh[SH_DATA].sh_name = addName(shstrtab, ".data");
+  sh[SH_DATA].sh_type = SHT_PROGBITS;
+  sh[SH_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+  sh[SH_DATA].sh_addralign = 4;
+  sh[SH_DATA].sh_size = m_data.size();
+  sh[SH_DATA].sh_offset = append(image, m_data.data(), m_data.size(), 4);
+
+  sh[SH_RELA].sh_name = addName(shstrtab, ".rela.text");
+  sh[SH_RELA].sh_type = SHT_RELA;
+  sh[SH_RELA].sh_flags = SHF_INFO_LINK;
+  sh[SH_RELA].sh_link = SH_SYMTAB;
+  sh[SH_RELA].sh_info = SH_TEXT;
+  sh[SH_RELA].sh_addralign = 8;
+  sh[SH_RELA].sh_entsize = sizeof(Elf64_Rela);
+  sh[SH_RELA].sh_size = relas.size() * sizeof(Elf64_Rela);
+  sh[SH_RELA].sh_offset = append(image, relas.data(), sh[SH_RELA].sh_size, 8);
+
+  sh[SH_SYMTAB].sh_name = addName(shstrtab, ".symtab");
+  sh[SH_SYMTAB].sh_type = SHT_SYMTAB;
+  sh[SH_SYMTAB].sh_link = SH_STRTAB;
+  sh[SH_SYMTAB].sh_info = firstGlobal;
+  sh[SH_SYMTAB].sh_addralign = 8;
+  sh[SH_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+  sh[SH_SYMTAB].sh_size = syms.size() * sizeof(Elf64_Sym);
+  sh[SH_SYMTAB].sh_offset = append(image, syms.data(), sh[SH_SYMTAB].sh_size, 8);
+
+  sh[SH_STRTAB].sh_name = addName(shstrtab, ".strtab");
+  sh[SH_STRTAB].sh_type = SHT_STRTAB;
+  sh[SH_STRTAB].sh_addralign = 1;
+  sh[SH_STRTAB].sh_size = strtab.size();
+  sh[SH_STRTAB].sh_offset = append(image, strtab.data(), strtab.size(), 1);
+
+  // Non-executable stack, as gcc expects of every object
+  sh[SH_NOTE].sh_name = addName(shstrtab, ".note.GNU-stack");
+  sh[SH_NOTE].sh_type = SHT_PROGBITS;
+  sh[SH_NOTE].sh_addralign = 1;
+  sh[SH_NOTE].sh_offset = image.size();
+
+  sh[SH_SHSTRTAB].sh_name = addName(shstrtab, ".shstrtab");
+  sh[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+  sh[SH_SHSTRTAB].sh_addralign = 1;
+  sh[SH_SHSTRTAB].sh_size = shstrtab.size();
+  sh[SH_SHSTRTAB].sh_offset = append(image, shstrtab.data(), shstrtab.size(), 1);
+
+  size_t shoff = append(image, sh, sizeof(sh), 8);
+
+  Elf64_Ehdr eh;
+  memset(&eh, 0, sizeof(eh));
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = shoff;
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_shentsize = sizeof(Elf64_Shdr);
+  eh.e_shnum = SH_COUNT;
+  eh.e_shstrndx = SH_SHSTRTAB;
+  memcpy(image.data(), &eh, sizeof(eh));
+
+  out.write(reinterpret_cast<const char*>(image.data()), image.size());
+  STAT_COUNT(BYTES, image.size());
+  out.flush();
+}
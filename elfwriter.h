@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mir.h"
+
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+// Writes the contents of an MBuffer as a relocatable ELF64 object, so the
+// output can be linked with gcc without going through nasm.  Code goes in
+// .text, the strings added with addString in .data.  Symbols that are used
+// but not defined (printf) become undefined globals with relocations.
+class ElfWriter
+{
+public:
+  ElfWriter(MBuffer& mirx);
+  ~ElfWriter();
+
+  void addString(const std::string& name, const std::string& nasmText);
+  void addGlobal(const std::string& name);
+  void write(std::ostream& out);
+
+  int passes;     // Branch relaxation passes used by the encoder
+
+private:
+  int addName(std::vector<char>& table, const std::string& name);
+
+  MBuffer& mir;
+  std::vector<unsigned char> m_data;
+  std::map<int, size_t> m_dataSyms;   // Symbol id -> offset in .data
+  std::vector<int> m_globals;
+};
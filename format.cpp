@@ -0,0 +1,123 @@
+#include "format.h"
+
+long long FormatChunk::spec() const
+{
+  return width | (left ? LEFT : 0) | (zero ? ZERO : 0) | (isLong ? LONG : 0) |
+    (static_cast<long long>(conv) << CONVSHIFT);
+}
+
+static void literal(std::vector<FormatChunk>& chunks, const std::string& text)
+{
+  if (text.empty())
+    return;
+
+  if (!chunks.empty() && !chunks.back().conversion)
+    {
+      chunks.back().text += text;
+      return;
+    }
+
+  FormatChunk c;
+  c.conversion = false;
+  c.text = text;
+  c.width = 0;
+  c.left = c.zero = c.isLong = false;
+  c.conv = 0;
+  chunks.push_back(c);
+}
+
+bool splitFormat(const std::string& fmt, std::vector<FormatChunk>& chunks)
+{
+  size_t i = 0;
+
+  chunks.clear();
+  while (i < fmt.size())
+    {
+      size_t pct = fmt.find('%', i);
+
+      if (pct == std::string::npos)
+	{
+	  literal(chunks, fmt.substr(i));
+	  break;
+	}
+      literal(chunks, fmt.substr(i, pct - i));
+
+      FormatChunk c;
+      c.conversion = true;
+      c.width = 0;
+      c.left = c.zero = c.isLong = false;
+      i = pct + 1;
+
+      if (i < fmt.size() && fmt[i] == '%')
+	{
+	  literal(chunks, "%");
+	  i++;
+	  continue;
+	}
+
+      for (; i < fmt.size() && (fmt[i] == '-' || fmt[i] == '0'); i++)
+	{
+	  if (fmt[i] == '-')
+	    c.left = true;
+	  else
+	    c.zero = true;
+	}
+      for (; i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9'; i++)
+	c.width = c.width * 10 + (fmt[i] - '0');
+      for (; i < fmt.size() && fmt[i] == 'l'; i++)
+	c.isLong = true;
+
+      if (i == fmt.size() || c.width > 255)
+	return false;
+
+      switch (fmt[i])
+	{
+	case 'd':
+	case 'i':
+	  c.conv = 'd';
+	  break;
+	case 'u':
+	case 'x':
+	case 'c':
+	  c.conv = fmt[i];
+	  break;
+	default:
+	  return false;
+	}
+
+      c.text = fmt.substr(pct, i + 1 - pct);
+      chunks.push_back(c);
+      i++;
+    }
+
+  return true;
+}
+
+/*
+  mcrt's printf knows the flags '-' and '0', a width, 'l' and the
+  d/i/u/x/c conversions; it would copy anything else, like "%+d" or
+  "%.3d", out literally where libc formats it
+*/
+bool runtimeFormat(const std::string& fmt)
+{
+  for (size_t i = fmt.find('%'); i != std::string::npos; i = fmt.find('%', i))
+    {
+      i++;
+      if (i < fmt.size() && fmt[i] == '%')
+	{
+	  i++;
+	  continue;
+	}
+      while (i < fmt.size() && (fmt[i] == '-' || fmt[i] == '0'))
+	i++;
+      while (i < fmt.size() && fmt[i] >= '0' && fmt[i] <= '9')
+	i++;
+      while (i < fmt.size() && fmt[i] == 'l')
+	i++;
+      if (i == fmt.size() || std::string("diuxc").find(fmt[i]) == std::string::npos)
+	return false;
+      i++;
+    }
+
+  return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A printf format split at compile time into literal text and single
+// integer conversions, so the code generators can call the runtime's
+// writer and integer formatter directly instead of printf.
+class FormatChunk
+{
+public:
+  // Bits of the spec word passed to mcrt_putint, above the width
+  enum { LEFT = 1 << 8, ZERO = 1 << 9, LONG = 1 << 10, CONVSHIFT = 16 };
+
+  bool conversion;
+  std::string text;   // Literal: source text, escapes not yet decoded
+  int width;
+  bool left;
+  bool zero;
+  bool isLong;
+  char conv;          // 'd', 'u', 'x' or 'c'
+
+  long long spec() const;
+};
+
+// Splits fmt; returns false if it uses anything beyond flags '-' and '0',
+// a width, 'l' and the d/i/u/x/c conversions, which only printf handles
+bool splitFormat(const std::string& fmt, std::vector<FormatChunk>& chunks);
+
+// True if mcrt's printf formats fmt as libc's does
+bool runtimeFormat(const std::string& fmt);
@@ -82,9 +82,9 @@ imul rbx
 push rax
 mov rax,10
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 pop rbx
@@ -99,9 +99,9 @@ push rax
 push qword[rbp-16]
 mov rax,4
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 pop rbx
@@ -113,9 +113,9 @@ push rax
 push qword[rbp-16]
 mov rax,100
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 pop rbx
@@ -129,9 +129,9 @@ push rax
 push qword[rbp-16]
 mov rax,400
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 pop rbx
@@ -143,9 +143,9 @@ push qword[rbp-32]
 push qword[rbp-32]
 mov rax,7
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 mov rax,7
@@ -358,9 +358,9 @@ add rax,rbx
 push rax
 mov rax,7
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 mov rax,1
@@ -489,7 +489,7 @@ push rax
 pop qword[rbp-80]
 jmp L18
 L19:
- mov rdi,fmt5
+ mov rdi,fmt4
  mov rax,0
  push rbp
  call printf
@@ -510,9 +510,9 @@ mov qword[rbp-8],rsi
 push qword[rbp-8]
 mov rax,4
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 mov rax,4
@@ -546,9 +546,9 @@ L20:
 push qword[rbp-8]
 mov rax,100
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 mov rax,100
@@ -582,9 +582,9 @@ L22:
 push qword[rbp-8]
 mov rax,400
 push rax
-mov rdx,0
 pop rbx
 pop rax
+cqo
 idiv rbx
 push rax
 mov rax,400
@@ -644,7 +644,7 @@ push rax
 pop rax
 cmp rax,0
 je L26
- mov rdi,fmt6
+ mov rdi,fmt5
  mov rax,0
  push rbp
  call printf
@@ -673,7 +673,7 @@ push rax
 pop rax
 cmp rax,0
 je L28
- mov rdi,fmt7
+ mov rdi,fmt6
  mov rax,0
  push rbp
  call printf
@@ -702,7 +702,7 @@ push rax
 pop rax
 cmp rax,0
 je L30
- mov rdi,fmt8
+ mov rdi,fmt7
  mov rax,0
  push rbp
  call printf
@@ -731,7 +731,7 @@ push rax
 pop rax
 cmp rax,0
 je L32
- mov rdi,fmt9
+ mov rdi,fmt8
  mov rax,0
  push rbp
  call printf
@@ -760,7 +760,7 @@ push rax
 pop rax
 cmp rax,0
 je L34
- mov rdi,fmt10
+ mov rdi,fmt9
  mov rax,0
  push rbp
  call printf
@@ -789,7 +789,7 @@ push rax
 pop rax
 cmp rax,0
 je L36
- mov rdi,fmt11
+ mov rdi,fmt10
  mov rax,0
  push rbp
  call printf
@@ -818,7 +818,7 @@ push rax
 pop rax
 cmp rax,0
 je L38
- mov rdi,fmt12
+ mov rdi,fmt11
  mov rax,0
  push rbp
  call printf
@@ -847,7 +847,7 @@ push rax
 pop rax
 cmp rax,0
 je L40
- mov rdi,fmt13
+ mov rdi,fmt12
  mov rax,0
  push rbp
  call printf
@@ -876,7 +876,7 @@ push rax
 pop rax
 cmp rax,0
 je L42
- mov rdi,fmt14
+ mov rdi,fmt13
  mov rax,0
  push rbp
  call printf
@@ -905,7 +905,7 @@ push rax
 pop rax
 cmp rax,0
 je L44
- mov rdi,fmt15
+ mov rdi,fmt14
  mov rax,0
  push rbp
  call printf
@@ -934,7 +934,7 @@ push rax
 pop rax
 cmp rax,0
 je L46
- mov rdi,fmt16
+ mov rdi,fmt15
  mov rax,0
  push rbp
  call printf
@@ -963,7 +963,7 @@ push rax
 pop rax
 cmp rax,0
 je L48
- mov rdi,fmt17
+ mov rdi,fmt16
  mov rax,0
  push rbp
  call printf
@@ -989,16 +989,15 @@ ret
  fmt2: db `   `, 0
  fmt3: db `%2d `, 0
  fmt4: db `\n`, 0
- fmt5: db `\n`, 0
- fmt6: db `       January\n`, 0
- fmt7: db `      February\n`, 0
- fmt8: db `        March\n`, 0
- fmt9: db `        April\n`, 0
- fmt10: db `         May\n`, 0
- fmt11: db `        June\n`, 0
- fmt12: db `        July\n`, 0
- fmt13: db `       August\n`, 0
- fmt14: db `      September\n`, 0
- fmt15: db `       October\n`, 0
- fmt16: db `      November\n`, 0
- fmt17: db `      December\n`, 0
+ fmt5: db `       January\n`, 0
+ fmt6: db `      February\n`, 0
+ fmt7: db `        March\n`, 0
+ fmt8: db `        April\n`, 0
+ fmt9: db `         May\n`, 0
+ fmt10: db `        June\n`, 0
+ fmt11: db `        July\n`, 0
+ fmt12: db `       August\n`, 0
+ fmt13: db `      September\n`, 0
+ fmt14: db `       October\n`, 0
+ fmt15: db `      November\n`, 0
+ fmt16: db `      December\n`, 0
@@ -0,0 +1,349 @@
+#include "incremental.h"
+#include "cache.h"
+#include "lexer.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// First line of a sidecar; bumped whenever its layout changes
+static const char SIDECAR_FORMAT[] = "microc-incremental 1";
+
+IncrementalState::IncrementalState(const std::string& pathx, const std::string& configx)
+  : path(pathx), config(configx), reused(0)
+{
+
+}
+
+/*
+  Splits source[begin, end) in front of every "function" keyword outside
+  braces, comments and strings; begin is on the given line.  Anything
+  before the first function stays with it, so a chunk always parses the
+  way it would in the whole file.
+*/
+void IncrementalState::split(const std::string& source, size_t begin, size_t end, int line,
+			     std::vector<Chunk>& chunks)
+{
+  size_t start = begin;
+  int startLine = line;
+  int depth = 0;
+  bool first = true;
+  size_t i = begin;
+
+  while (i < end)
+    {
+      char c = source[i];
+
+      if (c == '\n')
+	line++;
+      if (c == '#')
+	{
+	  while (i < end && source[i] != '\n')
+	    i++;
+	  continue;
+	}
+      if (c == '"')
+	{
+	  for (i++; i < end && source[i] != '"'; i++)
+	    if (source[i] == '\n')
+	      line++;
+	  i++;
+	  continue;
+	}
+      if (isalpha(static_cast<unsigned char>(c)))
+	{
+	  size_t word = i;
+	  while (i < end && isalnum(static_cast<unsigned char>(source[i])))
+	    i++;
+	  if (depth == 0 && source.compare(word, i - word, "function") == 0)
+	    {
+	      if (!first)
+		{
+		  Chunk chunk = { source.substr(start, word - start), start, startLine, "" };
+		  chunks.push_back(chunk);
+		  start = word;
+		  startLine = line;
+		}
+	      first = false;
+	    }
+	  continue;
+	}
+      if (c == '{')
+	depth++;
+      else if (c == '}' && depth > 0)
+	depth--;
+      i++;
+    }
+
+  if (start < end || chunks.empty())
+    {
+      Chunk chunk = { source.substr(start, end - start), start, startLine, "" };
+      chunks.push_back(chunk);
+    }
+}
+
+/*
+  Splits the source into fingerprinted chunks.  Against the last call's
+  source, only the bytes between the common prefix and suffix changed.
+  The chunks before the one the edit starts in are kept, and so are
+  those that start on a later line than it ends on, shifted by the
+  change in length; the rest is split and fingerprinted again.
+*/
+void IncrementalState::rechunk(const std::string& source, std::vector<Chunk>& chunks)
+{
+  size_t first = 0;                  // First old chunk split again
+  size_t last = m_chunks.size();     // First old chunk kept after the edit
+  size_t begin = 0;
+  size_t end = source.size();
+  int line = 1;
+
+  if (!m_chunks.empty())
+    {
+      size_t n = std::min(source.size(), m_source.size());
+      size_t prefix = 0;
+      while (prefix < n && source[prefix] == m_source[prefix])
+	prefix++;
+      size_t suffix = 0;
+      while (suffix < n - prefix && source[source.size() - 1 - suffix] == m_source[m_source.size() - 1 - suffix])
+	suffix++;
+      size_t oldEnd = m_source.size() - suffix;
+
+      // An edit that touches a chunk's first byte may change its keyword
+      while (first + 1 < m_chunks.size() && m_chunks[first + 1].offset < prefix)
+	first++;
+      last = first + 1;
+      while (last < m_chunks.size() &&
+	     m_source.find('\n', oldEnd) >= m_chunks[last].offset)
+	last++;
+
+      begin = m_chunks[first].offset;
+      end = last < m_chunks.size() ? m_chunks[last].offset + source.size() - m_source.size() : source.size();
+      line = m_chunks[first].line;
+    }
+
+  chunks.assign(m_chunks.begin(), m_chunks.begin() + first);
+  size_t edited = chunks.size();
+  split(source, begin, end, line, chunks);
+  for (size_t i = edited; i < chunks.size(); i++)
+    chunks[i].fingerprint = fingerprint(chunks[i].text);
+
+  int lines = 0;
+  for (size_t i = begin; i < end; i++)
+    lines += source[i] == '\n';
+  int shift = line + lines - (last < m_chunks.size() ? m_chunks[last].line : 0);
+  for (size_t i = last; i < m_chunks.size(); i++)
+    {
+      Chunk chunk = m_chunks[i];
+      chunk.offset += source.size() - m_source.size();
+      chunk.line += shift;
+      chunks.push_back(chunk);
+    }
+
+  m_source = source;
+  m_chunks = chunks;
+}
+
+/*
+  Hashes the chunk's tokens, types and lexemes, so comments, blank lines
+  and indentation do not change it
+*/
+std::string IncrementalState::fingerprint(const std::string& chunk)
+{
+  std::istringstream in(chunk);
+  Lexer lexer(in);
+  std::string tokens;
+
+  for (Token* t = lexer.nextToken(); t->type() != Token::ENDOFFILE; t = lexer.nextToken())
+    {
+      tokens += std::to_string(static_cast<long long>(t->type()));
+      tokens += ' ';
+      tokens += t->lexeme();
+      tokens += '\0';
+    }
+  return CompileCache::digest(tokens);
+}
+
+/*
+  Reads the functions of the last build.  A missing or damaged sidecar,
+  or one written by another compiler or with other options, is ignored
+  and every function is compiled.
+*/
+void IncrementalState::load()
+{
+  std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+  std::string line;
+  std::map<std::string, Function> previous;
+  int count;
+
+  if (!std::getline(in, line) || line != SIDECAR_FORMAT)
+    return;
+  if (!std::getline(in, line) || line != CompileCache::digest(config))
+    return;
+  if (!(in >> count))
+    return;
+
+  for (int i = 0; i < count; i++)
+    {
+      Function f;
+      int nstrings;
+      size_t bytes;
+
+      if (!(in >> f.fingerprint >> f.parseLabels >> f.codeLabels >> nstrings >> bytes))
+	return;
+      for (int k = 0; k < nstrings; k++)
+	{
+	  size_t len;
+	  if (!(in >> len) || in.get() != ' ')
+	    return;
+	  std::string s(len, 0);
+	  if (len && !in.read(&s[0], len))
+	    return;
+	  f.strings.push_back(s);
+	}
+      if (in.get() != '\n')
+	return;
+      f.code.resize(bytes);
+      if (bytes && !in.read(&f.code[0], bytes))
+	return;
+      previous[f.fingerprint] = f;
+    }
+
+  m_previous.swap(previous);
+}
+
+/*
+  Writes this build's functions to a temporary file and renames it over
+  the sidecar, so an interrupted build leaves the old one intact
+*/
+void IncrementalState::save()
+{
+  std::string tmp = path + ".tmp" + std::to_string(static_cast<long long>(getpid()));
+  {
+    std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+    out << SIDECAR_FORMAT << "\n" << CompileCache::digest(config) << "\n" << functions.size() << "\n";
+    for (size_t i = 0; i < functions.size(); i++)
+      {
+	Function& f = functions[i];
+	out << f.fingerprint << " " << f.parseLabels << " " << f.codeLabels << " "
+	    << f.strings.size() << " " << f.code.size();
+	for (size_t k = 0; k < f.strings.size(); k++)
+	  out << " " << f.strings[k].size() << " " << f.strings[k];
+	out << "\n" << f.code;
+      }
+    if (!out.flush())
+      {
+	remove(tmp.c_str());
+	return;
+      }
+  }
+  if (rename(tmp.c_str(), path.c_str()) < 0)
+    remove(tmp.c_str());
+}
+
+/*
+  Makes this build's functions the ones find() returns next time.  After
+  a failed build the functions it did compile are added to the old ones,
+  so fixing the error does not compile them again.
+*/
+void IncrementalState::commit(bool complete)
+{
+  if (complete)
+    m_previous.clear();
+  for (size_t i = 0; i < functions.size(); i++)
+    m_previous[functions[i].fingerprint] = functions[i];
+  functions.clear();
+  reused = 0;
+}
+
+// The function from the last build with this fingerprint, or NULL
+const IncrementalState::Function* IncrementalState::find(const std::string& fingerprint)
+{
+  std::map<std::string, Function>::iterator it = m_previous.find(fingerprint);
+  return it == m_previous.end() ? NULL : &it->second;
+}
+
+/*
+  Emits the functions into parser, after its header.  A whole-program
+  compile makes every parse label before any code generation label, and
+  interns the fmt strings as the code uses them, so each function's
+  labels are shifted past the ones made before it in each phase and its
+  strings are interned in order.
+*/
+void IncrementalState::link(Parser& parser)
+{
+  int parsed = 0;
+  int before = 0;
+  int generated = 0;
+
+  for (size_t i = 0; i < functions.size(); i++)
+    parsed += functions[i].parseLabels;
+
+  for (size_t i = 0; i < functions.size(); i++)
+    {
+      Function& f = functions[i];
+      std::vector<int> fmts;
+      for (size_t k = 0; k < f.strings.size(); k++)
+	fmts.push_back(parser.strings.intern(f.strings[k]));
+
+      std::string code = relocate(f, before, parsed + generated, fmts);
+      if (!code.empty() && code[code.size() - 1] == '\n')
+	code.erase(code.size() - 1);
+      if (!code.empty())
+	parser.emit(code);
+      parser.flushCode();
+      before += f.parseLabels;
+      generated += f.codeLabels;
+    }
+}
+
+/*
+  Renumbers the L and fmt symbols in a function's code.  Its parse labels
+  follow the before made by earlier functions, its code generation labels
+  the codeBase made before them, and fmt k becomes fmts[k - 1].
+*/
+std::string IncrementalState::relocate(const Function& f, int before, int codeBase,
+				       const std::vector<int>& fmts)
+{
+  const std::string& code = f.code;
+  std::string result;
+  size_t i = 0;
+
+  result.reserve(code.size() + code.size() / 8);
+  while (i < code.size())
+    {
+      if (!isalpha(static_cast<unsigned char>(code[i])) && code[i] != '_' && code[i] != '.')
+	{
+	  result += code[i++];
+	  continue;
+	}
+
+      size_t word = i;
+      while (i < code.size() && (isalnum(static_cast<unsigned char>(code[i])) || code[i] == '_' || code[i] == '.'))
+	i++;
+      size_t digits = code[word] == 'L' ? word + 1 : code.compare(word, 3, "fmt") == 0 ? word + 3 : i;
+      size_t d = digits;
+      while (d < i && isdigit(static_cast<unsigned char>(code[d])))
+	d++;
+      if (digits == i || d != i)
+	{
+	  result.append(code, word, i - word);
+	  continue;
+	}
+
+      int k = atoi(code.c_str() + digits);
+      if (code[word] == 'L' && k >= 2 && k <= f.parseLabels + 1)
+	k += before;
+      else if (code[word] == 'L' && k > f.parseLabels + 1 && k <= f.parseLabels + f.codeLabels + 1)
+	k += codeBase - f.parseLabels;
+      else if (code[word] == 'f' && k >= 1 && k <= static_cast<int>(fmts.size()))
+	k = fmts[k - 1];
+      result.append(code, word, digits - word);
+      result += std::to_string(static_cast<long long>(k));
+    }
+  return result;
+}
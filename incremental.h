@@ -0,0 +1,69 @@
+#pragma once
+
+#include "parser.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// State of a function-granular incremental build, kept in a sidecar file
+// between runs.  The source is split into its top-level functions, each
+// identified by a fingerprint of its token stream, so edits to comments
+// and layout do not count as changes.  A function whose fingerprint was
+// in the last build reuses the code it compiled to; only the others are
+// parsed and generated again.
+//
+// Each function is compiled on its own, so its code carries its own L
+// label and fmt numbers.  link() renumbers them into one program exactly
+// as a whole-program compile would have numbered them.  Nothing else
+// crosses a function boundary: there is no inlining, and the symbol
+// table starts afresh in every function.
+//
+// A state kept in memory between builds, as the compile server keeps
+// one per open file, also remembers the last source and its chunks.
+// rechunk() then lexes and splits only the edited byte range, widened
+// to the function boundaries around it; the chunks outside it keep
+// their fingerprints.
+class IncrementalState
+{
+public:
+  struct Chunk {
+    std::string text;
+    size_t offset;                      // In the source
+    int line;                           // Of its first character
+    std::string fingerprint;
+  };
+
+  struct Function {
+    std::string fingerprint;
+    int parseLabels;                    // L labels made while parsing it
+    int codeLabels;                     // L labels made generating its code
+    std::vector<std::string> strings;   // Its fmt strings, in local order
+    std::string code;                   // NASM text, with a trailing newline
+  };
+
+  IncrementalState(const std::string& pathx, const std::string& configx);
+
+  void load();
+  void save();
+  void rechunk(const std::string& source, std::vector<Chunk>& chunks);
+  const Function* find(const std::string& fingerprint);
+  void link(Parser& parser);
+  void commit(bool complete);
+
+  static void split(const std::string& source, size_t begin, size_t end, int line,
+		    std::vector<Chunk>& chunks);
+  static std::string fingerprint(const std::string& chunk);
+
+  std::string path;
+  std::string config;                 // Compiler and options; a mismatch drops the sidecar
+  std::vector<Function> functions;    // This build's, in source order
+  int reused;                         // Functions taken from the sidecar
+
+private:
+  std::string relocate(const Function& f, int before, int codeBase, const std::vector<int>& fmts);
+
+  std::map<std::string, Function> m_previous;
+  std::string m_source;               // Of the last rechunk()
+  std::vector<Chunk> m_chunks;
+};
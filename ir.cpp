@@ -0,0 +1,566 @@
+#include "ir.h"
+
+#include <algorithm>
+#include <set>
+
+static const char* binops[] = { "add", "sub", "mul", "div",
+				"iseq", "isne", "islt", "isle", "isgt", "isge",
+				"and", "or" };
+
+IRInstr::IRInstr(Opcode opx, int idx) : op(opx), id(idx), binop(0), imm(0), slot(0), block(NULL), mark(false)
+{
+  target[0] = NULL;
+  target[1] = NULL;
+}
+
+bool IRInstr::isPure()
+{
+  return op == CONST || op == PARAM || op == BINOP || op == PHI || op == COPY;
+}
+
+bool IRInstr::isTerminator()
+{
+  return op == JUMP || op == BRANCH || op == RET;
+}
+
+bool IRInstr::hasValue()
+{
+  return isPure() || op == CALL;
+}
+
+IRBlock::IRBlock(int idx) : id(idx), idom(NULL), rpo(-1), loopDepth(0)
+{
+
+}
+
+IRInstr* IRBlock::terminator()
+{
+  if (instrs.empty() || !instrs.back()->isTerminator())
+    return NULL;
+
+  return instrs.back();
+}
+
+int IRBlock::predIndex(IRBlock* pred)
+{
+  for (size_t i = 0; i < preds.size(); i++)
+    if (preds[i] == pred)
+      return i;
+
+  return -1;
+}
+
+/*
+  Drop an incoming edge together with the matching PHI operands
+*/
+void IRBlock::removePred(IRBlock* pred)
+{
+  int idx = predIndex(pred);
+  if (idx < 0)
+    return;
+
+  preds.erase(preds.begin() + idx);
+  for (size_t i = 0; i < instrs.size() && instrs[i]->op == IRInstr::PHI; i++)
+    instrs[i]->args.erase(instrs[i]->args.begin() + idx);
+}
+
+void IRBlock::replaceSucc(IRBlock* from, IRBlock* to)
+{
+  std::replace(succs.begin(), succs.end(), from, to);
+
+  IRInstr* term = terminator();
+  if (term == NULL)
+    return;
+
+  for (int i = 0; i < 2; i++)
+    if (term->target[i] == from)
+      term->target[i] = to;
+}
+
+IRFunction::IRFunction(std::string namex) : name(namex), nextBlock(0), nextValue(1)
+{
+
+}
+
+IRFunction::~IRFunction()
+{
+  for (size_t i = 0; i < blocks.size(); i++)
+    delete blocks[i];
+
+  for (size_t i = 0; i < pool.size(); i++)
+    delete pool[i];
+}
+
+IRBlock* IRFunction::newBlock()
+{
+  IRBlock* block = new IRBlock(nextBlock++);
+  blocks.push_back(block);
+  return block;
+}
+
+IRInstr* IRFunction::newInstr(IRInstr::Opcode op)
+{
+  IRInstr* instr = new IRInstr(op, nextValue++);
+  pool.push_back(instr);
+  return instr;
+}
+
+/*
+  Constants live at the top of the entry block so they dominate every use
+*/
+IRInstr* IRFunction::constant(long long value)
+{
+  IRInstr* instr = newInstr(IRInstr::CONST);
+  IRBlock* entry = blocks[0];
+  instr->imm = value;
+  instr->block = entry;
+  entry->instrs.insert(entry->instrs.begin(), instr);
+  return instr;
+}
+
+void IRFunction::replaceAllUses(IRInstr* from, IRInstr* to)
+{
+  for (size_t b = 0; b < blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	std::replace(instrs[i]->args.begin(), instrs[i]->args.end(), from, to);
+    }
+}
+
+int IRFunction::useCount(IRInstr* value)
+{
+  int count = 0;
+
+  for (size_t b = 0; b < blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	count += std::count(instrs[i]->args.begin(), instrs[i]->args.end(), value);
+    }
+
+  return count;
+}
+
+void IRFunction::removeBlock(IRBlock* block)
+{
+  for (size_t i = 0; i < block->succs.size(); i++)
+    block->succs[i]->removePred(block);
+
+  for (size_t i = 0; i < block->preds.size(); i++)
+    {
+      std::vector<IRBlock*>& succs = block->preds[i]->succs;
+      succs.erase(std::remove(succs.begin(), succs.end(), block), succs.end());
+    }
+
+  blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+  delete block;
+}
+
+void IRFunction::removeUnreachable()
+{
+  std::vector<IRBlock*> work(1, blocks[0]);
+  std::set<IRBlock*> seen;
+  seen.insert(blocks[0]);
+
+  while (!work.empty())
+    {
+      IRBlock* block = work.back();
+      work.pop_back();
+      for (size_t i = 0; i < block->succs.size(); i++)
+	{
+	  IRBlock* succ = block->succs[i];
+	  if (seen.insert(succ).second)
+	    {
+	      work.push_back(succ);
+	    }
+	}
+    }
+
+  for (size_t i = blocks.size(); i > 0; i--)
+    {
+      IRBlock* block = blocks[i - 1];
+      if (!seen.count(block))
+	removeBlock(block);
+    }
+}
+
+/*
+  Fold a block into its predecessor when it is the only way in and out
+*/
+bool IRFunction::mergeBlocks()
+{
+  bool changed = false;
+
+  for (size_t b = 0; b < blocks.size(); b++)
+    {
+      IRBlock* block = blocks[b];
+      IRInstr* term = block->terminator();
+
+      while (term != NULL && term->op == IRInstr::JUMP && term->target[0] != block &&
+	     term->target[0]->preds.size() == 1 && term->target[0] != blocks[0])
+	{
+	  IRBlock* succ = term->target[0];
+
+	  block->instrs.pop_back();
+	  for (size_t i = 0; i < succ->instrs.size(); i++)
+	    {
+	      succ->instrs[i]->block = block;
+	      block->instrs.push_back(succ->instrs[i]);
+	    }
+
+	  block->succs = succ->succs;
+	  for (size_t i = 0; i < succ->succs.size(); i++)
+	    std::replace(succ->succs[i]->preds.begin(), succ->succs[i]->preds.end(), succ, block);
+
+	  blocks.erase(std::find(blocks.begin(), blocks.end(), succ));
+	  delete succ;
+	  if (std::find(blocks.begin(), blocks.end(), block) - blocks.begin() < (long)b)
+	    b--;
+	  term = block->terminator();
+	  changed = true;
+	}
+    }
+
+  return changed;
+}
+
+/*
+  Put an empty block on every edge from a branch into a join point, so PHI
+  copies can be placed on the edge itself
+*/
+void IRFunction::splitCriticalEdges()
+{
+  size_t count = blocks.size();
+
+  for (size_t b = 0; b < count; b++)
+    {
+      IRBlock* pred = blocks[b];
+      if (pred->succs.size() < 2)
+	continue;
+
+      for (size_t s = 0; s < pred->succs.size(); s++)
+	{
+	  IRBlock* succ = pred->succs[s];
+	  if (succ->preds.size() < 2)
+	    continue;
+
+	  IRBlock* edge = newBlock();
+	  IRInstr* jump = newInstr(IRInstr::JUMP);
+	  jump->block = edge;
+	  jump->target[0] = succ;
+	  edge->instrs.push_back(jump);
+	  edge->preds.push_back(pred);
+	  edge->succs.push_back(succ);
+
+	  succ->preds[succ->predIndex(pred)] = edge;
+	  pred->replaceSucc(succ, edge);
+	}
+    }
+}
+
+/*
+  Cooper, Harvey and Kennedy's iterative dominator algorithm over reverse
+  postorder
+*/
+void IRFunction::computeDominators()
+{
+  std::vector<IRBlock*> order;
+
+  for (size_t i = 0; i < blocks.size(); i++)
+    {
+      blocks[i]->rpo = -1;
+      blocks[i]->idom = NULL;
+      blocks[i]->domChildren.clear();
+    }
+
+  std::vector<std::pair<IRBlock*, size_t> > stack;
+  blocks[0]->rpo = 0;
+  stack.push_back(std::make_pair(blocks[0], 0));
+
+  while (!stack.empty())
+    {
+      IRBlock* block = stack.back().first;
+      size_t next = stack.back().second++;
+
+      if (next < block->succs.size())
+	{
+	  IRBlock* succ = block->succs[next];
+	  if (succ->rpo < 0)
+	    {
+	      succ->rpo = 0;
+	      stack.push_back(std::make_pair(succ, 0));
+	    }
+	}
+      else
+	{
+	  order.push_back(block);
+	  stack.pop_back();
+	}
+    }
+
+  std::reverse(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i]->rpo = i;
+
+  IRBlock* entry = blocks[0];
+  entry->idom = entry;
+
+  bool changed = true;
+  while (changed)
+    {
+      changed = false;
+      for (size_t i = 1; i < order.size(); i++)
+	{
+	  IRBlock* block = order[i];
+	  IRBlock* idom = NULL;
+
+	  for (size_t p = 0; p < block->preds.size(); p++)
+	    {
+	      IRBlock* pred = block->preds[p];
+	      if (pred->idom == NULL)
+		continue;
+
+	      if (idom == NULL)
+		{
+		  idom = pred;
+		  continue;
+		}
+
+	      IRBlock* a = pred;
+	      IRBlock* b = idom;
+	      while (a != b)
+		{
+		  while (a->rpo > b->rpo)
+		    a = a->idom;
+		  while (b->rpo > a->rpo)
+		    b = b->idom;
+		}
+	      idom = a;
+	    }
+
+	  if (idom != block->idom)
+	    {
+	      block->idom = idom;
+	      changed = true;
+	    }
+	}
+    }
+
+  for (size_t i = 1; i < order.size(); i++)
+    order[i]->idom->domChildren.push_back(order[i]);
+}
+
+bool IRFunction::dominates(IRBlock* a, IRBlock* b)
+{
+  while (b != a && b->idom != b && b->idom != NULL)
+    b = b->idom;
+
+  return a == b;
+}
+
+IRLoop::IRLoop(IRBlock* headerx) : header(headerx), preheader(NULL), depth(1)
+{
+  blocks.insert(header);
+}
+
+bool IRLoop::contains(IRBlock* block)
+{
+  return blocks.count(block) > 0;
+}
+
+/*
+  Loops sharing a header are merged.  Expects up to date dominators; the
+  result is ordered innermost first and the caller owns it.
+*/
+std::vector<IRLoop*> IRFunction::findLoops()
+{
+  std::vector<IRLoop*> loops;
+
+  for (size_t b = 0; b < blocks.size(); b++)
+    {
+      IRBlock* block = blocks[b];
+      block->loopDepth = 0;
+      if (block->rpo < 0)
+	continue;
+
+      for (size_t s = 0; s < block->succs.size(); s++)
+	{
+	  IRBlock* header = block->succs[s];
+	  if (!dominates(header, block))
+	    continue;
+
+	  IRLoop* loop = NULL;
+	  for (size_t l = 0; l < loops.size(); l++)
+	    if (loops[l]->header == header)
+	      loop = loops[l];
+	  if (loop == NULL)
+	    {
+	      loop = new IRLoop(header);
+	      loops.push_back(loop);
+	    }
+
+	  std::vector<IRBlock*> work;
+	  if (loop->blocks.insert(block).second)
+	    work.push_back(block);
+	  while (!work.empty())
+	    {
+	      IRBlock* next = work.back();
+	      work.pop_back();
+	      for (size_t p = 0; p < next->preds.size(); p++)
+		if (next->preds[p]->rpo >= 0 && loop->blocks.insert(next->preds[p]).second)
+		  work.push_back(next->preds[p]);
+	    }
+	}
+    }
+
+  for (size_t l = 0; l < loops.size(); l++)
+    {
+      loops[l]->depth = 0;
+      for (size_t o = 0; o < loops.size(); o++)
+	if (loops[o]->contains(loops[l]->header))
+	  loops[l]->depth++;
+
+      for (std::set<IRBlock*>::iterator it = loops[l]->blocks.begin(); it != loops[l]->blocks.end(); ++it)
+	(*it)->loopDepth = std::max((*it)->loopDepth, loops[l]->depth);
+    }
+
+  for (size_t i = 1; i < loops.size(); i++)
+    for (size_t j = i; j > 0 && loops[j]->depth > loops[j - 1]->depth; j--)
+      std::swap(loops[j], loops[j - 1]);
+
+  return loops;
+}
+
+/*
+  Give the loop a single block that is the only way in from outside.  PHI
+  operands from several outside predecessors are merged there first.
+*/
+IRBlock* IRFunction::makePreheader(IRLoop* loop)
+{
+  IRBlock* header = loop->header;
+  std::vector<int> outside;
+
+  for (size_t p = 0; p < header->preds.size(); p++)
+    if (!loop->contains(header->preds[p]))
+      outside.push_back(p);
+
+  if (outside.size() == 1 && header->preds[outside[0]]->succs.size() == 1)
+    {
+      loop->preheader = header->preds[outside[0]];
+      return loop->preheader;
+    }
+
+  IRBlock* pre = new IRBlock(nextBlock++);
+  blocks.insert(std::find(blocks.begin(), blocks.end(), header), pre);
+
+  for (size_t i = 0; i < header->instrs.size() && header->instrs[i]->op == IRInstr::PHI; i++)
+    {
+      IRInstr* phi = header->instrs[i];
+      IRInstr* value = phi->args[outside[0]];
+
+      if (outside.size() > 1)
+	{
+	  value = newInstr(IRInstr::PHI);
+	  value->block = pre;
+	  for (size_t o = 0; o < outside.size(); o++)
+	    value->args.push_back(phi->args[outside[o]]);
+	  pre->instrs.push_back(value);
+	}
+
+      for (size_t o = outside.size(); o > 0; o--)
+	phi->args.erase(phi->args.begin() + outside[o - 1]);
+      phi->args.push_back(value);
+    }
+
+  for (size_t o = 0; o < outside.size(); o++)
+    {
+      IRBlock* pred = header->preds[outside[o]];
+      pred->replaceSucc(header, pre);
+      pre->preds.push_back(pred);
+    }
+
+  for (size_t o = outside.size(); o > 0; o--)
+    header->preds.erase(header->preds.begin() + outside[o - 1]);
+  header->preds.push_back(pre);
+
+  IRInstr* jump = newInstr(IRInstr::JUMP);
+  jump->block = pre;
+  jump->target[0] = header;
+  pre->instrs.push_back(jump);
+  pre->succs.push_back(header);
+
+  loop->preheader = pre;
+  return pre;
+}
+
+std::string IRFunction::toString(IRInstr* instr)
+{
+  std::string s;
+  std::string value = "v" + std::to_string(static_cast<long long>(instr->id));
+
+  if (instr->hasValue())
+    s = value + " = ";
+
+  switch (instr->op)
+    {
+    case IRInstr::CONST:
+      return s + "const " + std::to_string(instr->imm);
+    case IRInstr::PARAM:
+      return s + "param " + std::to_string(instr->imm);
+    case IRInstr::BINOP:
+      s += binops[instr->binop];
+      break;
+    case IRInstr::PHI:
+      s += "phi";
+      break;
+    case IRInstr::COPY:
+      s += "copy";
+      break;
+    case IRInstr::CALL:
+      s += "call " + instr->name;
+      break;
+    case IRInstr::PRINTF:
+      s += "printf \"" + instr->name + "\"";
+      break;
+    case IRInstr::JUMP:
+      return "jump B" + std::to_string(static_cast<long long>(instr->target[0]->id));
+    case IRInstr::BRANCH:
+      s += "branch";
+      break;
+    case IRInstr::RET:
+      s += "ret";
+      break;
+    }
+
+  for (size_t i = 0; i < instr->args.size(); i++)
+    {
+      s += (i == 0 && instr->op != IRInstr::CALL && instr->op != IRInstr::PRINTF) ? " " : ", ";
+      s += "v" + std::to_string(static_cast<long long>(instr->args[i]->id));
+      if (instr->op == IRInstr::PHI)
+	s += " B" + std::to_string(static_cast<long long>(instr->block->preds[i]->id));
+    }
+
+  if (instr->op == IRInstr::BRANCH)
+    s += ", B" + std::to_string(static_cast<long long>(instr->target[0]->id)) +
+      ", B" + std::to_string(static_cast<long long>(instr->target[1]->id));
+
+  return s;
+}
+
+void IRFunction::print(std::ostream& os)
+{
+  os << "function " << name << std::endl;
+
+  for (size_t b = 0; b < blocks.size(); b++)
+    {
+      IRBlock* block = blocks[b];
+      os << "B" << block->id << ":";
+      for (size_t p = 0; p < block->preds.size(); p++)
+	os << (p == 0 ? " ; preds B" : ", B") << block->preds[p]->id;
+      os << std::endl;
+
+      for (size_t i = 0; i < block->instrs.size(); i++)
+	os << "  " << toString(block->instrs[i]) << std::endl;
+    }
+}
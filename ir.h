@@ -0,0 +1,103 @@
+#pragma once
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+class IRBlock;
+
+// One SSA value or side-effecting instruction.  Binary operators keep the
+// Parser::Operation they were lowered from in binop.
+class IRInstr
+{
+public:
+  enum Opcode {
+    CONST, PARAM, BINOP, PHI, COPY, // Values
+    CALL, PRINTF, // Side effects
+    JUMP, BRANCH, RET // Terminators
+  };
+
+  IRInstr(Opcode opx, int idx);
+
+  bool isPure();
+  bool isTerminator();
+  bool hasValue();
+
+  Opcode op;
+  int id;
+  int binop;               // BINOP: Parser::Operation
+  long long imm;           // CONST: value, PARAM: paramCount
+  int slot;                // Variable the value was first stored to, or 0
+  std::string name;        // CALL: callee, PRINTF: format string
+  std::vector<IRInstr*> args;
+  IRBlock* block;
+  IRBlock* target[2];      // JUMP: target[0], BRANCH: nonzero/zero targets
+  bool mark;
+};
+
+class IRBlock
+{
+public:
+  IRBlock(int idx);
+
+  IRInstr* terminator();
+  int predIndex(IRBlock* pred);
+  void removePred(IRBlock* pred);
+  void replaceSucc(IRBlock* from, IRBlock* to);
+
+  int id;
+  std::vector<IRInstr*> instrs; // PHIs first, terminator last
+  std::vector<IRBlock*> preds;
+  std::vector<IRBlock*> succs;
+  IRBlock* idom;
+  std::vector<IRBlock*> domChildren;
+  int rpo;
+  int loopDepth;
+};
+
+// A natural loop: the header plus every block that reaches a back edge
+// into it without passing through the header
+class IRLoop
+{
+public:
+  IRLoop(IRBlock* headerx);
+
+  bool contains(IRBlock* block);
+
+  IRBlock* header;
+  IRBlock* preheader;
+  std::set<IRBlock*> blocks;
+  int depth;
+};
+
+class IRFunction
+{
+public:
+  IRFunction(std::string namex);
+  ~IRFunction();
+
+  IRBlock* newBlock();
+  IRInstr* newInstr(IRInstr::Opcode op);
+  IRInstr* constant(long long value);
+
+  void replaceAllUses(IRInstr* from, IRInstr* to);
+  int useCount(IRInstr* value);
+  void removeBlock(IRBlock* block);
+  void removeUnreachable();
+  bool mergeBlocks();
+  void splitCriticalEdges();
+  void computeDominators();
+  bool dominates(IRBlock* a, IRBlock* b);
+  std::vector<IRLoop*> findLoops();
+  IRBlock* makePreheader(IRLoop* loop);
+
+  void print(std::ostream& os);
+  static std::string toString(IRInstr* instr);
+
+  std::string name;
+  std::vector<IRBlock*> blocks; // blocks[0] is the entry
+  std::vector<IRInstr*> pool;   // owns every instruction ever created
+  int nextBlock;
+  int nextValue;
+};
@@ -0,0 +1,421 @@
+#include "irbuilder.h"
+#include "stats.h"
+#include "compileerror.h"
+
+#include <algorithm>
+
+IRBuilder::IRBuilder() : m_function(NULL), m_labels(NULL), m_varcnt(0)
+{
+
+}
+
+IRBuilder::~IRBuilder()
+{
+
+}
+
+std::vector<IRFunction*> IRBuilder::build(Parser::TreeNode* program)
+{
+  STAT_TIMER(OPTIMIZE);
+  std::vector<Parser::TreeNode*> code;
+  std::vector<IRFunction*> functions;
+  linearize(program, code);
+
+  size_t begin = 0;
+  while (begin < code.size())
+    {
+      size_t end = begin + 1;
+      while (end < code.size() && code[end]->op != Parser::FUNC)
+	end++;
+
+      if (code[begin]->op == Parser::FUNC)
+	functions.push_back(buildFunction(code, begin, end));
+      begin = end;
+    }
+
+  return functions;
+}
+
+/*
+  First split the stack code into basic blocks and wire up the edges, then
+  replay each block.  A block is sealed once all of its predecessors have
+  been filled.
+*/
+IRFunction* IRBuilder::buildFunction(std::vector<Parser::TreeNode*>& code, size_t begin, size_t end)
+{
+  IRFunction* f = new IRFunction(code[begin]->val);
+  std::map<std::string, IRBlock*> labels;
+  std::vector<size_t> first;
+  std::vector<size_t> last;
+
+  m_function = f;
+  m_currentDef.clear();
+  m_incompletePhis.clear();
+  m_sealed.clear();
+  m_filled.clear();
+  m_varcnt = 0;
+
+  f->newBlock();
+  first.push_back(begin + 1);
+  last.push_back(begin + 1);
+  bool ended = false;
+
+  for (size_t i = begin + 1; i < end; i++)
+    {
+      Parser::TreeNode* node = code[i];
+
+      if (node->op == Parser::LABEL)
+	{
+	  labels[node->val.substr(0, node->val.size() - 1)] = f->newBlock();
+	  first.push_back(i + 1);
+	  last.push_back(i + 1);
+	  ended = false;
+	  continue;
+	}
+
+      if (ended)
+	{
+	  f->newBlock();
+	  first.push_back(i);
+	  last.push_back(i);
+	  ended = false;
+	}
+
+      last.back() = i + 1;
+      if (node->op == Parser::JUMP || node->op == Parser::JUMPF ||
+	  node->op == Parser::JUMPT || node->op == Parser::RET)
+	ended = true;
+    }
+
+  size_t count = f->blocks.size();
+  std::vector<IRBlock*> blocks = f->blocks;
+
+  for (size_t k = 0; k < count; k++)
+    {
+      IRBlock* block = blocks[k];
+      IRBlock* next = (k + 1 < count) ? blocks[k + 1] : NULL;
+      Parser::TreeNode* node = (last[k] > first[k]) ? code[last[k] - 1] : NULL;
+      std::vector<IRBlock*> succs;
+
+      if (node != NULL && node->op != Parser::RET && node->op != Parser::JUMP && next != NULL)
+	succs.push_back(next);
+
+      if (node != NULL && (node->op == Parser::JUMP || node->op == Parser::JUMPF || node->op == Parser::JUMPT))
+	{
+	  if (!labels.count(node->val))
+	    throw CompileError("In IRBuilder: Unknown label " + node->val);
+	  if (std::find(succs.begin(), succs.end(), labels[node->val]) == succs.end())
+	    succs.push_back(labels[node->val]);
+	}
+
+      if (node == NULL && next != NULL)
+	succs.push_back(next);
+
+      for (size_t s = 0; s < succs.size(); s++)
+	{
+	  block->succs.push_back(succs[s]);
+	  succs[s]->preds.push_back(block);
+	}
+    }
+
+  for (size_t k = 0; k < count; k++)
+    {
+      IRBlock* block = blocks[k];
+      bool ready = true;
+      for (size_t p = 0; p < block->preds.size(); p++)
+	ready = ready && m_filled.count(block->preds[p]);
+      if (ready && !m_sealed.count(block))
+	sealBlock(block);
+
+      m_labels = &labels;
+      fillBlock(block, code, first[k], last[k]);
+      m_filled.insert(block);
+
+      for (size_t s = 0; s < block->succs.size(); s++)
+	{
+	  IRBlock* succ = block->succs[s];
+	  bool done = true;
+	  for (size_t p = 0; p < succ->preds.size(); p++)
+	    done = done && m_filled.count(succ->preds[p]);
+	  if (done && !m_sealed.count(succ))
+	    sealBlock(succ);
+	}
+    }
+
+  return f;
+}
+
+void IRBuilder::fillBlock(IRBlock* block, std::vector<Parser::TreeNode*>& code, size_t begin, size_t end)
+{
+  IRInstr* instr;
+  IRInstr* a;
+  IRInstr* b;
+  int n;
+
+  m_stack.clear();
+
+  for (size_t i = begin; i < end; i++)
+    {
+      Parser::TreeNode* node = code[i];
+
+      switch (node->op) {
+      case Parser::LOADL:
+	m_stack.push_back(m_function->constant(node->literal()));
+	break;
+      case Parser::LOADV:
+	m_stack.push_back(readVariable(std::stoi(node->val), block));
+	break;
+      case Parser::STORE:
+	instr = append(block, IRInstr::COPY);
+	instr->args.push_back(pop());
+	instr->slot = std::stoi(node->val);
+	writeVariable(instr->slot, block, instr);
+	break;
+      case Parser::ADD:
+      case Parser::SUB:
+      case Parser::MULT:
+      case Parser::DIV:
+      case Parser::ISEQ:
+      case Parser::ISNE:
+      case Parser::ISLT:
+      case Parser::ISLE:
+      case Parser::ISGT:
+      case Parser::ISGE:
+      case Parser::AND:
+      case Parser::OR:
+	b = pop();
+	a = pop();
+	instr = append(block, IRInstr::BINOP);
+	instr->binop = node->op;
+	instr->args.push_back(a);
+	instr->args.push_back(b);
+	m_stack.push_back(instr);
+	break;
+      case Parser::CALL:
+	a = pop();
+	if (a->op != IRInstr::CONST)
+	  throw CompileError("In IRBuilder: CALL without argument count");
+	instr = append(block, IRInstr::CALL);
+	instr->name = node->val;
+	instr->args.resize(a->imm / 8);
+	for (n = instr->args.size() - 1; n >= 0; n--)
+	  instr->args[n] = pop();
+	m_stack.push_back(instr);
+	break;
+      case Parser::PRINTF:
+	instr = append(block, IRInstr::PRINTF);
+	instr->name = node->val;
+	instr->args.resize(node->paramCount);
+	for (n = instr->args.size() - 1; n >= 0; n--)
+	  instr->args[n] = pop();
+	break;
+      case Parser::PARAM:
+	instr = append(block, IRInstr::PARAM);
+	instr->imm = node->paramCount;
+	instr->slot = ++m_varcnt;
+	writeVariable(instr->slot, block, instr);
+	break;
+      case Parser::JUMP:
+	instr = append(block, IRInstr::JUMP);
+	instr->target[0] = (*m_labels)[node->val];
+	break;
+      case Parser::JUMPF:
+      case Parser::JUMPT:
+	a = pop();
+	if (block->succs.size() == 1)
+	  {
+	    instr = append(block, IRInstr::JUMP);
+	    instr->target[0] = block->succs[0];
+	    break;
+	  }
+	instr = append(block, IRInstr::BRANCH);
+	instr->args.push_back(a);
+	instr->target[node->op == Parser::JUMPF ? 0 : 1] = block->succs[0];
+	instr->target[node->op == Parser::JUMPF ? 1 : 0] = block->succs[1];
+	break;
+      case Parser::RET:
+	a = pop();
+	instr = append(block, IRInstr::RET);
+	instr->args.push_back(a);
+	break;
+      default:
+	throw CompileError("In IRBuilder: Unexpected operation " + std::to_string(static_cast<long long>(node->op)));
+      }
+    }
+
+  if (block->terminator() == NULL)
+    {
+      if (block->succs.size() == 1)
+	{
+	  instr = append(block, IRInstr::JUMP);
+	  instr->target[0] = block->succs[0];
+	}
+      else
+	{
+	  // Falling off the end of a function returns 0
+	  a = m_function->constant(0);
+	  instr = append(block, IRInstr::RET);
+	  instr->args.push_back(a);
+	}
+    }
+}
+
+void IRBuilder::sealBlock(IRBlock* block)
+{
+  std::map<int, IRInstr*> phis = m_incompletePhis[block];
+  m_incompletePhis.erase(block);
+
+  for (std::map<int, IRInstr*>::iterator it = phis.begin(); it != phis.end(); ++it)
+    addPhiOperands(it->first, it->second);
+
+  m_sealed.insert(block);
+}
+
+void IRBuilder::writeVariable(int var, IRBlock* block, IRInstr* value)
+{
+  m_currentDef[var][block] = value;
+}
+
+IRInstr* IRBuilder::readVariable(int var, IRBlock* block)
+{
+  std::map<IRBlock*, IRInstr*>& defs = m_currentDef[var];
+  std::map<IRBlock*, IRInstr*>::iterator it = defs.find(block);
+  if (it != defs.end())
+    return it->second;
+
+  return readVariableRecursive(var, block);
+}
+
+IRInstr* IRBuilder::readVariableRecursive(int var, IRBlock* block)
+{
+  IRInstr* value;
+
+  if (!m_sealed.count(block))
+    {
+      value = newPhi(block);
+      m_incompletePhis[block][var] = value;
+    }
+  else if (block->preds.size() == 1)
+    {
+      value = readVariable(var, block->preds[0]);
+    }
+  else if (block->preds.empty())
+    {
+      // Read of a variable that was never assigned
+      value = m_function->constant(0);
+    }
+  else
+    {
+      value = newPhi(block);
+      writeVariable(var, block, value);
+      value = addPhiOperands(var, value);
+    }
+
+  writeVariable(var, block, value);
+  return value;
+}
+
+IRInstr* IRBuilder::addPhiOperands(int var, IRInstr* phi)
+{
+  IRBlock* block = phi->block;
+
+  for (size_t p = 0; p < block->preds.size(); p++)
+    phi->args.push_back(readVariable(var, block->preds[p]));
+
+  return tryRemoveTrivialPhi(phi);
+}
+
+/*
+  A PHI whose operands are all the same value (or itself) is just that value
+*/
+IRInstr* IRBuilder::tryRemoveTrivialPhi(IRInstr* phi)
+{
+  IRInstr* same = NULL;
+
+  for (size_t i = 0; i < phi->args.size(); i++)
+    {
+      IRInstr* op = phi->args[i];
+      if (op == same || op == phi)
+	continue;
+      if (same != NULL)
+	return phi;
+      same = op;
+    }
+
+  if (same == NULL)
+    same = m_function->constant(0);
+
+  std::vector<IRInstr*> users;
+  for (size_t b = 0; b < m_function->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = m_function->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	if (instrs[i] != phi && instrs[i]->op == IRInstr::PHI &&
+	    std::find(instrs[i]->args.begin(), instrs[i]->args.end(), phi) != instrs[i]->args.end())
+	  users.push_back(instrs[i]);
+    }
+
+  std::vector<IRInstr*>& instrs = phi->block->instrs;
+  instrs.erase(std::find(instrs.begin(), instrs.end(), phi));
+  replace(phi, same);
+
+  for (size_t i = 0; i < users.size(); i++)
+    tryRemoveTrivialPhi(users[i]);
+
+  return same;
+}
+
+void IRBuilder::replace(IRInstr* from, IRInstr* to)
+{
+  m_function->replaceAllUses(from, to);
+  std::replace(m_stack.begin(), m_stack.end(), from, to);
+
+  for (std::map<int, std::map<IRBlock*, IRInstr*> >::iterator v = m_currentDef.begin(); v != m_currentDef.end(); ++v)
+    for (std::map<IRBlock*, IRInstr*>::iterator d = v->second.begin(); d != v->second.end(); ++d)
+      if (d->second == from)
+	d->second = to;
+}
+
+IRInstr* IRBuilder::newPhi(IRBlock* block)
+{
+  IRInstr* phi = m_function->newInstr(IRInstr::PHI);
+  std::vector<IRInstr*>::iterator pos = block->instrs.begin();
+  while (pos != block->instrs.end() && (*pos)->op == IRInstr::PHI)
+    ++pos;
+
+  phi->block = block;
+  block->instrs.insert(pos, phi);
+  return phi;
+}
+
+IRInstr* IRBuilder::append(IRBlock* block, IRInstr::Opcode op)
+{
+  IRInstr* instr = m_function->newInstr(op);
+  instr->block = block;
+  block->instrs.push_back(instr);
+  return instr;
+}
+
+IRInstr* IRBuilder::pop()
+{
+  if (m_stack.empty())
+    throw CompileError("In IRBuilder: Stack underflow");
+
+  IRInstr* value = m_stack.back();
+  m_stack.pop_back();
+  return value;
+}
+
+/*
+  The instruction order geninst emits: every non-SEQ node in post-order
+*/
+void IRBuilder::linearize(Parser::TreeNode* node, std::vector<Parser::TreeNode*>& out)
+{
+  if (node == NULL)
+    return;
+
+  linearize(node->leftChild, out);
+  linearize(node->rightChild, out);
+  if (node->op != Parser::SEQ)
+    out.push_back(node);
+}
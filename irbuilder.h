@@ -0,0 +1,48 @@
+#pragma once
+
+#include "parser.h"
+#include "ir.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+// Lowers the Parser::TreeNode tree of a compilation unit into one SSA-form
+// control flow graph per function.  SSA is built on the fly while the stack
+// code is replayed, following Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form".
+class IRBuilder
+{
+public:
+  IRBuilder();
+  ~IRBuilder();
+
+  std::vector<IRFunction*> build(Parser::TreeNode* program);
+
+private:
+  IRFunction* buildFunction(std::vector<Parser::TreeNode*>& code, size_t begin, size_t end);
+  void fillBlock(IRBlock* block, std::vector<Parser::TreeNode*>& code, size_t begin, size_t end);
+  void sealBlock(IRBlock* block);
+
+  void writeVariable(int var, IRBlock* block, IRInstr* value);
+  IRInstr* readVariable(int var, IRBlock* block);
+  IRInstr* readVariableRecursive(int var, IRBlock* block);
+  IRInstr* addPhiOperands(int var, IRInstr* phi);
+  IRInstr* tryRemoveTrivialPhi(IRInstr* phi);
+  void replace(IRInstr* from, IRInstr* to);
+
+  IRInstr* newPhi(IRBlock* block);
+  IRInstr* append(IRBlock* block, IRInstr::Opcode op);
+  IRInstr* pop();
+
+  static void linearize(Parser::TreeNode* node, std::vector<Parser::TreeNode*>& out);
+
+  IRFunction* m_function;
+  std::map<std::string, IRBlock*>* m_labels;
+  std::vector<IRInstr*> m_stack;
+  std::map<int, std::map<IRBlock*, IRInstr*> > m_currentDef;
+  std::map<IRBlock*, std::map<int, IRInstr*> > m_incompletePhis;
+  std::set<IRBlock*> m_sealed;
+  std::set<IRBlock*> m_filled;
+  int m_varcnt;
+};
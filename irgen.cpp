@@ -0,0 +1,548 @@
+#include "irgen.h"
+#include "stats.h"
+
+#include <algorithm>
+
+// Bytes below rsp that signal handlers and the kernel leave alone
+static const int REDZONE = 128;
+
+// Deepest expression tree; keeps the selector within its register pool
+static const int MAXHEIGHT = 6;
+
+IRGen::IRGen(Parser& parserx) : omitFramePointer(true), isel(parserx), parser(parserx),
+				mir(parserx.mir), m_function(NULL), m_frame(0), m_leaf(false)
+{
+
+}
+
+IRGen::~IRGen()
+{
+
+}
+
+int IRGen::label(IRBlock* block)
+{
+  return mir.symbol(".B" + std::to_string(static_cast<long long>(block->id)));
+}
+
+/*
+  offset is relative to the frame base: rbp, or for leaf functions the
+  value rsp had on entry
+*/
+MOperand IRGen::frameSlot(int offset)
+{
+  if (m_leaf)
+    return MOperand::mem(RSP, offset + m_frame);
+
+  return MOperand::mem(RBP, offset);
+}
+
+MOperand IRGen::home(IRInstr* value)
+{
+  return frameSlot(-m_home[value] * 8);
+}
+
+/*
+  Arguments sit above the return address and the argument byte count, and
+  above the saved rbp when there is one
+*/
+MOperand IRGen::param(long long paramCount)
+{
+  if (m_leaf)
+    return frameSlot((paramCount + 1) * 8);
+
+  return frameSlot((paramCount + 2) * 8);
+}
+
+void IRGen::load(int reg, IRInstr* value)
+{
+  if (value->op == IRInstr::CONST)
+    mir.add(MInstr::MOV, MOperand::reg(reg), MOperand::imm(value->imm));
+  else
+    mir.add(MInstr::MOV, MOperand::reg(reg), home(value));
+}
+
+void IRGen::store(IRInstr* value, int reg)
+{
+  mir.add(MInstr::MOV, home(value), MOperand::reg(reg));
+}
+
+void IRGen::gen(IRFunction* f)
+{
+  STAT_TIMER(CODEGEN);
+  int slots;
+
+  m_function = f;
+  isel.reset();
+
+  f->splitCriticalEdges();
+  findTrees(f);
+  slots = assignHomes(f);
+
+  m_leaf = omitFramePointer;
+  for (size_t b = 0; b < f->blocks.size() && m_leaf; b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	if (instrs[i]->op == IRInstr::CALL || instrs[i]->op == IRInstr::PRINTF)
+	  m_leaf = false;
+    }
+
+  mir.label(mir.symbol(f->name));
+
+  if (m_leaf)
+    {
+      // Nothing below rsp survives a call, but a leaf makes none
+      m_frame = (slots * 8 <= REDZONE) ? 0 : slots * 8;
+      if (m_frame > 0)
+	mir.add(MInstr::SUB, MOperand::reg(RSP), MOperand::imm(m_frame));
+    }
+  else
+    {
+      m_frame = (slots * 8 + 15) & ~15;
+      mir.add(MInstr::PUSH, MOperand::reg(RBP));
+      mir.add(MInstr::MOV, MOperand::reg(RBP), MOperand::reg(RSP));
+      if (m_frame > 0)
+	mir.add(MInstr::SUB, MOperand::reg(RSP), MOperand::imm(m_frame));
+    }
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    genBlock(f->blocks[b], b + 1 < f->blocks.size() ? f->blocks[b + 1] : NULL);
+
+  mir.blank();
+}
+
+/*
+  A value with a single use later in the same block is computed where it
+  is used, as part of the user's expression tree, unless a call could
+  observe the difference (a division trapping before or after output)
+*/
+void IRGen::findTrees(IRFunction* f)
+{
+  std::map<IRInstr*, int> uses;
+  std::map<IRInstr*, IRInstr*> user;
+  std::map<IRInstr*, int> height;
+
+  m_folded.clear();
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	for (size_t a = 0; a < instrs[i]->args.size(); a++)
+	  {
+	    uses[instrs[i]->args[a]]++;
+	    user[instrs[i]->args[a]] = instrs[i];
+	  }
+    }
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	{
+	  IRInstr* instr = instrs[i];
+	  int h = 0;
+
+	  for (size_t a = 0; a < instr->args.size(); a++)
+	    if (m_folded.count(instr->args[a]))
+	      h = std::max(h, height[instr->args[a]]);
+	  height[instr] = h + 1;
+
+	  if (instr->op != IRInstr::BINOP || uses[instr] != 1 || height[instr] > MAXHEIGHT)
+	    continue;
+
+	  IRInstr* u = user[instr];
+	  if (u->block != instr->block)
+	    continue;
+	  if (u->op != IRInstr::BINOP && u->op != IRInstr::COPY && u->op != IRInstr::BRANCH &&
+	      u->op != IRInstr::RET && u->op != IRInstr::CALL)
+	    continue;
+
+	  bool blocked = false;
+	  size_t j;
+	  for (j = i + 1; j < instrs.size() && instrs[j] != u; j++)
+	    if (instrs[j]->op == IRInstr::CALL || instrs[j]->op == IRInstr::PRINTF)
+	      blocked = true;
+
+	  if (!blocked && j < instrs.size())
+	    m_folded.insert(instr);
+	}
+    }
+}
+
+bool IRGen::homed(IRInstr* value)
+{
+  return value->hasValue() && value->op != IRInstr::CONST && !m_folded.count(value);
+}
+
+// Values read by instr, looking through the trees folded into it
+void IRGen::addUses(IRInstr* instr, std::set<IRInstr*>& live)
+{
+  for (size_t a = 0; a < instr->args.size(); a++)
+    {
+      if (m_folded.count(instr->args[a]))
+	addUses(instr->args[a], live);
+      else if (homed(instr->args[a]))
+	live.insert(instr->args[a]);
+    }
+}
+
+/*
+  Backward liveness over slots.  Records, for every value with a slot, the
+  values live just after its definition; two values interfere when one is
+  live where the other is defined.
+*/
+void IRGen::computeLiveness(IRFunction* f, std::map<IRInstr*, std::set<IRInstr*> >& liveAfter)
+{
+  std::map<IRBlock*, std::set<IRInstr*> > liveIn;
+  bool changed = true;
+
+  while (changed)
+    {
+      changed = false;
+
+      for (size_t b = f->blocks.size(); b-- > 0; )
+	{
+	  IRBlock* block = f->blocks[b];
+	  std::set<IRInstr*> live;
+	  std::set<IRInstr*> phis;
+
+	  for (size_t s = 0; s < block->succs.size(); s++)
+	    {
+	      IRBlock* succ = block->succs[s];
+	      int idx = succ->predIndex(block);
+
+	      live.insert(liveIn[succ].begin(), liveIn[succ].end());
+	      for (size_t i = 0; i < succ->instrs.size() && succ->instrs[i]->op == IRInstr::PHI; i++)
+		if (homed(succ->instrs[i]->args[idx]))
+		  live.insert(succ->instrs[i]->args[idx]);
+	    }
+
+	  for (size_t i = block->instrs.size(); i-- > 0; )
+	    {
+	      IRInstr* instr = block->instrs[i];
+
+	      if (instr->op == IRInstr::PHI)
+		{
+		  phis.insert(instr);
+		  continue;
+		}
+	      if (m_folded.count(instr))
+		continue;
+	      if (homed(instr))
+		{
+		  liveAfter[instr] = live;
+		  live.erase(instr);
+		}
+	      addUses(instr, live);
+	    }
+
+	  // PHIs are all defined at once on entry
+	  for (std::set<IRInstr*>::iterator p = phis.begin(); p != phis.end(); ++p)
+	    {
+	      liveAfter[*p] = live;
+	      liveAfter[*p].insert(phis.begin(), phis.end());
+	    }
+	  for (std::set<IRInstr*>::iterator p = phis.begin(); p != phis.end(); ++p)
+	    live.erase(*p);
+
+	  if (live != liveIn[block])
+	    {
+	      liveIn[block] = live;
+	      changed = true;
+	    }
+	}
+    }
+}
+
+/*
+  Gives every value that is not folded into a tree a frame slot.  A PHI
+  shares its slot with its operands when none of their live ranges
+  overlap, which turns most loop variables back into a single memory
+  location that can be updated in place.
+*/
+int IRGen::assignHomes(IRFunction* f)
+{
+  std::map<IRInstr*, std::set<IRInstr*> > liveAfter;
+  std::map<IRInstr*, int> web;
+  std::vector<std::vector<IRInstr*> > members;
+  std::vector<int> slotOf;
+  int slots = 0;
+
+  computeLiveness(f, liveAfter);
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	if (homed(instrs[i]))
+	  {
+	    web[instrs[i]] = members.size();
+	    members.push_back(std::vector<IRInstr*>(1, instrs[i]));
+	  }
+    }
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size() && instrs[i]->op == IRInstr::PHI; i++)
+	for (size_t a = 0; a < instrs[i]->args.size(); a++)
+	  {
+	    IRInstr* arg = instrs[i]->args[a];
+	    if (!homed(arg) || web[arg] == web[instrs[i]])
+	      continue;
+
+	    std::vector<IRInstr*>& x = members[web[instrs[i]]];
+	    std::vector<IRInstr*>& y = members[web[arg]];
+	    bool interfere = false;
+
+	    for (size_t m = 0; m < x.size() && !interfere; m++)
+	      for (size_t n = 0; n < y.size() && !interfere; n++)
+		if (liveAfter[x[m]].count(y[n]) || liveAfter[y[n]].count(x[m]))
+		  interfere = true;
+
+	    if (interfere)
+	      continue;
+
+	    for (size_t n = 0; n < y.size(); n++)
+	      {
+		x.push_back(y[n]);
+		web[y[n]] = web[instrs[i]];
+	      }
+	    y.clear();
+	  }
+    }
+
+  m_home.clear();
+  slotOf.assign(members.size(), 0);
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	if (homed(instrs[i]))
+	  {
+	    int w = web[instrs[i]];
+	    if (slotOf[w] == 0)
+	      slotOf[w] = ++slots;
+	    m_home[instrs[i]] = slotOf[w];
+	  }
+    }
+
+  return slots;
+}
+
+ISel::Node* IRGen::tree(IRInstr* value)
+{
+  if (value->op == IRInstr::CONST)
+    return isel.constant(value->imm);
+  if (m_folded.count(value))
+    return expr(value);
+  return isel.slot(m_home[value], home(value));
+}
+
+/*
+  Constants go on the right of commutative operators so the immediate
+  forms of the patterns apply
+*/
+ISel::Node* IRGen::expr(IRInstr* value)
+{
+  IRInstr* left = value->args[0];
+  IRInstr* right = value->args[1];
+
+  if (left->op == IRInstr::CONST && right->op != IRInstr::CONST &&
+      (value->binop == Parser::ADD || value->binop == Parser::MULT ||
+       value->binop == Parser::AND || value->binop == Parser::OR))
+    std::swap(left, right);
+
+  return isel.binary(value->binop, tree(left), tree(right));
+}
+
+void IRGen::genBlock(IRBlock* block, IRBlock* next)
+{
+  if (block != m_function->blocks[0])
+    mir.label(label(block));
+
+  for (size_t i = 0; i < block->instrs.size(); i++)
+    {
+      IRInstr* instr = block->instrs[i];
+
+      if (m_folded.count(instr))
+	continue;
+
+      switch (instr->op) {
+      case IRInstr::CONST:
+      case IRInstr::PHI:
+	break;
+      case IRInstr::PARAM:
+	mir.add(MInstr::MOV, MOperand::reg(RAX), param(instr->imm));
+	store(instr, RAX);
+	break;
+      case IRInstr::COPY:
+	if (!homed(instr->args[0]) || m_home[instr->args[0]] != m_home[instr])
+	  isel.select(isel.store(m_home[instr], home(instr), tree(instr->args[0])));
+	break;
+      case IRInstr::BINOP:
+	isel.select(isel.store(m_home[instr], home(instr), expr(instr)));
+	break;
+      case IRInstr::CALL:
+	genCall(instr);
+	break;
+      case IRInstr::PRINTF:
+	genPrintf(instr);
+	break;
+      case IRInstr::JUMP:
+	phiCopies(block, instr->target[0]);
+	if (instr->target[0] != next)
+	  mir.add(MInstr::JMP, MOperand::label(label(instr->target[0])));
+	break;
+      case IRInstr::BRANCH:
+	isel.select(isel.branch(tree(instr->args[0]), label(instr->target[1])));
+	if (instr->target[0] != next)
+	  mir.add(MInstr::JMP, MOperand::label(label(instr->target[0])));
+	break;
+      case IRInstr::RET:
+	isel.select(isel.ret(tree(instr->args[0])));
+	epilogue();
+	break;
+      }
+    }
+}
+
+void IRGen::epilogue()
+{
+  if (!m_leaf)
+    {
+      mir.add(MInstr::MOV, MOperand::reg(RSP), MOperand::reg(RBP));
+      mir.add(MInstr::POP, MOperand::reg(RBP));
+    }
+  else if (m_frame > 0)
+    {
+      mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::imm(m_frame));
+    }
+
+  mir.add(MInstr::RET);
+}
+
+/*
+  Same convention as geninst: arguments pushed left to right, then their
+  size in bytes, which the caller pops to clean up
+*/
+void IRGen::genCall(IRInstr* instr)
+{
+  for (size_t a = 0; a < instr->args.size(); a++)
+    isel.select(isel.push(tree(instr->args[a])));
+
+  isel.select(isel.push(isel.constant(instr->args.size() * 8)));
+  mir.add(MInstr::CALL, MOperand::label(mir.symbol(instr->name)));
+  mir.add(MInstr::POP, MOperand::reg(RBX));
+  mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::reg(RBX));
+  store(instr, RAX);
+}
+
+void IRGen::genPrintf(IRInstr* instr)
+{
+  static const int regs[] = { RSI, RDX, RCX, R8, R9 };
+  size_t nargs = instr->args.size();
+
+  if (parser.specializePrintf)
+    {
+      std::vector<MOperand> args;
+      for (size_t a = 0; a < nargs; a++)
+	args.push_back(instr->args[a]->op == IRInstr::CONST ?
+		       MOperand::imm(instr->args[a]->imm) : home(instr->args[a]));
+      if (parser.genPrintfChunks(instr->name, args))
+	return;
+    }
+
+  int fmt = parser.formatSymbol(instr->name);
+
+  for (size_t a = 0; a < nargs && a < 5; a++)
+    load(regs[a], instr->args[a]);
+
+  mir.add(MInstr::MOV, MOperand::reg(RDI), MOperand::label(fmt));
+  mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(0));
+  mir.add(MInstr::MOV, MOperand::reg(RBX), MOperand::reg(RSP));
+  mir.add(MInstr::AND, MOperand::reg(RSP), MOperand::imm(-16));
+  // Arguments past the fifth go on the stack, the sixth on top, with the
+  // stack still 16-byte aligned at the call
+  if (nargs > 5)
+    {
+      if ((nargs - 5) % 2)
+	mir.add(MInstr::SUB, MOperand::reg(RSP), MOperand::imm(8));
+      for (size_t a = nargs - 1; a >= 5; a--)
+	{
+	  load(R11, instr->args[a]);
+	  mir.add(MInstr::PUSH, MOperand::reg(R11));
+	}
+    }
+  mir.add(MInstr::CALL, MOperand::label(mir.symbol("printf")));
+  mir.add(MInstr::MOV, MOperand::reg(RSP), MOperand::reg(RBX));
+}
+
+/*
+  PHIs read their operands simultaneously.  Copies are ordered so no slot
+  is overwritten while another copy still needs it, and a cycle is broken
+  by parking one value in rcx.  Nothing is pushed, which keeps the red zone
+  of leaf functions intact.  A PHI sharing its operand's slot needs no copy.
+*/
+void IRGen::phiCopies(IRBlock* pred, IRBlock* succ)
+{
+  std::vector<int> dests;
+  std::vector<IRInstr*> srcs;
+  std::vector<bool> parked;   // Source already copied to rcx
+  int idx = succ->predIndex(pred);
+
+  for (size_t i = 0; i < succ->instrs.size() && succ->instrs[i]->op == IRInstr::PHI; i++)
+    {
+      IRInstr* phi = succ->instrs[i];
+      IRInstr* arg = phi->args[idx];
+      if (!homed(arg) || m_home[arg] != m_home[phi])
+	{
+	  dests.push_back(m_home[phi]);
+	  srcs.push_back(arg);
+	  parked.push_back(false);
+	}
+    }
+
+  while (!dests.empty())
+    {
+      bool progress = false;
+
+      for (size_t i = 0; i < dests.size(); )
+	{
+	  bool needed = false;
+	  for (size_t j = 0; j < srcs.size(); j++)
+	    if (j != i && !parked[j] && homed(srcs[j]) && m_home[srcs[j]] == dests[i])
+	      needed = true;
+
+	  if (needed)
+	    {
+	      i++;
+	      continue;
+	    }
+
+	  if (parked[i])
+	    mir.add(MInstr::MOV, frameSlot(-dests[i] * 8), MOperand::reg(RCX));
+	  else
+	    {
+	      load(RAX, srcs[i]);
+	      mir.add(MInstr::MOV, frameSlot(-dests[i] * 8), MOperand::reg(RAX));
+	    }
+
+	  dests.erase(dests.begin() + i);
+	  srcs.erase(srcs.begin() + i);
+	  parked.erase(parked.begin() + i);
+	  progress = true;
+	}
+
+      if (!progress)
+	{
+	  // Only cycles remain; save one destination so its copy can go first
+	  mir.add(MInstr::MOV, MOperand::reg(RCX), frameSlot(-dests[0] * 8));
+	  for (size_t j = 0; j < srcs.size(); j++)
+	    if (homed(srcs[j]) && m_home[srcs[j]] == dests[0])
+	      parked[j] = true;
+	}
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "parser.h"
+#include "ir.h"
+#include "isel.h"
+
+#include <map>
+#include <set>
+#include <string>
+
+// Lowers optimized SSA functions to x86-64 assembly.  Single-use values
+// are folded into expression trees that the instruction selector tiles;
+// every other value gets a frame slot, shared across a PHI web when the
+// live ranges allow it, and PHIs become copies on the incoming edges.
+// Leaf functions skip the frame pointer and keep their slots in the SysV
+// red zone below rsp when they fit.
+class IRGen
+{
+public:
+  IRGen(Parser& parserx);
+  ~IRGen();
+
+  void gen(IRFunction* f);
+
+  bool omitFramePointer;
+  ISel isel;
+
+private:
+  void findTrees(IRFunction* f);
+  int assignHomes(IRFunction* f);
+  void computeLiveness(IRFunction* f, std::map<IRInstr*, std::set<IRInstr*> >& liveAfter);
+  void addUses(IRInstr* instr, std::set<IRInstr*>& live);
+  bool homed(IRInstr* value);
+
+  ISel::Node* tree(IRInstr* value);
+  ISel::Node* expr(IRInstr* value);
+
+  void genBlock(IRBlock* block, IRBlock* next);
+  void genCall(IRInstr* instr);
+  void genPrintf(IRInstr* instr);
+  void phiCopies(IRBlock* pred, IRBlock* succ);
+  void epilogue();
+
+  void load(int reg, IRInstr* value);
+  void store(IRInstr* value, int reg);
+  MOperand home(IRInstr* value);
+  MOperand param(long long paramCount);
+  MOperand frameSlot(int offset);
+  int label(IRBlock* block);
+
+  Parser& parser;
+  MBuffer& mir;
+  IRFunction* m_function;
+  std::map<IRInstr*, int> m_home;
+  std::set<IRInstr*> m_folded;
+  int m_frame;
+  bool m_leaf;
+};
@@ -0,0 +1,354 @@
+#include "iropt.h"
+#include "stats.h"
+#include "parser.h"
+#include "unroller.h"
+
+#include <algorithm>
+
+IROptimizer::IROptimizer() : copies(0), redundant(0), folded(0), dead(0), hoist(true)
+{
+
+}
+
+IROptimizer::~IROptimizer()
+{
+
+}
+
+void IROptimizer::run(IRFunction* f)
+{
+  STAT_TIMER(OPTIMIZE);
+  // Folded branches expose more copies and constants, so repeat until stable
+  for (int round = 0; round < 4; round++)
+    {
+      int before = copies + redundant + folded;
+      copyPropagation(f);
+      valueNumbering(f);
+      f->removeUnreachable();
+      f->mergeBlocks();
+      if (copies + redundant + folded == before)
+	break;
+    }
+
+  if (hoist && licm.run(f) > 0)
+    {
+      valueNumbering(f);
+      f->mergeBlocks();
+    }
+
+  copyPropagation(f);
+  deadCodeElimination(f);
+}
+
+/*
+  Follow the chain of values an instruction has been replaced by
+*/
+IRInstr* IROptimizer::resolve(IRInstr* value)
+{
+  std::map<IRInstr*, IRInstr*>::iterator it = m_forward.find(value);
+  if (it == m_forward.end())
+    return value;
+
+  IRInstr* root = resolve(it->second);
+  it->second = root;
+  return root;
+}
+
+/*
+  Point every operand at its final replacement and drop replaced instructions
+*/
+void IROptimizer::rewrite(IRFunction* f)
+{
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      std::vector<IRInstr*> kept;
+
+      for (size_t i = 0; i < instrs.size(); i++)
+	{
+	  if (m_forward.count(instrs[i]))
+	    continue;
+	  for (size_t a = 0; a < instrs[i]->args.size(); a++)
+	    instrs[i]->args[a] = resolve(instrs[i]->args[a]);
+	  kept.push_back(instrs[i]);
+	}
+
+      instrs.swap(kept);
+    }
+
+  m_forward.clear();
+}
+
+/*
+  Remove copies and PHIs whose operands all name the same value
+*/
+void IROptimizer::copyPropagation(IRFunction* f)
+{
+  bool changed = true;
+
+  while (changed)
+    {
+      changed = false;
+      for (size_t b = 0; b < f->blocks.size(); b++)
+	{
+	  std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+	  for (size_t i = 0; i < instrs.size(); i++)
+	    {
+	      IRInstr* instr = instrs[i];
+	      if (m_forward.count(instr))
+		continue;
+
+	      if (instr->op == IRInstr::COPY)
+		{
+		  m_forward[instr] = resolve(instr->args[0]);
+		  copies++;
+		  changed = true;
+		}
+
+	      else if (instr->op == IRInstr::PHI)
+		{
+		  IRInstr* same = NULL;
+		  bool trivial = true;
+		  for (size_t a = 0; a < instr->args.size() && trivial; a++)
+		    {
+		      IRInstr* op = resolve(instr->args[a]);
+		      if (op == instr || op == same)
+			continue;
+		      trivial = (same == NULL);
+		      same = op;
+		    }
+
+		  if (trivial && same != NULL)
+		    {
+		      m_forward[instr] = same;
+		      copies++;
+		      changed = true;
+		    }
+		}
+	    }
+	}
+    }
+
+  rewrite(f);
+}
+
+/*
+  Algebraic identities and constant folding for a BINOP whose operands have
+  already been numbered.  Returns the value the instruction can be replaced by.
+*/
+IRInstr* IROptimizer::simplify(IRInstr* instr)
+{
+  IRInstr* a = instr->args[0];
+  IRInstr* b = instr->args[1];
+  long long result;
+
+  if (a->op == IRInstr::CONST && b->op == IRInstr::CONST &&
+      Unroller::foldBinary(instr->binop, a->imm, b->imm, result))
+    {
+      instr->op = IRInstr::CONST;
+      instr->binop = 0;
+      instr->imm = result;
+      instr->args.clear();
+      folded++;
+      return instr;
+    }
+
+  switch (instr->binop)
+    {
+    case Parser::ADD:
+      if (a->op == IRInstr::CONST && a->imm == 0)
+	return b;
+      if (b->op == IRInstr::CONST && b->imm == 0)
+	return a;
+      break;
+    case Parser::SUB:
+      if (b->op == IRInstr::CONST && b->imm == 0)
+	return a;
+      break;
+    case Parser::MULT:
+      if (a->op == IRInstr::CONST && a->imm == 0)
+	return a;
+      if (b->op == IRInstr::CONST && b->imm == 0)
+	return b;
+      if (a->op == IRInstr::CONST && a->imm == 1)
+	return b;
+      if (b->op == IRInstr::CONST && b->imm == 1)
+	return a;
+      break;
+    case Parser::DIV:
+      if (b->op == IRInstr::CONST && b->imm == 1)
+	return a;
+      break;
+    }
+
+  return instr;
+}
+
+/*
+  A branch on a constant becomes a jump, and the untaken edge goes away
+*/
+void IROptimizer::foldBranch(IRInstr* instr)
+{
+  IRBlock* block = instr->block;
+  IRBlock* taken = instr->target[instr->args[0]->imm ? 0 : 1];
+  IRBlock* untaken = instr->target[instr->args[0]->imm ? 1 : 0];
+
+  instr->op = IRInstr::JUMP;
+  instr->args.clear();
+  instr->target[0] = taken;
+  instr->target[1] = NULL;
+
+  untaken->removePred(block);
+  block->succs.erase(std::find(block->succs.begin(), block->succs.end(), untaken));
+  folded++;
+}
+
+/*
+  Dominator-tree walk with a scoped hash table: a pure instruction whose
+  opcode and operands match one in a dominating block is redundant
+*/
+void IROptimizer::valueNumbering(IRFunction* f)
+{
+  std::map<std::vector<long long>, IRInstr*> table;
+  std::vector<std::pair<IRBlock*, size_t> > stack;
+  std::vector<std::vector<std::vector<long long> > > scopes;
+
+  f->computeDominators();
+  stack.push_back(std::make_pair(f->blocks[0], 0));
+  scopes.push_back(std::vector<std::vector<long long> >());
+
+  bool entering = true;
+  while (!stack.empty())
+    {
+      IRBlock* block = stack.back().first;
+
+      if (entering)
+	{
+	  std::vector<std::vector<long long> >& scope = scopes.back();
+
+	  for (size_t i = 0; i < block->instrs.size(); i++)
+	    {
+	      IRInstr* instr = block->instrs[i];
+	      if (m_forward.count(instr))
+		continue;
+
+	      for (size_t a = 0; a < instr->args.size(); a++)
+		instr->args[a] = resolve(instr->args[a]);
+
+	      if (instr->op == IRInstr::BRANCH && instr->args[0]->op == IRInstr::CONST)
+		{
+		  foldBranch(instr);
+		  continue;
+		}
+
+	      if (instr->op == IRInstr::BINOP)
+		{
+		  IRInstr* value = simplify(instr);
+		  if (value != instr)
+		    {
+		      m_forward[instr] = value;
+		      folded++;
+		      continue;
+		    }
+		}
+
+	      if (instr->op != IRInstr::CONST && instr->op != IRInstr::BINOP &&
+		  instr->op != IRInstr::PARAM && instr->op != IRInstr::PHI)
+		continue;
+
+	      std::vector<long long> key;
+	      key.push_back(instr->op);
+	      key.push_back(instr->binop);
+	      key.push_back(instr->imm);
+	      if (instr->op == IRInstr::PHI)
+		key.push_back(block->id);
+	      for (size_t a = 0; a < instr->args.size(); a++)
+		key.push_back(instr->args[a]->id);
+
+	      if (instr->op == IRInstr::BINOP &&
+		  (instr->binop == Parser::ADD || instr->binop == Parser::MULT || instr->binop == Parser::ISEQ ||
+		   instr->binop == Parser::ISNE || instr->binop == Parser::AND || instr->binop == Parser::OR))
+		std::sort(key.begin() + 3, key.end());
+
+	      std::map<std::vector<long long>, IRInstr*>::iterator it = table.find(key);
+	      if (it != table.end())
+		{
+		  m_forward[instr] = it->second;
+		  redundant++;
+		}
+	      else
+		{
+		  table[key] = instr;
+		  scope.push_back(key);
+		}
+	    }
+
+	  entering = false;
+	}
+
+      size_t next = stack.back().second++;
+      if (next < block->domChildren.size())
+	{
+	  stack.push_back(std::make_pair(block->domChildren[next], 0));
+	  scopes.push_back(std::vector<std::vector<long long> >());
+	  entering = true;
+	}
+      else
+	{
+	  std::vector<std::vector<long long> >& scope = scopes.back();
+	  for (size_t k = 0; k < scope.size(); k++)
+	    table.erase(scope[k]);
+	  scopes.pop_back();
+	  stack.pop_back();
+	}
+    }
+
+  rewrite(f);
+}
+
+/*
+  Keep calls, printf and terminators plus everything they depend on
+*/
+void IROptimizer::deadCodeElimination(IRFunction* f)
+{
+  std::vector<IRInstr*> work;
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      for (size_t i = 0; i < instrs.size(); i++)
+	{
+	  instrs[i]->mark = !instrs[i]->isPure();
+	  if (instrs[i]->mark)
+	    work.push_back(instrs[i]);
+	}
+    }
+
+  while (!work.empty())
+    {
+      IRInstr* instr = work.back();
+      work.pop_back();
+      for (size_t a = 0; a < instr->args.size(); a++)
+	{
+	  if (!instr->args[a]->mark)
+	    {
+	      instr->args[a]->mark = true;
+	      work.push_back(instr->args[a]);
+	    }
+	}
+    }
+
+  for (size_t b = 0; b < f->blocks.size(); b++)
+    {
+      std::vector<IRInstr*>& instrs = f->blocks[b]->instrs;
+      std::vector<IRInstr*> kept;
+      for (size_t i = 0; i < instrs.size(); i++)
+	{
+	  if (instrs[i]->mark)
+	    kept.push_back(instrs[i]);
+	  else
+	    dead++;
+	}
+      instrs.swap(kept);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ir.h"
+#include "licm.h"
+
+#include <map>
+#include <vector>
+
+// Scalar optimizations on the SSA form: copy propagation, dominator-based
+// global value numbering with constant folding, loop-invariant code motion
+// and dead code elimination.
+class IROptimizer
+{
+public:
+  IROptimizer();
+  ~IROptimizer();
+
+  void run(IRFunction* f);
+
+  void copyPropagation(IRFunction* f);
+  void valueNumbering(IRFunction* f);
+  void deadCodeElimination(IRFunction* f);
+
+  int copies;
+  int redundant;
+  int folded;
+  int dead;
+
+  bool hoist;
+  LICM licm;
+
+private:
+  IRInstr* resolve(IRInstr* value);
+  IRInstr* simplify(IRInstr* instr);
+  void foldBranch(IRInstr* instr);
+  void rewrite(IRFunction* f);
+
+  std::map<IRInstr*, IRInstr*> m_forward;
+};
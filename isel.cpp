@@ -0,0 +1,611 @@
+#include "isel.h"
+#include "compileerror.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+static const int INFINITE = 1 << 28;
+
+// Scratch registers available to tiles.  rax and rdx are left out because
+// idiv needs them and the code around the selector uses rax freely.
+static const int POOL[] = { R11, R10, R9, R8, RDI, RSI, RCX, RBX };
+
+static const struct { const char* name; int op; } OPNAMES[] = {
+  { "ADD", Parser::ADD }, { "SUB", Parser::SUB }, { "MULT", Parser::MULT },
+  { "DIV", Parser::DIV }, { "AND", Parser::AND }, { "OR", Parser::OR },
+  { "ISEQ", Parser::ISEQ }, { "ISNE", Parser::ISNE }, { "ISLT", Parser::ISLT },
+  { "ISLE", Parser::ISLE }, { "ISGT", Parser::ISGT }, { "ISGE", Parser::ISGE },
+  { "CONST", ISel::CONSTANT }, { "SLOT", ISel::SLOT }, { "STORE", ISel::STORE },
+  { "BRANCH", ISel::BRANCH }, { "RET", ISel::RET }, { "PUSH", ISel::PUSH },
+  { "ALU", ISel::ALU }, { "REL", ISel::REL },
+  { "reg", -ISel::REG - 1 }, { "mem", -ISel::MEM - 1 }, { "imm", -ISel::IMM - 1 },
+  { "cond", -ISel::COND - 1 },
+  { NULL, 0 }
+};
+
+static MInstr::Opcode mnemonic(int op)
+{
+  switch (op)
+    {
+    case Parser::ADD:
+      return MInstr::ADD;
+    case Parser::SUB:
+      return MInstr::SUB;
+    case Parser::MULT:
+      return MInstr::IMUL;
+    case Parser::AND:
+      return MInstr::AND;
+    default:
+      return MInstr::OR;
+    }
+}
+
+/* Guards */
+
+static bool fitsImm32(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return n->imm >= -2147483647LL - 1 && n->imm <= 2147483647LL;
+}
+
+static bool lastIsOne(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return leaves.back()->imm == 1;
+}
+
+static bool lastIsPow2(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  long long v = leaves.back()->imm;
+  return v >= 2 && v <= (1LL << 30) && (v & (v - 1)) == 0;
+}
+
+static bool lastIsLea(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  long long v = leaves.back()->imm;
+  return v == 3 || v == 5 || v == 9;
+}
+
+static bool isScale(long long v)
+{
+  return v == 2 || v == 4 || v == 8;
+}
+
+static bool scaleLast(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return isScale(leaves.back()->imm);
+}
+
+static bool scaleMiddle(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return isScale(leaves[1]->imm);
+}
+
+// Read-modify-write forms need the destination to be the left operand
+static bool sameSlot(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return leaves[0]->slot == n->slot;
+}
+
+static bool sameSlotOne(ISel::Node* n, std::vector<ISel::Node*>& leaves)
+{
+  return sameSlot(n, leaves) && leaves[1]->imm == 1;
+}
+
+/* Emitters */
+
+#define EMITTER(name) \
+  static MOperand name(ISel& s, ISel::Node* n, std::vector<ISel::Node*>& leaves, \
+		       std::vector<MOperand>& ops)
+
+EMITTER(emitSlot)
+{
+  return n->mem;
+}
+
+EMITTER(emitImm)
+{
+  return MOperand::imm(n->imm);
+}
+
+EMITTER(emitMovImm)
+{
+  MOperand r = MOperand::reg(s.allocReg());
+  s.mir.add(MInstr::MOV, r, MOperand::imm(n->imm));
+  return r;
+}
+
+EMITTER(emitLoad)
+{
+  MOperand r = MOperand::reg(s.allocReg());
+  s.mir.add(MInstr::MOV, r, n->mem);
+  return r;
+}
+
+EMITTER(emitAlu)
+{
+  s.mir.add(mnemonic(n->op), ops[0], ops[1]);
+  return ops[0];
+}
+
+EMITTER(emitInc)
+{
+  s.mir.add(n->op == Parser::ADD ? MInstr::INC : MInstr::DEC, ops[0]);
+  return ops[0];
+}
+
+EMITTER(emitShl)
+{
+  int shift = 0;
+  for (long long v = leaves[1]->imm; v > 1; v >>= 1)
+    shift++;
+  s.mir.add(MInstr::SHL, ops[0], MOperand::imm(shift));
+  return ops[0];
+}
+
+EMITTER(emitImulImm)
+{
+  s.mir.add(MInstr::IMUL, ops[0], ops[0], ops[1]);
+  return ops[0];
+}
+
+// x*3, x*5, x*9
+EMITTER(emitLeaMul)
+{
+  s.mir.add(MInstr::LEA, ops[0], MOperand::addr(ops[0].base, ops[0].base, leaves[1]->imm - 1, 0));
+  return ops[0];
+}
+
+// ADD(reg,MULT(reg,imm))
+EMITTER(emitLeaScale)
+{
+  s.mir.add(MInstr::LEA, ops[0], MOperand::addr(ops[0].base, ops[1].base, ops[2].value, 0));
+  return ops[0];
+}
+
+// ADD(MULT(reg,imm),reg)
+EMITTER(emitLeaScaleLeft)
+{
+  s.mir.add(MInstr::LEA, ops[0], MOperand::addr(ops[2].base, ops[0].base, ops[1].value, 0));
+  return ops[0];
+}
+
+// ADD(ADD(reg,reg),imm)
+EMITTER(emitLeaAdd)
+{
+  s.mir.add(MInstr::LEA, ops[0], MOperand::addr(ops[0].base, ops[1].base, 1, ops[2].value));
+  return ops[0];
+}
+
+EMITTER(emitDiv)
+{
+  s.mir.add(MInstr::MOV, MOperand::reg(RAX), ops[0]);
+  s.mir.add(MInstr::CQO);
+  s.mir.add(MInstr::IDIV, ops[1]);
+  s.mir.add(MInstr::MOV, ops[0], MOperand::reg(RAX));
+  return ops[0];
+}
+
+// The condition code travels as an immediate
+EMITTER(emitCmp)
+{
+  s.mir.add(MInstr::CMP, ops[0], ops[1]);
+  return MOperand::imm(Parser::relationalCondition(n->op));
+}
+
+EMITTER(emitSetcc)
+{
+  int r = s.allocReg();
+  s.mir.setcc(ops[0].value, r);
+  s.mir.add(MInstr::MOVZX, MOperand::reg(r), MOperand::reg8(r));
+  return MOperand::reg(r);
+}
+
+EMITTER(emitStore)
+{
+  s.mir.add(MInstr::MOV, n->mem, ops[0]);
+  return MOperand();
+}
+
+EMITTER(emitAluMem)
+{
+  s.mir.add(mnemonic(n->kids[0]->op), n->mem, ops[1]);
+  return MOperand();
+}
+
+EMITTER(emitIncMem)
+{
+  s.mir.add(n->kids[0]->op == Parser::ADD ? MInstr::INC : MInstr::DEC, n->mem);
+  return MOperand();
+}
+
+EMITTER(emitJcc)
+{
+  s.mir.jcc(MBuffer::invert(ops[0].value), n->target);
+  return MOperand();
+}
+
+EMITTER(emitTestBranch)
+{
+  s.mir.add(MInstr::TEST, ops[0], ops[0]);
+  s.mir.jcc(MInstr::E, n->target);
+  return MOperand();
+}
+
+EMITTER(emitCmpBranch)
+{
+  s.mir.add(MInstr::CMP, ops[0], MOperand::imm(0));
+  s.mir.jcc(MInstr::E, n->target);
+  return MOperand();
+}
+
+EMITTER(emitRet)
+{
+  s.mir.add(MInstr::MOV, MOperand::reg(RAX), ops[0]);
+  return MOperand();
+}
+
+EMITTER(emitPush)
+{
+  s.mir.add(MInstr::PUSH, ops[0]);
+  return MOperand();
+}
+
+/*
+  The default x86-64 rule table.  Costs are roughly twice the number of
+  instructions, plus one for a memory operand, so shorter encodings such as
+  inc win ties against add.
+*/
+ISel::ISel(Parser& parserx) : mir(parserx.mir), tiles(0)
+{
+  // Leaves
+  addRule(MEM, "SLOT", 0, NULL, emitSlot);
+  addRule(IMM, "CONST", 0, fitsImm32, emitImm);
+  addRule(REG, "CONST", 2, NULL, emitMovImm);
+  addRule(REG, "SLOT", 3, NULL, emitLoad);
+
+  // Arithmetic
+  addRule(REG, "ALU(reg,reg)", 2, NULL, emitAlu);
+  addRule(REG, "ALU(reg,imm)", 2, NULL, emitAlu);
+  addRule(REG, "ALU(reg,mem)", 3, NULL, emitAlu);
+  addRule(REG, "ADD(reg,imm)", 1, lastIsOne, emitInc);
+  addRule(REG, "SUB(reg,imm)", 1, lastIsOne, emitInc);
+  addRule(REG, "MULT(reg,reg)", 6, NULL, emitAlu);
+  addRule(REG, "MULT(reg,mem)", 7, NULL, emitAlu);
+  addRule(REG, "MULT(reg,imm)", 6, NULL, emitImulImm);
+  addRule(REG, "MULT(reg,imm)", 2, lastIsPow2, emitShl);
+  addRule(REG, "MULT(reg,imm)", 2, lastIsLea, emitLeaMul);
+  addRule(REG, "ADD(reg,MULT(reg,imm))", 2, scaleLast, emitLeaScale);
+  addRule(REG, "ADD(MULT(reg,imm),reg)", 2, scaleMiddle, emitLeaScaleLeft);
+  addRule(REG, "ADD(ADD(reg,reg),imm)", 2, NULL, emitLeaAdd);
+  addRule(REG, "DIV(reg,reg)", 40, NULL, emitDiv);
+  addRule(REG, "DIV(reg,mem)", 41, NULL, emitDiv);
+
+  // Relational operators set the flags; a value is only made when needed
+  addRule(COND, "REL(reg,reg)", 2, NULL, emitCmp);
+  addRule(COND, "REL(reg,imm)", 2, NULL, emitCmp);
+  addRule(COND, "REL(reg,mem)", 3, NULL, emitCmp);
+  addRule(COND, "REL(mem,reg)", 3, NULL, emitCmp);
+  addRule(COND, "REL(mem,imm)", 3, NULL, emitCmp);
+  addRule(REG, "cond", 4, NULL, emitSetcc);
+
+  // Statements
+  addRule(STMT, "STORE(reg)", 2, NULL, emitStore);
+  addRule(STMT, "STORE(imm)", 2, NULL, emitStore);
+  addRule(STMT, "STORE(ALU(mem,imm))", 4, sameSlot, emitAluMem);
+  addRule(STMT, "STORE(ALU(mem,reg))", 4, sameSlot, emitAluMem);
+  addRule(STMT, "STORE(ADD(mem,imm))", 3, sameSlotOne, emitIncMem);
+  addRule(STMT, "STORE(SUB(mem,imm))", 3, sameSlotOne, emitIncMem);
+  addRule(STMT, "BRANCH(cond)", 2, NULL, emitJcc);
+  addRule(STMT, "BRANCH(reg)", 4, NULL, emitTestBranch);
+  addRule(STMT, "BRANCH(mem)", 4, NULL, emitCmpBranch);
+  addRule(STMT, "RET(reg)", 2, NULL, emitRet);
+  addRule(STMT, "RET(imm)", 2, NULL, emitRet);
+  addRule(STMT, "RET(mem)", 2, NULL, emitRet);
+  addRule(STMT, "PUSH(reg)", 2, NULL, emitPush);
+  addRule(STMT, "PUSH(imm)", 2, NULL, emitPush);
+  addRule(STMT, "PUSH(mem)", 3, NULL, emitPush);
+
+  reset();
+}
+
+ISel::~ISel()
+{
+  for (size_t i = 0; i < m_rules.size(); i++)
+    freePattern(m_rules[i].pattern);
+  for (size_t i = 0; i < m_nodes.size(); i++)
+    delete m_nodes[i];
+}
+
+void ISel::addRule(NT nt, const char* pattern, int cost, Guard guard, Emitter emitter)
+{
+  Rule rule;
+  const char* p = pattern;
+
+  rule.nt = nt;
+  rule.text = pattern;
+  rule.pattern = parse(p);
+  rule.cost = cost;
+  rule.guard = guard;
+  rule.emitter = emitter;
+
+  if (*p != '\0')
+    throw CompileError(std::string("Bad instruction pattern ") + pattern);
+
+  m_rules.push_back(rule);
+}
+
+ISel::Pattern* ISel::parse(const char*& p)
+{
+  Pattern* pat = new Pattern();
+  size_t len = 0;
+
+  pat->op = 0;
+  pat->nt = NONE;
+  pat->kids[0] = pat->kids[1] = NULL;
+
+  while (isalnum(p[len]))
+    len++;
+
+  int i;
+  for (i = 0; OPNAMES[i].name != NULL; i++)
+    if (strlen(OPNAMES[i].name) == len && !strncmp(OPNAMES[i].name, p, len))
+      break;
+
+  if (OPNAMES[i].name == NULL)
+    throw CompileError("Unknown operator in instruction pattern: " + std::string(p, len));
+
+  if (OPNAMES[i].op < 0)
+    pat->nt = -OPNAMES[i].op - 1;
+  else
+    pat->op = OPNAMES[i].op;
+  p += len;
+
+  if (*p == '(')
+    {
+      p++;
+      pat->kids[0] = parse(p);
+      if (*p == ',')
+	{
+	  p++;
+	  pat->kids[1] = parse(p);
+	}
+      if (*p++ != ')')
+	throw CompileError("Expected ) in instruction pattern");
+    }
+
+  return pat;
+}
+
+void ISel::freePattern(Pattern* p)
+{
+  if (p == NULL)
+    return;
+  freePattern(p->kids[0]);
+  freePattern(p->kids[1]);
+  delete p;
+}
+
+ISel::Node* ISel::newNode(int op)
+{
+  Node* n = new Node();
+  n->op = op;
+  n->imm = 0;
+  n->slot = 0;
+  n->target = 0;
+  n->kids[0] = n->kids[1] = NULL;
+  m_nodes.push_back(n);
+  return n;
+}
+
+ISel::Node* ISel::constant(long long value)
+{
+  Node* n = newNode(CONSTANT);
+  n->imm = value;
+  return n;
+}
+
+ISel::Node* ISel::slot(int slot, MOperand operand)
+{
+  Node* n = newNode(SLOT);
+  n->slot = slot;
+  n->mem = operand;
+  return n;
+}
+
+ISel::Node* ISel::binary(int op, Node* left, Node* right)
+{
+  Node* n = newNode(op);
+  n->kids[0] = left;
+  n->kids[1] = right;
+  return n;
+}
+
+ISel::Node* ISel::store(int slot, MOperand dest, Node* value)
+{
+  Node* n = newNode(STORE);
+  n->slot = slot;
+  n->mem = dest;
+  n->kids[0] = value;
+  return n;
+}
+
+ISel::Node* ISel::branch(Node* cond, int falseLabel)
+{
+  Node* n = newNode(BRANCH);
+  n->target = falseLabel;
+  n->kids[0] = cond;
+  return n;
+}
+
+ISel::Node* ISel::ret(Node* value)
+{
+  Node* n = newNode(RET);
+  n->kids[0] = value;
+  return n;
+}
+
+ISel::Node* ISel::push(Node* value)
+{
+  Node* n = newNode(PUSH);
+  n->kids[0] = value;
+  return n;
+}
+
+bool ISel::matches(int pop, int op)
+{
+  if (pop == ALU)
+    return op == Parser::ADD || op == Parser::SUB || op == Parser::AND || op == Parser::OR;
+  if (pop == REL)
+    return op >= Parser::ISEQ && op <= Parser::ISGE;
+  return pop == op;
+}
+
+bool ISel::match(Pattern* p, Node* n, std::vector<Node*>& leaves,
+		 std::vector<int>& nts, int& cost)
+{
+  if (p->nt != NONE)
+    {
+      if (n->cost[p->nt] >= INFINITE)
+	return false;
+      cost += n->cost[p->nt];
+      leaves.push_back(n);
+      nts.push_back(p->nt);
+      return true;
+    }
+
+  if (!matches(p->op, n->op))
+    return false;
+
+  for (int k = 0; k < 2; k++)
+    {
+      if ((p->kids[k] == NULL) != (n->kids[k] == NULL))
+	return false;
+      if (p->kids[k] != NULL && !match(p->kids[k], n->kids[k], leaves, nts, cost))
+	return false;
+    }
+
+  return true;
+}
+
+/*
+  Bottom-up labelling: the cheapest rule for each nonterminal, then chain
+  rules until nothing improves
+*/
+void ISel::label(Node* n)
+{
+  bool changed = true;
+
+  for (int k = 0; k < 2; k++)
+    if (n->kids[k] != NULL)
+      label(n->kids[k]);
+
+  for (int nt = 0; nt < NTCOUNT; nt++)
+    {
+      n->cost[nt] = INFINITE;
+      n->rule[nt] = -1;
+    }
+
+  for (size_t r = 0; r < m_rules.size(); r++)
+    {
+      std::vector<Node*> leaves;
+      std::vector<int> nts;
+      int cost = m_rules[r].cost;
+
+      if (m_rules[r].pattern->nt != NONE)
+	continue;
+      if (!match(m_rules[r].pattern, n, leaves, nts, cost))
+	continue;
+      if (m_rules[r].guard != NULL && !m_rules[r].guard(n, leaves))
+	continue;
+      if (cost < n->cost[m_rules[r].nt])
+	{
+	  n->cost[m_rules[r].nt] = cost;
+	  n->rule[m_rules[r].nt] = r;
+	}
+    }
+
+  while (changed)
+    {
+      changed = false;
+      for (size_t r = 0; r < m_rules.size(); r++)
+	{
+	  std::vector<Node*> leaves;
+	  std::vector<int> nts;
+	  int cost = m_rules[r].cost;
+
+	  if (m_rules[r].pattern->nt == NONE)
+	    continue;
+	  if (!match(m_rules[r].pattern, n, leaves, nts, cost))
+	    continue;
+	  if (m_rules[r].guard != NULL && !m_rules[r].guard(n, leaves))
+	    continue;
+	  if (cost < n->cost[m_rules[r].nt])
+	    {
+	      n->cost[m_rules[r].nt] = cost;
+	      n->rule[m_rules[r].nt] = r;
+	      changed = true;
+	    }
+	}
+    }
+}
+
+MOperand ISel::reduce(Node* n, int nt)
+{
+  std::vector<Node*> leaves;
+  std::vector<int> nts;
+  std::vector<MOperand> ops;
+  int cost = 0;
+
+  if (n->rule[nt] < 0)
+    throw CompileError("No instruction pattern covers the expression");
+
+  Rule& rule = m_rules[n->rule[nt]];
+  match(rule.pattern, n, leaves, nts, cost);
+
+  for (size_t i = 0; i < leaves.size(); i++)
+    ops.push_back(reduce(leaves[i], nts[i]));
+
+  MOperand result = rule.emitter(*this, n, leaves, ops);
+  tiles++;
+
+  for (size_t i = 0; i < ops.size(); i++)
+    if (nts[i] == REG && !(ops[i] == result))
+      freeReg(ops[i].base);
+
+  return result;
+}
+
+void ISel::select(Node* root)
+{
+  label(root);
+  reduce(root, STMT);
+
+  for (size_t i = 0; i < m_nodes.size(); i++)
+    delete m_nodes[i];
+  m_nodes.clear();
+}
+
+/*
+  Refills the register pool in its first order.  The order the registers
+  come back in depends on the trees selected, so every function starts
+  from here to get the same code whichever functions came before it.
+*/
+void ISel::reset()
+{
+  m_free.assign(POOL, POOL + sizeof(POOL) / sizeof(POOL[0]));
+}
+
+int ISel::allocReg()
+{
+  if (m_free.empty())
+    throw CompileError("Expression too deep for the register pool");
+
+  int r = m_free.back();
+  m_free.pop_back();
+  return r;
+}
+
+void ISel::freeReg(int reg)
+{
+  m_free.push_back(reg);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "parser.h"
+#include "mir.h"
+
+#include <string>
+#include <vector>
+
+// Tree-pattern instruction selector.  Expression trees are labelled bottom
+// up with the cheapest rule for every nonterminal (BURS style dynamic
+// programming) and then reduced top down, emitting one tile per rule into
+// the parser's machine code buffer.
+//
+// Rules are written as patterns over node operators, e.g.
+// "ADD(reg,MULT(reg,imm))", where lowercase names are nonterminals that the
+// matched subtree must already reduce to.  A pattern that is just a
+// nonterminal is a chain rule.  New rules can be added with addRule.
+class ISel
+{
+public:
+  // Nonterminals
+  enum NT { NONE = -1, REG, MEM, IMM, COND, STMT, NTCOUNT };
+
+  // Node operators beyond the Parser::Operation binary operators.  ALU and
+  // REL only appear in patterns and match a family of operators.
+  enum Kind { CONSTANT = 100, SLOT, STORE, BRANCH, RET, PUSH, ALU, REL };
+
+  class Node
+  {
+  public:
+    int op;
+    long long imm;       // CONSTANT: value
+    int slot;            // SLOT, STORE: frame slot number
+    MOperand mem;        // SLOT, STORE: the slot's memory operand
+    int target;          // BRANCH: label taken when the value is zero
+    Node* kids[2];
+    int cost[NTCOUNT];
+    int rule[NTCOUNT];
+  };
+
+  typedef bool (*Guard)(Node* n, std::vector<Node*>& leaves);
+  typedef MOperand (*Emitter)(ISel& s, Node* n, std::vector<Node*>& leaves,
+			      std::vector<MOperand>& ops);
+
+  ISel(Parser& parserx);
+  ~ISel();
+
+  void addRule(NT nt, const char* pattern, int cost, Guard guard, Emitter emitter);
+
+  Node* constant(long long value);
+  Node* slot(int slot, MOperand operand);
+  Node* binary(int op, Node* left, Node* right);
+  Node* store(int slot, MOperand dest, Node* value);
+  Node* branch(Node* cond, int falseLabel);
+  Node* ret(Node* value);
+  Node* push(Node* value);
+
+  void select(Node* root);
+  void reset();
+
+  // Used by the rule emitters
+  int allocReg();
+
+  MBuffer& mir;
+  int tiles;
+
+private:
+  class Pattern
+  {
+  public:
+    int op;
+    int nt;
+    Pattern* kids[2];
+  };
+
+  class Rule
+  {
+  public:
+    NT nt;
+    std::string text;
+    Pattern* pattern;
+    int cost;
+    Guard guard;
+    Emitter emitter;
+  };
+
+  Node* newNode(int op);
+  Pattern* parse(const char*& p);
+  void freePattern(Pattern* p);
+  bool matches(int pop, int op);
+  bool match(Pattern* p, Node* n, std::vector<Node*>& leaves,
+	     std::vector<int>& nts, int& cost);
+  void label(Node* n);
+  MOperand reduce(Node* n, int nt);
+  void freeReg(int reg);
+
+  std::vector<Rule> m_rules;
+  std::vector<Node*> m_nodes;
+  std::vector<int> m_free;
+};
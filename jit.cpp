@@ -0,0 +1,112 @@
+#include "jit.h"
+#include "x86enc.h"
+#include "compileerror.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// movabs r11,imm64; jmp r11.  r11 is scratch in the ABI and, unlike rax,
+// does not carry the vararg register count to printf.
+static const unsigned char STUB[] = { 0x49, 0xBB, 0, 0, 0, 0, 0, 0, 0, 0, 0x41, 0xFF, 0xE3 };
+static const size_t STUBSIZE = 16;
+
+static size_t alignUp(size_t n, size_t align)
+{
+  return (n + align - 1) / align * align;
+}
+
+JIT::JIT(MBuffer& mirx) : codeBytes(0), mir(mirx), m_region(NULL), m_size(0)
+{
+
+}
+
+JIT::~JIT()
+{
+  if (m_region)
+    munmap(m_region, m_size);
+}
+
+void JIT::addString(const std::string& name, const std::string& nasmText)
+{
+  std::string s = MBuffer::decodeString(nasmText);
+
+  m_dataSyms[mir.symbol(name)] = m_data.size();
+  m_data.insert(m_data.end(), s.begin(), s.end());
+  m_data.push_back(0);
+}
+
+void JIT::bind(const std::string& name, void* address)
+{
+  m_host[mir.symbol(name)] = address;
+}
+
+/*
+  Lays out [code][stubs][strings] in one mapping, resolves the relocations
+  the encoder left and calls entry.  Host calls go through the stubs since
+  libc is usually mapped too far away for a rel32.
+*/
+long long JIT::run(const std::string& entry)
+{
+  X86Encoder enc(mir);
+  enc.encode();
+  codeBytes = enc.text.size();
+
+  size_t stubs = alignUp(enc.text.size(), 16);
+  size_t data = stubs + m_host.size() * STUBSIZE;
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  m_size = alignUp(data + m_data.size(), pageSize);
+  m_region = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m_region == MAP_FAILED)
+    {
+      m_region = NULL;
+      throw CompileError(std::string("microc: mmap: ") + strerror(errno));
+    }
+
+  unsigned char* base = static_cast<unsigned char*>(m_region);
+  std::map<int, unsigned char*> address;
+
+  memcpy(base, enc.text.data(), enc.text.size());
+  memcpy(base + data, m_data.data(), m_data.size());
+
+  size_t k = 0;
+  for (std::map<int, void*>::iterator it = m_host.begin(); it != m_host.end(); ++it, ++k)
+    {
+      unsigned char* stub = base + stubs + k * STUBSIZE;
+      memcpy(stub, STUB, sizeof(STUB));
+      memcpy(stub + 2, &it->second, 8);
+      address[it->first] = stub;
+    }
+  for (std::map<int, size_t>::iterator it = m_dataSyms.begin(); it != m_dataSyms.end(); ++it)
+    address[it->first] = base + data + it->second;
+
+  for (size_t i = 0; i < enc.relocs.size(); i++)
+    {
+      X86Encoder::Reloc& r = enc.relocs[i];
+      std::map<int, unsigned char*>::iterator s = address.find(r.symbol);
+
+      if (s == address.end())
+	throw CompileError("microc: undefined symbol " + mir.name(r.symbol));
+
+      long long value = (s->second - base) + r.addend - static_cast<long long>(r.offset);
+      int field = static_cast<int>(value);
+      memcpy(base + r.offset, &field, 4);
+    }
+
+  std::map<int, size_t>::iterator start = enc.labels.find(mir.symbol(entry));
+  if (start == enc.labels.end())
+    throw CompileError("microc: no " + entry + " function");
+
+  if (mprotect(m_region, m_size, PROT_READ | PROT_EXEC) != 0)
+    throw CompileError(std::string("microc: mprotect: ") + strerror(errno));
+
+  long long (*fn)() = reinterpret_cast<long long (*)()>(base + start->second);
+  long long result = fn();
+  fflush(stdout);
+  return result;
+}
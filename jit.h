@@ -0,0 +1,32 @@
+#pragma once
+
+#include "mir.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Runs an MBuffer in process.  The code is encoded into an mmap'ed region
+// along with the strings and a jump stub for every host function bound with
+// bind(); relocations are patched against those addresses and the region is
+// made executable before entry is called.
+class JIT
+{
+public:
+  JIT(MBuffer& mirx);
+  ~JIT();
+
+  void addString(const std::string& name, const std::string& nasmText);
+  void bind(const std::string& name, void* address);
+  long long run(const std::string& entry);
+
+  size_t codeBytes;
+
+private:
+  MBuffer& mir;
+  std::vector<unsigned char> m_data;
+  std::map<int, size_t> m_dataSyms;   // Symbol id -> offset in the data
+  std::map<int, void*> m_host;        // Symbol id -> host address
+  void* m_region;
+  size_t m_size;
+};
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cctype>
 #include "lexer.h"
+#include "stats.h"
 #include "token.h"
 
 Lexer::Lexer(std::istream& inputStream) : m_rinputStream(inputStream)
@@ -8,11 +9,18 @@ Lexer::Lexer(std::istream& inputStream) : m_rinputStream(inputStream)
   m_line = 1;
   m_pos = 1;
   lastChar = 0;
+  m_token = NULL;
 }
 
 Lexer::~Lexer()
 {
-  
+  delete m_token;
+}
+
+// True once the input has ended or can no longer be read
+bool Lexer::exhausted()
+{
+  return !m_rinputStream.good();
 }
 
 char Lexer::nextChar()
@@ -32,6 +40,8 @@ char Lexer::nextChar()
   else if (c == '#') {
     while (1) {
       char c2 = m_rinputStream.get();
+      if (m_rinputStream.eof())
+	return '$';
       if (c2 == '\n') {
 	m_line++;
 	m_pos = 1;
@@ -98,7 +108,20 @@ int Lexer::evalulateAlpha(std::string str)
   else return Token::IDENT;
 }
 
+/*
+  The lexer owns the token it returns; it stays valid until the next
+  call to nextToken
+*/
 Token* Lexer::nextToken()
+{
+  STAT_TIMER(LEX);
+  STAT_COUNT(TOKENS, 1);
+  delete m_token;
+  m_token = scan();
+  return m_token;
+}
+
+Token* Lexer::scan()
 {
   // OLD LEXER IMPL
   /*
@@ -256,7 +279,7 @@ Token* Lexer::nextToken()
       if (c == 0x22)
 	{
 	  c = nextChar();
-	  while (c != 0x22)
+	  while (c != 0x22 && !m_rinputStream.eof())
 	    {
 	      str += c;
 	      c = nextChar();
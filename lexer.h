@@ -13,6 +13,7 @@ public:
   
   Token* nextToken();
   Token* handleUnary(char c);
+  bool exhausted();
   int evalulateAlpha(std::string str);
 
   int m_line;
@@ -21,6 +22,8 @@ public:
   char lastChar;  
   
 private:
+  Token* scan();
   char nextChar();
   std::istream& m_rinputStream;
+  Token* m_token;
 };
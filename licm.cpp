@@ -0,0 +1,111 @@
+#include "licm.h"
+#include "parser.h"
+
+#include <algorithm>
+
+LICM::LICM()
+{
+
+}
+
+LICM::~LICM()
+{
+
+}
+
+/*
+  Division is the only pure operation that can trap, so it is only moved
+  when the divisor is a constant that cannot fault
+*/
+bool LICM::safeToSpeculate(IRInstr* instr)
+{
+  if (instr->op != IRInstr::BINOP || instr->binop != Parser::DIV)
+    return true;
+
+  IRInstr* divisor = instr->args[1];
+  return divisor->op == IRInstr::CONST && divisor->imm != 0 && divisor->imm != -1;
+}
+
+bool LICM::invariant(IRLoop* loop, IRInstr* instr)
+{
+  if (instr->op != IRInstr::BINOP || !safeToSpeculate(instr))
+    return false;
+
+  for (size_t a = 0; a < instr->args.size(); a++)
+    if (loop->contains(instr->args[a]->block))
+      return false;
+
+  return true;
+}
+
+int LICM::run(IRFunction* f)
+{
+  int total = 0;
+
+  f->computeDominators();
+  std::vector<IRLoop*> found = f->findLoops();
+  for (size_t l = 0; l < found.size(); l++)
+    f->makePreheader(found[l]);
+  for (size_t l = 0; l < found.size(); l++)
+    delete found[l];
+
+  f->computeDominators();
+  found = f->findLoops();
+
+  for (size_t l = 0; l < found.size(); l++)
+    {
+      IRLoop* loop = found[l];
+      IRBlock* pre = f->makePreheader(loop);
+      std::vector<IRBlock*> order(loop->blocks.begin(), loop->blocks.end());
+      int hoisted = 0;
+
+      // Visit definitions before their uses
+      for (size_t i = 1; i < order.size(); i++)
+	for (size_t j = i; j > 0 && order[j]->rpo < order[j - 1]->rpo; j--)
+	  std::swap(order[j], order[j - 1]);
+
+      for (size_t b = 0; b < order.size(); b++)
+	{
+	  std::vector<IRInstr*>& instrs = order[b]->instrs;
+	  for (size_t i = 0; i < instrs.size(); )
+	    {
+	      IRInstr* instr = instrs[i];
+	      if (!invariant(loop, instr))
+		{
+		  i++;
+		  continue;
+		}
+
+	      instrs.erase(instrs.begin() + i);
+	      instr->block = pre;
+	      pre->instrs.insert(pre->instrs.end() - 1, instr);
+	      hoisted++;
+	    }
+	}
+
+      LoopReport r;
+      r.function = f->name;
+      r.header = loop->header->id;
+      r.depth = loop->depth;
+      r.blocks = loop->blocks.size();
+      r.hoisted = hoisted;
+      loops.push_back(r);
+      total += hoisted;
+    }
+
+  for (size_t l = 0; l < found.size(); l++)
+    delete found[l];
+
+  return total;
+}
+
+void LICM::report(std::ostream& os)
+{
+  for (size_t l = 0; l < loops.size(); l++)
+    {
+      LoopReport& r = loops[l];
+      os << "licm: " << r.function << ": loop at B" << r.header
+	 << " (depth " << r.depth << ", " << r.blocks << " blocks): "
+	 << r.hoisted << " instructions hoisted" << std::endl;
+    }
+}
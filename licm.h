@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ir.h"
+
+#include <string>
+#include <vector>
+
+// Loop-invariant code motion: pure instructions whose operands are all
+// defined outside a loop move to the loop's preheader.  Loops are handled
+// innermost first so invariants can climb through several levels.
+class LICM
+{
+public:
+  struct LoopReport {
+    std::string function;
+    int header;
+    int depth;
+    int blocks;
+    int hoisted;
+  };
+
+  LICM();
+  ~LICM();
+
+  int run(IRFunction* f);
+  void report(std::ostream& os);
+
+  std::vector<LoopReport> loops;
+
+private:
+  bool invariant(IRLoop* loop, IRInstr* instr);
+  bool safeToSpeculate(IRInstr* instr);
+};
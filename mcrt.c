@@ -0,0 +1,240 @@
+/*
+  Minimal static runtime for microc programs.  Provides _start, a printf
+  that only knows the integer conversions the language can produce, the
+  mcrt_write/mcrt_putint primitives printf calls are lowered to with
+  --runtime=mcrt, and a large stdout buffer written with raw syscalls and
+  flushed at exit, so a program links with no libc at all:
+
+    microc --runtime=mcrt -c -o prog.o < prog.mc
+    ld -static -o prog prog.o mcrt.o
+
+  Build with the flags the makefile uses: it must not depend on libc and
+  must not touch SSE registers, since generated code does not keep the
+  stack 16-byte aligned at every call.
+*/
+
+#include <stdarg.h>
+
+#define OUTBUF (1 << 16)
+
+static char out[OUTBUF];
+static long used;
+
+extern int main(void);
+
+static long sys_write(int fd, const char* p, long n)
+{
+  long r;
+  __asm__ volatile ("syscall" : "=a"(r) : "a"(1), "D"(fd), "S"(p), "d"(n) : "rcx", "r11", "memory");
+  return r;
+}
+
+static void __attribute__((noreturn)) sys_exit(int status)
+{
+  __asm__ volatile ("syscall" : : "a"(231), "D"(status) : "rcx", "r11", "memory");
+  for (;;)
+    ;
+}
+
+static void flush(void)
+{
+  long off = 0;
+
+  while (off < used)
+    {
+      long n = sys_write(1, out + off, used - off);
+      if (n <= 0)
+	break;
+      off += n;
+    }
+  used = 0;
+}
+
+static void put(char c)
+{
+  if (used == OUTBUF)
+    flush();
+  out[used++] = c;
+}
+
+/*
+  Writes digits with printf's width, '-' and '0' flags; returns the
+  number of characters written
+*/
+static int putPadded(const char* s, int len, int neg, int width, int left, int zero)
+{
+  int n = len + neg;
+  int pad = width > n ? width - n : 0;
+  int i;
+
+  if (!left && !zero)
+    for (i = 0; i < pad; i++)
+      put(' ');
+  if (neg)
+    put('-');
+  if (!left && zero)
+    for (i = 0; i < pad; i++)
+      put('0');
+  for (i = 0; i < len; i++)
+    put(s[i]);
+  if (left)
+    for (i = 0; i < pad; i++)
+      put(' ');
+
+  return n + pad;
+}
+
+static int putNumber(unsigned long v, int base, int neg, int width, int left, int zero)
+{
+  char digits[24];
+  char s[24];
+  int len = 0;
+  int i;
+
+  do
+    {
+      digits[len++] = "0123456789abcdef"[v % base];
+      v /= base;
+    }
+  while (v);
+
+  for (i = 0; i < len; i++)
+    s[i] = digits[len - 1 - i];
+
+  return putPadded(s, len, neg, width, left, zero);
+}
+
+/*
+  Entry points for printf calls that microc splits at compile time
+  (--runtime=mcrt): literal text, and one integer conversion whose
+  width, flags and conversion character are packed into spec as in
+  format.h
+*/
+void mcrt_write(const char* s, long len)
+{
+  long i;
+
+  for (i = 0; i < len; i++)
+    put(s[i]);
+}
+
+void mcrt_putint(long v, long spec)
+{
+  int width = spec & 0xff;
+  int left = (spec >> 8) & 1;
+  int zero = (spec >> 9) & 1;
+  int lng = (spec >> 10) & 1;
+  int conv = (spec >> 16) & 0xff;
+
+  if (conv == 'c')
+    {
+      char c = (char)v;
+      putPadded(&c, 1, 0, width, left, 0);
+    }
+  else if (conv == 'd')
+    {
+      if (!lng)
+	v = (int)v;
+      putNumber(v < 0 ? -(unsigned long)v : (unsigned long)v, 10, v < 0, width, left, zero);
+    }
+  else
+    putNumber(lng ? (unsigned long)v : (unsigned int)v, conv == 'x' ? 16 : 10, 0, width, left, zero);
+}
+
+/*
+  %d %i %u %x %c %s %% with optional '-', '0', width and l/ll
+*/
+int printf(const char* fmt, ...)
+{
+  va_list ap;
+  int count = 0;
+
+  va_start(ap, fmt);
+  for (; *fmt; fmt++)
+    {
+      if (*fmt != '%')
+	{
+	  put(*fmt);
+	  count++;
+	  continue;
+	}
+
+      int left = 0, zero = 0, width = 0, lng = 0;
+
+      for (fmt++; *fmt == '-' || *fmt == '0'; fmt++)
+	{
+	  if (*fmt == '-')
+	    left = 1;
+	  else
+	    zero = 1;
+	}
+      for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+	width = width * 10 + (*fmt - '0');
+      for (; *fmt == 'l'; fmt++)
+	lng = 1;
+
+      switch (*fmt)
+	{
+	case 'd':
+	case 'i':
+	  {
+	    long v = lng ? va_arg(ap, long) : va_arg(ap, int);
+	    unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+	    count += putNumber(u, 10, v < 0, width, left, zero);
+	  }
+	  break;
+	case 'u':
+	case 'x':
+	  {
+	    unsigned long u = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+	    count += putNumber(u, *fmt == 'u' ? 10 : 16, 0, width, left, zero);
+	  }
+	  break;
+	case 'c':
+	  {
+	    char c = (char)va_arg(ap, int);
+	    count += putPadded(&c, 1, 0, width, left, 0);
+	  }
+	  break;
+	case 's':
+	  {
+	    const char* s = va_arg(ap, const char*);
+	    int len = 0;
+	    while (s[len])
+	      len++;
+	    count += putPadded(s, len, 0, width, left, 0);
+	  }
+	  break;
+	case '%':
+	  put('%');
+	  count++;
+	  break;
+	case 0:
+	  fmt--;
+	  break;
+	default:
+	  put('%');
+	  put(*fmt);
+	  count += 2;
+	  break;
+	}
+    }
+  va_end(ap);
+
+  return count;
+}
+
+void mcrt_start(void)
+{
+  int status = main();
+  flush();
+  sys_exit(status);
+}
+
+__asm__(".text\n"
+	".globl _start\n"
+	"_start:\n"
+	"  xor %ebp,%ebp\n"
+	"  and $-16,%rsp\n"
+	"  call mcrt_start\n"
+	"  hlt\n");
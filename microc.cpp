@@ -1,30 +1,347 @@
 // Compile with '-std=c++0x' ;; required for various c++11 features
 
-#include "token.h"
-#include "lexer.h"
-#include "parser.h"
+#include "compiler.h"
+#include "threadpool.h"
+#include "server.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
 
-void processFile(std::istream& in) {
-  Lexer lexer(in);
-  Parser parser(lexer, std::cout);
-  Parser::TreeNode* program = parser.compilationunit();
-  //std::cout << Parser::TreeNode::toString(program) << std::endl;
-  parser.genasm(program);
+void usage()
+{
+  std::cerr << "usage: microc [-O0|-O1] [--unroll=N] [--unroll-full=N] [--dump-ir]\n"
+	    << "              [--no-licm] [--licm-report] [-fno-omit-frame-pointer]\n"
+	    << "              [-c] [-o file] [--run] [--vm] [--dump-bytecode]\n"
+	    << "              [--emit=c|asm] [--runtime=libc|mcrt] [--stream] [-j N]\n"
+	    << "              [--cache|--no-cache] [--cache-dir=dir] [--cache-size=N[K|M|G]]\n"
+	    << "              [--incremental[=sidecar]] [--module] [--connect=socket]\n"
+	    << "              [--stats[=json]] [--mem-stats[=json]] [file.mc]\n"
+	    << "       microc [-j N] [options] file.mc... | @filelist\n"
+	    << "       microc [--cache-dir=dir] --cache-stats|--cache-clear\n"
+	    << "       microc --server=socket"
+	    << std::endl;
+  exit(1);
+}
+
+// One source file of a batch compile
+struct BatchUnit {
+  std::string source;
+  std::string output;
+  std::string messages;   // Everything the compilation wrote to its error stream
+  std::string sidecar;    // For --incremental
+  CompileStats stats;     // For --stats
+  bool failed;
+};
+
+// The source's name with its extension replaced by ext
+std::string replaceExtension(const std::string& source, const std::string& ext) {
+  size_t dot = source.rfind('.');
+  size_t slash = source.rfind('/');
+
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return source + ext;
+  return source.substr(0, dot) + ext;
+}
+
+// The output path for a batch source: .asm, .o or .c next to it
+std::string outputName(const std::string& source, const CompileOptions& opts) {
+  return replaceExtension(source, opts.object ? ".o" : opts.emitC ? ".c" : ".asm");
+}
+
+/*
+  Appends the names in a file list, one per line; blank lines and lines
+  starting with '#' are skipped
+*/
+void readFileList(const char* list, std::vector<std::string>& files) {
+  std::ifstream in(list);
+  std::string line;
+
+  if (!in) {
+    std::cerr << "microc: cannot open " << list << std::endl;
+    exit(1);
+  }
+  while (std::getline(in, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (!line.empty() && line[0] != '#')
+      files.push_back(line);
+  }
+}
+
+void compileUnit(BatchUnit& unit, const CompileOptions& opts, ThreadPool* pool, CompileCache* cache,
+		 bool stats) {
+  std::ifstream in(unit.source.c_str());
+  if (!in) {
+    unit.failed = true;
+    unit.messages = "cannot open file\n";
+    return;
+  }
+
+  std::ofstream out(unit.output.c_str(), std::ios::out | std::ios::binary);
+  if (!out) {
+    unit.failed = true;
+    unit.messages = "cannot write " + unit.output + "\n";
+    return;
+  }
+
+  std::ostringstream err;
+  CompileOptions unitOpts = opts;
+  unitOpts.incremental = unit.sidecar;
+  CompilationContext context(in, out, err, unitOpts);
+  context.pool = pool;
+  context.cache = cache;
+  context.stats = stats ? &unit.stats : NULL;
+  context.compile();
+  out.close();
+
+  unit.failed = context.failed;
+  unit.messages = err.str();
+  if (unit.failed)
+    remove(unit.output.c_str());
+}
+
+/*
+  Compiles every file on a pool of jobs threads, each to an output next
+  to its source.  The functions of a file are generated on the same pool,
+  so one large file can still use every thread.  A file that fails does
+  not stop the others; its messages are reported with its name once the
+  batch is done, in the order the files were given.  The files' stats are
+  added up into stats, if given.
+*/
+int compileBatch(const std::vector<std::string>& files, const CompileOptions& opts, int jobs,
+		 CompileCache* cache, bool incremental, CompileStats* stats) {
+  std::vector<BatchUnit> units(files.size());
+  int failures = 0;
+
+  {
+    ThreadPool pool(jobs);
+    for (size_t i = 0; i < files.size(); i++) {
+      units[i].source = files[i];
+      units[i].output = outputName(files[i], opts);
+      units[i].failed = false;
+      if (incremental)
+	units[i].sidecar = replaceExtension(files[i], ".mci");
+      BatchUnit* unit = &units[i];
+      ThreadPool* shared = &pool;
+      bool keepStats = stats != NULL;
+      pool.submit([unit, &opts, shared, cache, keepStats]() {
+	  compileUnit(*unit, opts, shared, cache, keepStats);
+	});
+    }
+    pool.wait();
+  }
+
+  for (size_t i = 0; i < units.size(); i++) {
+    if (stats)
+      stats->add(units[i].stats);
+    if (!units[i].failed) {
+      std::cerr << units[i].messages;
+      continue;
+    }
+    std::istringstream lines(units[i].messages);
+    std::string line;
+    while (std::getline(lines, line))
+      std::cerr << units[i].source << ": " << line << std::endl;
+    failures++;
+  }
+
+  if (failures)
+    std::cerr << "microc: " << failures << " of " << units.size() << " files failed" << std::endl;
+  return failures ? 1 : 0;
+}
+
+// The --stats report, on stderr
+void printStats(CompileStats& stats, bool json) {
+  if (json)
+    stats.printJSON(std::cerr);
+  else
+    stats.print(std::cerr);
+}
+
+// The --mem-stats report, on stderr, once everything compiled is freed
+void printMemoryStats(bool json) {
+  if (json)
+    MemoryStats::printJSON(std::cerr);
+  else
+    MemoryStats::print(std::cerr);
 }
 
 int main(int argc, char **argv) {
   std::ifstream in;
-  
-  if (argc > 1) {
-    in.open(argv[1]);
-    processFile(in);
-    in.close();
+  CompileOptions opts;
+  const char* output = NULL;
+  std::vector<std::string> files;
+  int jobs = 0;
+  bool batch = false;
+  // $MICROC_CACHE names a cache directory and turns caching on
+  bool useCache = getenv("MICROC_CACHE") && *getenv("MICROC_CACHE");
+  std::string cacheDir = CompileCache::defaultDir();
+  long long cacheSize = CompileCache::defaultLimit;
+  const char* cacheCommand = NULL;
+  bool incremental = false;
+  const char* listenOn = NULL;
+  const char* connectTo = NULL;
+  bool stats = false;
+  bool statsJSON = false;
+  bool memStats = false;
+  bool memStatsJSON = false;
+  std::vector<std::string> optionArgs;   // The arguments opts.parse() took
+
+  for (int i = 1; i < argc; i++) {
+    if (opts.parse(argv[i]))
+      optionArgs.push_back(argv[i]);
+    else if (!strcmp(argv[i], "--cache"))
+      useCache = true;
+    else if (!strcmp(argv[i], "--no-cache"))
+      useCache = false;
+    else if (!strncmp(argv[i], "--cache-dir=", 12)) {
+      cacheDir = argv[i] + 12;
+      useCache = true;
+    }
+    else if (!strncmp(argv[i], "--cache-size=", 13)) {
+      cacheSize = CompileCache::parseSize(argv[i] + 13);
+      if (cacheSize < 0)
+	usage();
+    }
+    else if (!strcmp(argv[i], "--cache-stats") || !strcmp(argv[i], "--cache-clear"))
+      cacheCommand = argv[i];
+    else if (!strcmp(argv[i], "--incremental"))
+      incremental = true;
+    else if (!strncmp(argv[i], "--incremental=", 14)) {
+      opts.incremental = argv[i] + 14;
+      incremental = true;
+    }
+    else if (!strncmp(argv[i], "--server=", 9))
+      listenOn = argv[i] + 9;
+    else if (!strncmp(argv[i], "--connect=", 10))
+      connectTo = argv[i] + 10;
+    else if (!strcmp(argv[i], "--stats") || !strcmp(argv[i], "--stats=json")) {
+      stats = true;
+      statsJSON = argv[i][7] == '=';
+    }
+    else if (!strcmp(argv[i], "--mem-stats") || !strcmp(argv[i], "--mem-stats=json")) {
+      memStats = true;
+      memStatsJSON = argv[i][11] == '=';
+    }
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+      jobs = atoi(argv[++i]);
+    else if (!strncmp(argv[i], "-j", 2) && argv[i][2])
+      jobs = atoi(argv[i] + 2);
+    else if (argv[i][0] == '-')
+      usage();
+    else if (argv[i][0] == '@') {
+      readFileList(argv[i] + 1, files);
+      batch = true;
+    }
+    else
+      files.push_back(argv[i]);
+  }
+
+  if (cacheCommand) {
+    CompileCache cache(cacheDir, cacheSize);
+    if (!strcmp(cacheCommand, "--cache-clear"))
+      cache.clear();
+    else
+      cache.printStats(std::cout);
+    return 0;
+  }
+#ifdef MICROC_NO_STATS
+  if (stats || memStats) {
+    std::cerr << "microc: built without --stats and --mem-stats" << std::endl;
+    return 1;
+  }
+#endif
+  MemoryStats::enabled = memStats;
+  if (listenOn) {
+    if (!files.empty() || output || stats || memStats)
+      usage();
+    CompileServer server(listenOn);
+    return server.run();
   }
-  else {
-    processFile(std::cin);
+  CompileCache* cache = useCache ? new CompileCache(cacheDir, cacheSize) : NULL;
+
+  if (files.size() > 1)
+    batch = true;
+  // Incremental builds link assembly text, so they only make assembly
+  if (incremental && (opts.object || opts.run || opts.vm || opts.dumpBytecode || opts.emitC ||
+		      opts.dumpIR || opts.licmReport || opts.stream))
+    usage();
+  // A module's imports go in its header, so it cannot stream assembly;
+  // the tree backends and the JIT have no linker to resolve them
+  if (opts.module && (incremental || (opts.stream && !opts.object) || opts.run || opts.vm ||
+		      opts.dumpBytecode || opts.emitC))
+    usage();
+  if (batch) {
+    if (output || opts.run || opts.vm || files.empty() || !opts.incremental.empty() || connectTo)
+      usage();
+    CompileStats batchStats;
+    int status = compileBatch(files, opts, jobs > 0 ? jobs : ThreadPool::defaultThreads(),
+			      cache, incremental, stats ? &batchStats : NULL);
+    if (stats)
+      printStats(batchStats, statsJSON);
+    if (memStats)
+      printMemoryStats(memStatsJSON);
+    delete cache;
+    return status;
+  }
+
+  if (!files.empty()) {
+    in.open(files[0].c_str());
+    if (!in) {
+      std::cerr << "microc: cannot open " << files[0] << std::endl;
+      exit(1);
+    }
+  }
+
+  std::ofstream outFile;
+  if (output) {
+    outFile.open(output, std::ios::out | std::ios::binary);
+    if (!outFile) {
+      std::cerr << "microc: cannot open " << output << std::endl;
+      exit(1);
+    }
+  }
+  std::ostream& out = output ? outFile : std::cout;
+
+  // The server keeps the file's state; it is known by its name, - for stdin
+  if (connectTo) {
+    if (incremental || useCache || stats || memStats)
+      usage();
+    std::ostringstream source;
+    source << (files.empty() ? std::cin.rdbuf() : in.rdbuf());
+    return CompileServer::request(connectTo, files.empty() ? "-" : files[0], optionArgs, source.str(),
+				  out, std::cerr);
+  }
+
+  // The sidecar of a named source is file.mci next to it
+  if (incremental && opts.incremental.empty()) {
+    if (files.empty())
+      usage();
+    opts.incremental = replaceExtension(files[0], ".mci");
+  }
+
+  // A single file with -j generates its functions in parallel
+  ThreadPool* pool = jobs > 1 ? new ThreadPool(jobs) : NULL;
+  CompileStats compileStats;
+  int status;
+  {
+    CompilationContext context(files.empty() ? std::cin : in, out, std::cerr, opts);
+    context.pool = pool;
+    context.cache = cache;
+    context.stats = stats ? &compileStats : NULL;
+    status = context.compile();
   }
-  
-  return 0;
+  if (stats)
+    printStats(compileStats, statsJSON);
+  if (memStats)
+    printMemoryStats(memStatsJSON);
+  delete pool;
+  delete cache;
+  return status;
 }
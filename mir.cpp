@@ -0,0 +1,427 @@
+#include "mir.h"
+#include "stats.h"
+
+#include <cstring>
+
+static const char* REGS[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+static const char* REGS8[] = {
+  "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+  "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+
+static const char* CONDS[] = { "e", "ne", "l", "ge", "le", "g" };
+
+static const char* MNEMONICS[] = {
+  "mov", "movzx", "lea", "push", "pop",
+  "add", "sub", "imul", "idiv", "cqo", "and", "or", "inc", "dec", "shl",
+  "cmp", "test", "set",
+  "jmp", "j", "call", "ret"
+};
+
+MOperand::MOperand() : kind(NONE), base(NOREG), index(NOREG), scale(1), value(0)
+{
+
+}
+
+MOperand MOperand::reg(int r)
+{
+  MOperand o;
+  o.kind = REG;
+  o.base = r;
+  return o;
+}
+
+MOperand MOperand::reg8(int r)
+{
+  MOperand o = reg(r);
+  o.kind = REG8;
+  return o;
+}
+
+MOperand MOperand::imm(long long v)
+{
+  MOperand o = reg(NOREG);
+  o.kind = IMM;
+  o.value = v;
+  return o;
+}
+
+MOperand MOperand::mem(int base, long long disp)
+{
+  MOperand o = reg(base);
+  o.kind = MEM;
+  o.value = disp;
+  return o;
+}
+
+MOperand MOperand::addr(int base, int index, int scale, long long disp)
+{
+  MOperand o = reg(base);
+  o.kind = ADDR;
+  o.index = index;
+  o.scale = scale;
+  o.value = disp;
+  return o;
+}
+
+MOperand MOperand::label(int id)
+{
+  MOperand o = reg(NOREG);
+  o.kind = LABEL;
+  o.value = id;
+  return o;
+}
+
+bool MOperand::operator==(const MOperand& o) const
+{
+  return kind == o.kind && base == o.base && index == o.index && scale == o.scale &&
+    value == o.value;
+}
+
+MBuffer::MBuffer() : m_capacity(0), m_textBytes(0)
+{
+
+}
+
+MBuffer::~MBuffer()
+{
+  MEM_FREE(CODEGEN, m_capacity * sizeof(MInstr) + m_textBytes);
+}
+
+// Charges a change in the instruction array's capacity to --mem-stats
+void MBuffer::account()
+{
+  if (code.capacity() != m_capacity)
+    {
+      MEM_FREE(CODEGEN, m_capacity * sizeof(MInstr));
+      m_capacity = code.capacity();
+      MEM_ALLOC(CODEGEN, m_capacity * sizeof(MInstr));
+    }
+}
+
+// A string's size with its text, if that does not fit inline
+static long long textBytes(const std::string& s)
+{
+  return sizeof(std::string) + (s.capacity() > 15 ? s.capacity() + 1 : 0);
+}
+
+/*
+  Interns a label or symbol name.  Local labels are keyed by the enclosing
+  global label so every function gets its own .B1.
+*/
+int MBuffer::symbol(const std::string& name)
+{
+  return intern((!name.empty() && name[0] == '.') ? m_scope + name : name, name);
+}
+
+int MBuffer::intern(const std::string& key, const std::string& name)
+{
+  std::map<std::string, int>::iterator it = m_ids.find(key);
+
+  if (it != m_ids.end())
+    return it->second;
+
+  m_names.push_back(name);
+  m_ids[key] = m_names.size() - 1;
+  return m_names.size() - 1;
+}
+
+/*
+  Appends the instructions of another buffer.  Its symbols are interned
+  here in the order it first saw them, so ids come out as if the code had
+  been added to this buffer directly; renames gives new names for some of
+  them.
+*/
+void MBuffer::append(MBuffer& other, const std::map<std::string, std::string>& renames)
+{
+  std::vector<std::string> keys(other.m_names.size());
+  std::vector<int> ids(other.m_names.size());
+
+  for (std::map<std::string, int>::iterator it = other.m_ids.begin(); it != other.m_ids.end(); ++it)
+    keys[it->second] = it->first;
+  for (size_t i = 0; i < keys.size(); i++)
+    {
+      std::map<std::string, std::string>::const_iterator r = renames.find(keys[i]);
+      if (r != renames.end())
+	ids[i] = intern(r->second, r->second);
+      else
+	ids[i] = intern(keys[i], other.m_names[i]);
+    }
+
+  for (size_t i = 0; i < other.code.size(); i++)
+    {
+      MInstr instr = other.code[i];
+
+      if (instr.op == MInstr::TEXT)
+	{
+	  m_text.push_back(other.m_text[instr.ops[0].value]);
+	  m_textBytes += textBytes(m_text.back());
+	  MEM_ALLOC(CODEGEN, textBytes(m_text.back()));
+	  instr.ops[0].value = m_text.size() - 1;
+	}
+      else
+	for (int k = 0; k < instr.nops; k++)
+	  if (instr.ops[k].kind == MOperand::LABEL)
+	    instr.ops[k].value = ids[instr.ops[k].value];
+      code.push_back(instr);
+    }
+  account();
+  m_scope = other.m_scope;
+}
+
+const std::string& MBuffer::name(int id)
+{
+  return m_names[id];
+}
+
+MInstr& MBuffer::add(MInstr::Opcode op)
+{
+  MInstr instr;
+  instr.op = op;
+  instr.cc = 0;
+  instr.nops = 0;
+  instr.indent = false;
+  code.push_back(instr);
+  account();
+  return code.back();
+}
+
+MInstr& MBuffer::add(MInstr::Opcode op, MOperand a)
+{
+  MInstr& instr = add(op);
+  instr.ops[0] = a;
+  instr.nops = 1;
+  return instr;
+}
+
+MInstr& MBuffer::add(MInstr::Opcode op, MOperand a, MOperand b)
+{
+  MInstr& instr = add(op, a);
+  instr.ops[1] = b;
+  instr.nops = 2;
+  return instr;
+}
+
+MInstr& MBuffer::add(MInstr::Opcode op, MOperand a, MOperand b, MOperand c)
+{
+  MInstr& instr = add(op, a, b);
+  instr.ops[2] = c;
+  instr.nops = 3;
+  return instr;
+}
+
+MInstr& MBuffer::jcc(int cc, int label)
+{
+  MInstr& instr = add(MInstr::JCC, MOperand::label(label));
+  instr.cc = cc;
+  return instr;
+}
+
+MInstr& MBuffer::setcc(int cc, int reg)
+{
+  MInstr& instr = add(MInstr::SETCC, MOperand::reg8(reg));
+  instr.cc = cc;
+  return instr;
+}
+
+MInstr& MBuffer::label(int id)
+{
+  if (m_names[id].empty() || m_names[id][0] != '.')
+    m_scope = m_names[id];
+  return add(MInstr::LABEL, MOperand::label(id));
+}
+
+MInstr& MBuffer::text(const std::string& s)
+{
+  m_text.push_back(s);
+  m_textBytes += textBytes(m_text.back());
+  MEM_ALLOC(CODEGEN, textBytes(m_text.back()));
+  return add(MInstr::TEXT, MOperand::imm(m_text.size() - 1));
+}
+
+MInstr& MBuffer::blank()
+{
+  return add(MInstr::BLANK);
+}
+
+/*
+  Drops the instructions but keeps the symbol table, so ids handed out
+  earlier stay valid
+*/
+void MBuffer::clear()
+{
+  code.clear();
+  m_text.clear();
+  MEM_FREE(CODEGEN, m_textBytes);
+  m_textBytes = 0;
+}
+
+const char* MBuffer::regName(int r)
+{
+  return REGS[r];
+}
+
+const char* MBuffer::reg8Name(int r)
+{
+  return REGS8[r];
+}
+
+const char* MBuffer::condName(int cc)
+{
+  return CONDS[cc];
+}
+
+// Conditions are laid out in complementary pairs
+int MBuffer::invert(int cc)
+{
+  return cc ^ 1;
+}
+
+static int hexDigit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/*
+  Decodes a NASM backquoted string, C-style escapes included, into the
+  bytes nasm would assemble
+*/
+std::string MBuffer::decodeString(const std::string& nasmText)
+{
+  std::string s = nasmText;
+  std::string bytes;
+
+  if (s.size() >= 2 && s[0] == '`' && s[s.size() - 1] == '`')
+    s = s.substr(1, s.size() - 2);
+
+  for (size_t i = 0; i < s.size(); i++)
+    {
+      if (s[i] != '\\' || i + 1 == s.size())
+	{
+	  bytes.push_back(s[i]);
+	  continue;
+	}
+
+      char c = s[++i];
+      switch (c)
+	{
+	case 'n': bytes.push_back('\n'); break;
+	case 't': bytes.push_back('\t'); break;
+	case 'r': bytes.push_back('\r'); break;
+	case 'a': bytes.push_back('\a'); break;
+	case 'b': bytes.push_back('\b'); break;
+	case 'f': bytes.push_back('\f'); break;
+	case 'v': bytes.push_back('\v'); break;
+	case 'e': bytes.push_back(27); break;
+	case 'x':
+	  {
+	    int v = 0;
+	    for (int k = 0; k < 2 && i + 1 < s.size() && hexDigit(s[i + 1]) >= 0; k++)
+	      v = v * 16 + hexDigit(s[++i]);
+	    bytes.push_back(v);
+	  }
+	  break;
+	default:
+	  if (c >= '0' && c <= '7')
+	    {
+	      int v = c - '0';
+	      for (int k = 0; k < 2 && i + 1 < s.size() && s[i + 1] >= '0' && s[i + 1] <= '7'; k++)
+		v = v * 8 + (s[++i] - '0');
+	      bytes.push_back(v);
+	    }
+	  else
+	    bytes.push_back(c);    // \\ \` \' \" and anything unknown
+	  break;
+	}
+    }
+
+  return bytes;
+}
+
+void MBuffer::printOperand(OutputSink& sink, const MOperand& o)
+{
+  switch (o.kind)
+    {
+    case MOperand::NONE:
+      break;
+    case MOperand::REG:
+      sink.put(REGS[o.base], strlen(REGS[o.base]));
+      break;
+    case MOperand::REG8:
+      sink.put(REGS8[o.base], strlen(REGS8[o.base]));
+      break;
+    case MOperand::IMM:
+      sink.put(o.value);
+      break;
+    case MOperand::LABEL:
+      sink.put(m_names[o.value]);
+      break;
+    case MOperand::MEM:
+    case MOperand::ADDR:
+      if (o.kind == MOperand::MEM)
+	sink.put("qword", 5);
+      sink.put('[');
+      sink.put(REGS[o.base], strlen(REGS[o.base]));
+      if (o.index != NOREG)
+	{
+	  sink.put('+');
+	  sink.put(REGS[o.index], strlen(REGS[o.index]));
+	  if (o.scale != 1)
+	    {
+	      sink.put('*');
+	      sink.put(static_cast<long long>(o.scale));
+	    }
+	}
+      if (o.value > 0)
+	sink.put('+');
+      if (o.value != 0)
+	sink.put(o.value);
+      sink.put(']');
+      break;
+    }
+}
+
+void MBuffer::print(OutputSink& sink)
+{
+  for (size_t i = 0; i < code.size(); i++)
+    {
+      MInstr& instr = code[i];
+
+      switch (instr.op)
+	{
+	case MInstr::LABEL:
+	  sink.put(m_names[instr.ops[0].value]);
+	  sink.put(':');
+	  break;
+	case MInstr::BLANK:
+	  break;
+	case MInstr::TEXT:
+	  sink.put(m_text[instr.ops[0].value]);
+	  break;
+	default:
+	  if (instr.indent)
+	    sink.put(' ');
+	  sink.put(MNEMONICS[instr.op], strlen(MNEMONICS[instr.op]));
+	  if (instr.op == MInstr::JCC || instr.op == MInstr::SETCC)
+	    sink.put(CONDS[instr.cc], strlen(CONDS[instr.cc]));
+	  for (int k = 0; k < instr.nops; k++)
+	    {
+	      sink.put(k == 0 ? ' ' : ',');
+	      printOperand(sink, instr.ops[k]);
+	    }
+	  break;
+	}
+
+      sink.put('\n');
+    }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "outbuf.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Registers in hardware encoding order
+enum MReg {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+  NOREG = -1
+};
+
+class MOperand
+{
+public:
+  enum Kind {
+    NONE,
+    REG,      // 64-bit register
+    REG8,     // Low byte of a register, for setcc
+    IMM,      // Immediate
+    MEM,      // qword[base+index*scale+disp]
+    ADDR,     // [base+index*scale+disp] without a size, for lea
+    LABEL     // Code label or data symbol
+  };
+
+  MOperand();
+
+  static MOperand reg(int r);
+  static MOperand reg8(int r);
+  static MOperand imm(long long v);
+  static MOperand mem(int base, long long disp);
+  static MOperand addr(int base, int index, int scale, long long disp);
+  static MOperand label(int id);
+
+  bool operator==(const MOperand& o) const;
+
+  Kind kind;
+  int base;        // REG, REG8: the register; MEM, ADDR: base register
+  int index;       // MEM, ADDR: index register or NOREG
+  int scale;
+  long long value; // IMM: value, MEM, ADDR: displacement, LABEL: symbol id
+};
+
+class MInstr
+{
+public:
+  enum Opcode {
+    MOV, MOVZX, LEA, PUSH, POP,
+    ADD, SUB, IMUL, IDIV, CQO, AND, OR, INC, DEC, SHL,
+    CMP, TEST, SETCC,
+    JMP, JCC, CALL, RET,
+    LABEL,  // ops[0] is the label being defined
+    BLANK,  // Empty line
+    TEXT    // Directive; value of ops[0] indexes the text table
+  };
+
+  enum Cond { E, NE, L, GE, LE, G };
+
+  Opcode op;
+  int cc;          // JCC, SETCC
+  int nops;
+  MOperand ops[3];
+  bool indent;     // Printed with a leading space
+};
+
+// An in-memory stream of machine instructions.  Labels and symbols are
+// interned to integer ids; local labels (".name") are scoped to the last
+// global label, as NASM does.  print() renders NASM syntax.
+class MBuffer
+{
+public:
+  MBuffer();
+  ~MBuffer();
+
+  int symbol(const std::string& name);
+  const std::string& name(int id);
+
+  MInstr& add(MInstr::Opcode op);
+  MInstr& add(MInstr::Opcode op, MOperand a);
+  MInstr& add(MInstr::Opcode op, MOperand a, MOperand b);
+  MInstr& add(MInstr::Opcode op, MOperand a, MOperand b, MOperand c);
+  MInstr& jcc(int cc, int label);
+  MInstr& setcc(int cc, int reg);
+  MInstr& label(int id);
+  MInstr& text(const std::string& s);
+  MInstr& blank();
+
+  void print(OutputSink& sink);
+  void clear();
+  void append(MBuffer& other, const std::map<std::string, std::string>& renames);
+
+  static const char* regName(int r);
+  static const char* reg8Name(int r);
+  static const char* condName(int cc);
+  static int invert(int cc);
+  static std::string decodeString(const std::string& nasmText);
+
+  std::vector<MInstr> code;
+
+private:
+  void printOperand(OutputSink& sink, const MOperand& o);
+  int intern(const std::string& key, const std::string& name);
+  void account();
+
+  std::vector<std::string> m_names;
+  std::map<std::string, int> m_ids;
+  std::vector<std::string> m_text;
+  std::string m_scope;
+  size_t m_capacity;      // Of code, as --mem-stats last saw it
+  long long m_textBytes;  // Held by m_text, for --mem-stats
+};
@@ -0,0 +1,100 @@
+#include "outbuf.h"
+#include "stats.h"
+
+#include <cstring>
+
+OutputSink::OutputSink(std::ostream& out, size_t capacity) : bytes(0), writes(0), m_out(out),
+							       m_len(0), m_cap(capacity)
+{
+  m_buf = new char[m_cap];
+  MEM_ALLOC(OUTPUT, m_cap);
+}
+
+OutputSink::~OutputSink()
+{
+  flush();
+  delete[] m_buf;
+  MEM_FREE(OUTPUT, m_cap);
+}
+
+/*
+  Hands the buffered bytes to the stream in a single write
+*/
+void OutputSink::drain()
+{
+  if (m_len == 0)
+    return;
+
+  m_out.write(m_buf, m_len);
+  STAT_COUNT(BYTES, m_len);
+  m_len = 0;
+  writes++;
+}
+
+void OutputSink::flush()
+{
+  drain();
+  m_out.flush();
+}
+
+void OutputSink::put(char c)
+{
+  if (m_len == m_cap)
+    drain();
+  m_buf[m_len++] = c;
+  bytes++;
+}
+
+void OutputSink::put(const char* s, size_t len)
+{
+  bytes += len;
+
+  if (m_len + len > m_cap)
+    {
+      drain();
+      // Too big to buffer; pass it straight through
+      if (len > m_cap)
+	{
+	  m_out.write(s, len);
+	  STAT_COUNT(BYTES, len);
+	  writes++;
+	  return;
+	}
+    }
+
+  memcpy(m_buf + m_len, s, len);
+  m_len += len;
+}
+
+void OutputSink::put(const std::string& s)
+{
+  put(s.data(), s.size());
+}
+
+/*
+  Decimal formatting without going through a stringstream
+*/
+void OutputSink::put(long long v)
+{
+  char digits[24];
+  int n = sizeof(digits);
+  unsigned long long u = v < 0 ? 0ULL - static_cast<unsigned long long>(v) : v;
+
+  do
+    {
+      digits[--n] = '0' + u % 10;
+      u /= 10;
+    }
+  while (u != 0);
+
+  if (v < 0)
+    digits[--n] = '-';
+
+  put(digits + n, sizeof(digits) - n);
+}
+
+void OutputSink::line(const std::string& s)
+{
+  put(s);
+  put('\n');
+}
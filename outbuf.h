@@ -0,0 +1,32 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+// Accumulates generated assembly and hands it to the output stream in
+// large blocks.  Nothing is flushed per line; the buffer is written when
+// it fills up, on flush() and when the sink is destroyed.
+class OutputSink
+{
+public:
+  OutputSink(std::ostream& out, size_t capacity = 1 << 16);
+  ~OutputSink();
+
+  void put(char c);
+  void put(const char* s, size_t len);
+  void put(const std::string& s);
+  void put(long long v);
+  void line(const std::string& s);
+  void flush();
+
+  size_t bytes;    // Total bytes accepted
+  int writes;      // Block writes issued to the stream
+
+private:
+  void drain();
+
+  std::ostream& m_out;
+  char* m_buf;
+  size_t m_len;
+  size_t m_cap;
+};
@@ -1,6 +1,11 @@
 // Compile with '-std=c++0x' ;; required for various c++11 features
 
 #include "parser.h"
+#include "format.h"
+#include "compileerror.h"
+#include "stats.h"
+
+#include <cerrno>
 
 const std::string Parser::ops[] = { "ADD", "SUB", "MULT", "DIV",
 				    "ISEQ", "ISNE", "ISLT", "ISLE", "ISGT", "ISGE",
@@ -11,22 +16,95 @@ const std::string Parser::ops[] = { "ADD", "SUB", "MULT", "DIV",
 				    "LABEL", "SEQ" };
 
 
-Parser::Parser(Lexer& lexerx, std::ostream& outx) : lexer(lexerx), out(outx), lindex(1), tindex(1)
+Parser::Parser(Lexer& lexerx, std::ostream& outx) : specializePrintf(false), module(false), m_discard(NULL), lexer(lexerx), out(outx), sink(outx), lindex(1), tindex(1), varcnt(0), m_shard(false)
 {
   token = lexer.nextToken();
 }
 
+/*
+  A code generation shard: generates one function of the parent's program
+  into its own buffer, string pool and label sequence, so shards can run
+  on separate threads.  It never reads tokens or writes output.
+*/
+Parser::Parser(Parser& parent) : specializePrintf(parent.specializePrintf), module(parent.module), m_discard(NULL), lexer(parent.lexer), token(parent.token),
+				 out(m_discard), sink(m_discard), lindex(0), tindex(1), varcnt(0), m_shard(true)
+{
+
+}
+
 Parser::~Parser()
 {
   
 }
 
+// Past this many diagnostics the rest are likely to follow from them
+static const size_t MAX_ERRORS = 100;
+
+/*
+  Records a diagnostic at the current token and carries on; used for
+  errors that leave the parse in step, like an undefined variable
+*/
+void Parser::report(std::string message)
+{
+  std::ostringstream ss;
+  ss << message << " Found " << token->lexeme()
+     << " at line " << token->line()
+     << " position " << token->pos();
+  m_diagnostics.push_back(ss.str());
+  if (m_diagnostics.size() >= MAX_ERRORS)
+    {
+      m_diagnostics.push_back("Too many errors, stopping");
+      reportErrors();
+    }
+}
+
+// Records a diagnostic and unwinds to the nearest recovery point
 void Parser::error(std::string message)
 {
-  std::cerr << message << " Found " << token->lexeme()
-	    << " at line " << token->line()
-	    << " position " << token->pos() << std::endl;
-  exit(1);
+  report(message);
+  throw SyntaxError();
+}
+
+/*
+  Panic mode: skips the rest of the statement an error was found in,
+  through its ";" or its closing "}" (and an "else" block after it).  It
+  stops in front of a "}" that closes an enclosing block, a "function"
+  keyword or the end of the input.
+*/
+void Parser::synchronize()
+{
+  int depth = 0;
+
+  while (!atEnd() && token->type() != Token::FUNCTION)
+    {
+      int type = token->type();
+      if (type == Token::RBRACE && depth == 0)
+	return;
+      token = lexer.nextToken();
+      if (type == Token::LBRACE)
+	depth++;
+      else if (type == Token::RBRACE && --depth == 0 && token->type() != Token::ELSE)
+	return;
+      else if (type == Token::SEMICOLON && depth == 0)
+	return;
+    }
+}
+
+bool Parser::failed()
+{
+  return !m_diagnostics.empty();
+}
+
+// Throws every diagnostic so far, one per line, as one CompileError
+void Parser::reportErrors()
+{
+  if (m_diagnostics.empty())
+    return;
+
+  std::string messages = m_diagnostics[0];
+  for (size_t i = 1; i < m_diagnostics.size(); i++)
+    messages += "\n" + m_diagnostics[i];
+  throw CompileError(messages);
 }
 
 void Parser::check(int tokenType, std::string message)
@@ -38,6 +116,7 @@ void Parser::check(int tokenType, std::string message)
 Parser::TreeNode* Parser::funcall(std::string functionName)
 {  
   int paramCount = 0;
+  called.insert(functionName);
   token = lexer.nextToken();
   
   if (token->type() == Token::RPAREN) {
@@ -65,6 +144,8 @@ Parser::TreeNode* Parser::funcall(std::string functionName)
     if (token->type() == Token::RPAREN) {      
       break;
     }     
+    if (token->type() != Token::COMMA)
+      error("Expected \",\" or \")\" after argument");
   }  
   
   auto argc = new Parser::TreeNode(Parser::LOADL, std::to_string(static_cast<long long>(paramCount * 8)));  
@@ -89,9 +170,16 @@ Parser::TreeNode* Parser::factor()
       token = lexer.nextToken();
       break;
     case Token::INTLIT:
-      node = new Parser::TreeNode(Parser::LOADL, token->lexeme());
-      token = lexer.nextToken();
-      break;
+      {
+	// Checked once here, so that every backend sees the same value
+	errno = 0;
+	long long value = strtoll(token->lexeme().c_str(), NULL, 10);
+	if (errno == ERANGE)
+	  report("Integer literal out of range");
+	node = new Parser::TreeNode(Parser::LOADL, std::to_string(value));
+	token = lexer.nextToken();
+	break;
+      }
     case Token::IDENT:
       {
 	std::string str = token->lexeme();
@@ -106,12 +194,14 @@ Parser::TreeNode* Parser::factor()
 	  {
 	    int a = symTable.getUniqueSymbol(str);
 	    if (!a)
-	      error("Variable not defined or not in scope");
+	      report("Variable not defined or not in scope");
 	    
 	    node = new Parser::TreeNode(Parser::LOADV, std::to_string(static_cast<long long>(a)));	    
 	    break;
 	  }
       }
+    default:
+      error("Expected a number, variable, call or \"(\"");
     }
   
   return node;
@@ -216,7 +306,7 @@ Parser::TreeNode* Parser::assignmentStatement()
 {
   std::string var = token->lexeme();
   if (!symTable.getUniqueSymbol(var))
-    error("Variable out of scope in assignment statement");
+    report("Variable out of scope in assignment statement");
   
   token = lexer.nextToken();
   check(Token::ASSIGN, "Expected assignment operator after identifier");
@@ -240,6 +330,9 @@ Parser::TreeNode* Parser::printfStatement() {
   token = lexer.nextToken();
   check(Token::STRINGLIT, "Expecting string literal");
   std::string formatString = token->lexeme();
+  // The runtime's printf would print the rest differently from libc's
+  if (specializePrintf && !runtimeFormat(formatString))
+    report("Format not supported by --runtime=mcrt");
   token = lexer.nextToken();
   
   if (token->type() == Token::COMMA) {
@@ -258,7 +351,9 @@ Parser::TreeNode* Parser::printfStatement() {
   token = lexer.nextToken();
   check(Token::SEMICOLON, "Expecting ;");
   token = lexer.nextToken();
-  TreeNode* printStatement = new TreeNode(SEQ, paramList, new TreeNode(PRINTF, itos(nparams) + formatString));
+  TreeNode* printfNode = new TreeNode(PRINTF, formatString);
+  printfNode->paramCount = nparams;
+  TreeNode* printStatement = new TreeNode(SEQ, paramList, printfNode);
   return printStatement;
 }
 
@@ -387,32 +482,46 @@ Parser::TreeNode* Parser::vardefStatement()
     }
 }
 
+/*
+  A statement with a syntax error is skipped and parses as NULL, so the
+  rest of the block is still checked.  An error that skips to the next
+  function goes on up to function().
+*/
 Parser::TreeNode* Parser::statement()
 {
   int type = token->type();
-  Parser::TreeNode* node;
+  Parser::TreeNode* node = NULL;
   
-  switch (type)
-    {
-    case Token::PRINTF:
-      node = printfStatement();
-      break;
-    case Token::RETURN:
-      node = returnStatement();
-      break;
-    case Token::VAR:
-      node = vardefStatement();
-      break;
-    case Token::IDENT:
-      node = assignmentStatement();
-      break;
-    case Token::WHILE:
-      node = whileStatement();
-      break;
-    case Token::IF:
-      node = ifStatement();
-      break;
-    }
+  try {
+    switch (type)
+      {
+      case Token::PRINTF:
+	node = printfStatement();
+	break;
+      case Token::RETURN:
+	node = returnStatement();
+	break;
+      case Token::VAR:
+	node = vardefStatement();
+	break;
+      case Token::IDENT:
+	node = assignmentStatement();
+	break;
+      case Token::WHILE:
+	node = whileStatement();
+	break;
+      case Token::IF:
+	node = ifStatement();
+	break;
+      default:
+	error("Expected a statement");
+      }
+  }
+  catch (SyntaxError&) {
+    synchronize();
+    if (token->type() == Token::FUNCTION || atEnd())
+      throw;
+  }
   
   return node;
 }
@@ -478,45 +587,72 @@ Parser::TreeNode* Parser::parameterdefs()
   return node;
 }
 
+/*
+  A function whose syntax error could not be recovered from inside it is
+  skipped up to the next "function" keyword and parses as NULL
+*/
 Parser::TreeNode* Parser::function()
 {
-  symTable.enterScope();
-  Parser::TreeNode* node;
-  check(Token::FUNCTION, "Function declarations must start with \"function\" keyword");
-  token = lexer.nextToken();
-  std::string funcName = token->lexeme();
-  check(Token::IDENT, "Expected identifier after \"function\" keyword");
-  token = lexer.nextToken();
-  check(Token::LPAREN, "Expected \"(\" after identifier");
-  token = lexer.nextToken();
-  node = parameterdefs();
-  check(Token::RPAREN, "Expected \")\" after parameters");
-  token = lexer.nextToken();
+  STAT_TIMER(PARSE);
+  try {
+    symTable.enterScope();
+    Parser::TreeNode* node;
+    check(Token::FUNCTION, "Function declarations must start with \"function\" keyword");
+    token = lexer.nextToken();
+    std::string funcName = token->lexeme();
+    check(Token::IDENT, "Expected identifier after \"function\" keyword");
+    defined.push_back(funcName);
+    token = lexer.nextToken();
+    check(Token::LPAREN, "Expected \"(\" after identifier");
+    token = lexer.nextToken();
+    node = parameterdefs();
+    check(Token::RPAREN, "Expected \")\" after parameters");
+    token = lexer.nextToken();
   
-  auto funct = new Parser::TreeNode(Parser::FUNC, funcName);
-  if (node == NULL)
-    {
-      return new Parser::TreeNode(Parser::SEQ, funct, block(true));
-    }
-  else
-    {
-      auto temp = new Parser::TreeNode(Parser::SEQ, funct, node);
-      temp = new Parser::TreeNode(Parser::SEQ, temp, block(true));
-      return temp;
-    }
+    auto funct = new Parser::TreeNode(Parser::FUNC, funcName);
+    if (node == NULL)
+      {
+	return new Parser::TreeNode(Parser::SEQ, funct, block(true));
+      }
+    else
+      {
+	auto temp = new Parser::TreeNode(Parser::SEQ, funct, node);
+	temp = new Parser::TreeNode(Parser::SEQ, temp, block(true));
+	return temp;
+      }
+  }
+  catch (SyntaxError&) {
+    while (!atEnd() && token->type() != Token::FUNCTION)
+      token = lexer.nextToken();
+    symTable = SymbolTable();
+    return NULL;
+  }
 }
 
 Parser::TreeNode* Parser::compilationunit()
 {
   Parser::TreeNode* node = function();
-  while (token->type() != Token::ENDOFFILE)
+  functions.push_back(node);
+  while (!atEnd())
     {
-      node = new Parser::TreeNode(Parser::SEQ, node, function());
+      Parser::TreeNode* f = function();
+      functions.push_back(f);
+      node = new Parser::TreeNode(Parser::SEQ, node, f);
     }
   
+  reportErrors();
   return node;
 }
 
+/*
+  True once the last function has been parsed, or once the input fails:
+  the lexer then returns ERROR for good, and recovery would never end
+*/
+bool Parser::atEnd()
+{
+  return token->type() == Token::ENDOFFILE || (token->type() == Token::ERROR && lexer.exhausted());
+}
+
 std::string Parser::TreeNode::toString(TreeNode* node)
 {
   return toString0(node, 0);
@@ -551,9 +687,65 @@ std::string Parser::TreeNode::toString0(TreeNode* node, int spaces)
   return ret;
 }
 
-void Parser::emit(std::string s)
+thread_local Parser::NodePool* Parser::NodePool::current = NULL;
+
+void* Parser::TreeNode::operator new(size_t size)
+{
+  STAT_COUNT(NODES, 1);
+  MEM_ALLOC(AST, size);
+  void* p = ::operator new(size);
+  if (NodePool::current)
+    NodePool::current->add(static_cast<TreeNode*>(p));
+  return p;
+}
+
+void Parser::TreeNode::operator delete(void* p)
+{
+  if (NodePool::current)
+    NodePool::current->remove(static_cast<TreeNode*>(p));
+  MEM_FREE(AST, sizeof(TreeNode));
+  ::operator delete(p);
+}
+
+Parser::NodePool::NodePool()
+{
+
+}
+
+Parser::NodePool::~NodePool()
+{
+  for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+      m_nodes[i]->~TreeNode();
+      ::operator delete(m_nodes[i]);
+    }
+  MEM_FREE(AST, m_nodes.size() * sizeof(TreeNode));
+}
+
+void Parser::NodePool::add(TreeNode* node)
 {
-  std::cout << s << std::endl;
+  m_nodes.push_back(node);
+}
+
+// Newest first: only nodes still under construction are ever removed
+void Parser::NodePool::remove(TreeNode* node)
+{
+  for (size_t i = m_nodes.size(); i > 0; i--)
+    if (m_nodes[i - 1] == node)
+      {
+	m_nodes.erase(m_nodes.begin() + (i - 1));
+	return;
+      }
+}
+
+size_t Parser::NodePool::size()
+{
+  return m_nodes.size();
+}
+
+void Parser::emit(const std::string& s)
+{
+  mir.text(s);
 }
 
 const std::string Parser::relationalInstruction(int value)
@@ -573,36 +765,147 @@ const std::string Parser::relationalInstruction(int value)
     case Parser::ISGE:
       return "jge";
     default:
-      std::cout << "Error in getRelationalInstruction" << std::endl;
-      exit(1);
+      throw CompileError("Error in getRelationalInstruction");
+    }
+}
+
+// The MInstr condition a relational operator tests
+int Parser::relationalCondition(int value)
+{
+  switch(value)
+    {
+    case Parser::ISEQ:
+      return MInstr::E;
+    case Parser::ISNE:
+      return MInstr::NE;
+    case Parser::ISLT:
+      return MInstr::L;
+    case Parser::ISLE:
+      return MInstr::LE;
+    case Parser::ISGT:
+      return MInstr::G;
+    default:
+      return MInstr::GE;
     }
 }
 
 void Parser::printRelational(int value)
 {
-  std::string s1=makeLabel();
-  std::string s2=makeLabel();
-  emit("pop rbx");
-  emit("pop rax");
-  emit("cmp rax,rbx");
-  emit(relationalInstruction(value) + " " + s1);
-  emit("mov rax,0");
-  emit("jmp " + s2);
-  emit(s1 + ":");
-  emit("mov rax,1");
-  emit(s2 + ":");
-  emit("push rax");
+  int s1 = mir.symbol(makeLabel());
+  int s2 = mir.symbol(makeLabel());
+  mir.add(MInstr::POP, MOperand::reg(RBX));
+  mir.add(MInstr::POP, MOperand::reg(RAX));
+  mir.add(MInstr::CMP, MOperand::reg(RAX), MOperand::reg(RBX));
+  mir.jcc(relationalCondition(value), s1);
+  mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(0));
+  mir.add(MInstr::JMP, MOperand::label(s2));
+  mir.label(s1);
+  mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(1));
+  mir.label(s2);
+  mir.add(MInstr::PUSH, MOperand::reg(RAX));
+}
+
+// L labels made so far; a parser's first one is L2, a shard's @L1
+int Parser::labelCount()
+{
+  return m_shard ? lindex : lindex - 1;
+}
+
+// Returns the number of the fmt label holding the string
+int Parser::addFormat(std::string fmt)
+{
+  return strings.intern("`" + fmt + "`");
+}
+
+// The symbol of the fmt label for the string
+int Parser::formatSymbol(const std::string& fmt)
+{
+  return mir.symbol((m_shard ? "@fmt" : "fmt") + itos(addFormat(fmt)));
+}
+
+/*
+  Appends the code a shard generated.  Its labels and strings are
+  renumbered as if this parser had generated the function itself, so
+  merging the shards in source order reproduces the serial output.
+*/
+void Parser::merge(Parser& shard)
+{
+  std::map<std::string, std::string> renames;
+
+  for (int i = 1; i <= shard.lindex; i++)
+    renames["@L" + itos(i)] = "L" + itos(lindex + i);
+  lindex += shard.lindex;
+  for (int i = 0; i < shard.strings.size(); i++)
+    renames["@fmt" + itos(i + 1)] = "fmt" + itos(strings.intern(shard.strings.at(i)));
+
+  mir.append(shard.mir, renames);
+}
+
+int Parser::formatCount()
+{
+  return strings.size();
+}
+
+// The fmt string as NASM text, including the backquotes
+const std::string& Parser::format(int i)
+{
+  return strings.at(i);
+}
+
+/*
+  Lowers a printf to direct calls into the mcrt runtime: literal text
+  goes to mcrt_write and every conversion to mcrt_putint with its flags
+  and width packed into one word.  args says where each argument is read
+  from.  Emits nothing and returns false when the format needs printf.
+*/
+bool Parser::genPrintfChunks(const std::string& fmt, const std::vector<MOperand>& args)
+{
+  std::vector<FormatChunk> chunks;
+  size_t conversions = 0;
+
+  if (!splitFormat(fmt, chunks))
+    return false;
+  for (size_t i = 0; i < chunks.size(); i++)
+    conversions += chunks[i].conversion;
+  if (conversions != args.size())
+    return false;
+
+  size_t a = 0;
+  for (size_t i = 0; i < chunks.size(); i++)
+    {
+      if (chunks[i].conversion)
+	{
+	  mir.add(MInstr::MOV, MOperand::reg(RDI), args[a++]).indent = true;
+	  mir.add(MInstr::MOV, MOperand::reg(RSI), MOperand::imm(chunks[i].spec())).indent = true;
+	  mir.add(MInstr::CALL, MOperand::label(mir.symbol("mcrt_putint"))).indent = true;
+	}
+      else
+	{
+	  long long len = MBuffer::decodeString("`" + chunks[i].text + "`").size();
+	  mir.add(MInstr::MOV, MOperand::reg(RDI), MOperand::label(formatSymbol(chunks[i].text))).indent = true;
+	  mir.add(MInstr::MOV, MOperand::reg(RSI), MOperand::imm(len)).indent = true;
+	  mir.add(MInstr::CALL, MOperand::label(mir.symbol("mcrt_write"))).indent = true;
+	}
+    }
+
+  return true;
 }
 
-int nfmts = 0;
-std::string fmts[100];
-int varcnt = 0;
+// Strips the colon from a LABEL node's text
+static std::string labelName(const std::string& val)
+{
+  if (!val.empty() && val[val.size() - 1] == ':')
+    return val.substr(0, val.size() - 1);
+  return val;
+}
 
 void Parser::geninst(Parser::TreeNode* node)
 {
+  STAT_TIMER(CODEGEN);
   std::string fmt = "";
   int nparams = 0;
   const int MAXVARBYTES = 100;
+  static const int argregs[] = { RSI, RDX, RCX, R8, R9 };
   
   if (node != NULL)
     {
@@ -613,160 +916,195 @@ void Parser::geninst(Parser::TreeNode* node)
       case SEQ:
 	break;
       case LOADV:
-	emit("push qword[rbp-" + std::to_string(static_cast<long long>(std::stoi(node->val) * 8)) + "]");
+	mir.add(MInstr::PUSH, MOperand::mem(RBP, -std::stoi(node->val) * 8));
 	break;
       case LOADL:
-	emit("mov rax," + node->val);
-	emit("push rax");	
+	mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(node->literal()));
+	mir.add(MInstr::PUSH, MOperand::reg(RAX));
 	break;
       case ADD:
-	emit("pop rbx");
-	emit("pop rax");
-	emit("add rax,rbx");
-	emit("push rax");
-	break;
       case SUB:
-	emit("pop rbx");
-	emit("pop rax");
-	emit("sub rax,rbx");
-	emit("push rax");
+      case AND:
+      case OR:
+	mir.add(MInstr::POP, MOperand::reg(RBX));
+	mir.add(MInstr::POP, MOperand::reg(RAX));
+	mir.add(node->op == ADD ? MInstr::ADD : node->op == SUB ? MInstr::SUB :
+		node->op == AND ? MInstr::AND : MInstr::OR,
+		MOperand::reg(RAX), MOperand::reg(RBX));
+	mir.add(MInstr::PUSH, MOperand::reg(RAX));
 	break;
       case MULT:
-	emit("pop rbx");
-	emit("pop rax");
-	emit("imul rbx");
-	emit("push rax");      
+	mir.add(MInstr::POP, MOperand::reg(RBX));
+	mir.add(MInstr::POP, MOperand::reg(RAX));
+	mir.add(MInstr::IMUL, MOperand::reg(RBX));
+	mir.add(MInstr::PUSH, MOperand::reg(RAX));
       break;
       case DIV:
-	emit("mov rdx,0");
-	emit("pop rbx");
-	emit("pop rax");
-	emit("idiv rbx");
-	emit("push rax");      
+	// Signed, truncating toward zero, as at -O1 and in the VM and C backends
+	mir.add(MInstr::POP, MOperand::reg(RBX));
+	mir.add(MInstr::POP, MOperand::reg(RAX));
+	mir.add(MInstr::CQO);
+	mir.add(MInstr::IDIV, MOperand::reg(RBX));
+	mir.add(MInstr::PUSH, MOperand::reg(RAX));
 	break;
       case STORE:
-	emit("pop qword[rbp-" + std::to_string(static_cast<long long>(std::stoi(node->val) * 8)) + "]");
-	break;
-      case AND:
-	emit("pop rbx");
-	emit("pop rax");
-	emit("and rax,rbx");
-	emit("push rax");
-	break;
-      case OR:
-	emit("pop rbx");
-	emit("pop rax");
-	emit("or rax,rbx");
-	emit("push rax");
+	mir.add(MInstr::POP, MOperand::mem(RBP, -std::stoi(node->val) * 8));
 	break;
       case LABEL:      
-	emit(node->val);	
+	mir.label(mir.symbol(labelName(node->val)));
 	break;
       case ISEQ:
-	printRelational(node->op);	
-	break;
       case ISNE:
-	printRelational(node->op);	
-	break;
       case ISLT:
-	printRelational(node->op);	
-	break;
       case ISLE:
-	printRelational(node->op);
-   	break;
       case ISGT:
-	printRelational(node->op);
- 	break;
       case ISGE:
 	printRelational(node->op);
 	break;
       case JUMP:
-	emit("jmp " + node->val);
+	mir.add(MInstr::JMP, MOperand::label(mir.symbol(node->val)));
 	break;
       case JUMPF:
-	emit("pop rax");
-	emit("cmp rax,0");
-	emit("je " + node->val);	
-	break;
       case JUMPT:
-	emit("pop rax");
-	emit("cmp rax,0");
-	emit("jne " + node->val);	
+	mir.add(MInstr::POP, MOperand::reg(RAX));
+	mir.add(MInstr::CMP, MOperand::reg(RAX), MOperand::imm(0));
+	mir.jcc(node->op == JUMPF ? MInstr::E : MInstr::NE, mir.symbol(node->val));
 	break;
       case CALL:
-	emit("call " + node->val);	
-	emit("pop rbx");
-	emit("add rsp,rbx");
-	emit("push rax");
+	mir.add(MInstr::CALL, MOperand::label(mir.symbol(node->val)));
+	mir.add(MInstr::POP, MOperand::reg(RBX));
+	mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::reg(RBX));
+	mir.add(MInstr::PUSH, MOperand::reg(RAX));
 	break;
       case FUNC:
-	emit(node->val + ":");
-	emit("push rbp");
-	emit("mov rbp,rsp");
-	emit("sub rsp," + std::to_string(static_cast<long long>(MAXVARBYTES)));
+	mir.label(mir.symbol(node->val));
+	mir.add(MInstr::PUSH, MOperand::reg(RBP));
+	mir.add(MInstr::MOV, MOperand::reg(RBP), MOperand::reg(RSP));
+	mir.add(MInstr::SUB, MOperand::reg(RSP), MOperand::imm(MAXVARBYTES));
 	varcnt = 0;	
 	break;
       case RET:
-	emit("pop rax");
-	emit("add rsp," + std::to_string(static_cast<long long>(MAXVARBYTES)));
-	emit("pop rbp");	
-	emit("ret\n");	
+	mir.add(MInstr::POP, MOperand::reg(RAX));
+	mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::imm(MAXVARBYTES));
+	mir.add(MInstr::POP, MOperand::reg(RBP));
+	mir.add(MInstr::RET);
+	mir.blank();
 	break;
       case PRINTF:
 	fmt = node->val;
-	nparams = fmt.at(0) - '0';
-	fmt = "`" + fmt.substr(1) + "`";
-	fmts[nfmts++] = fmt;
-	emit(" mov rdi,fmt" + itos(nfmts));
-	if (nparams == 5) {
-	  emit(" pop r9");
-	  --nparams;
-	}
-	if (nparams == 4) {
-	  emit(" pop r8");
-	  --nparams;
-	}
-	if (nparams == 3) {
-	  emit(" pop rcx");
-	  --nparams;
-	}
-	if (nparams == 2) {
-	  emit(" pop rdx");
-	  --nparams;
-	}
-	if (nparams == 1) {
-	  emit(" pop rsi");
-	}
-	emit(" mov rax,0");
-	emit(" push rbp");
-	emit(" call printf");
-	emit(" pop rbp");	
+	nparams = node->paramCount;
+	// Arguments were pushed left to right, so the last one is on top
+	if (specializePrintf)
+	  {
+	    std::vector<MOperand> args;
+	    for (int i = 0; i < nparams; i++)
+	      args.push_back(MOperand::mem(RSP, (nparams - 1 - i) * 8));
+	    if (genPrintfChunks(fmt, args))
+	      {
+		if (nparams > 0)
+		  mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::imm(nparams * 8)).indent = true;
+		break;
+	      }
+	  }
+	mir.add(MInstr::MOV, MOperand::reg(RDI), MOperand::label(formatSymbol(fmt))).indent = true;
+	if (nparams <= 5)
+	  {
+	    for (int i = nparams; i > 0; i--)
+	      mir.add(MInstr::POP, MOperand::reg(argregs[i - 1])).indent = true;
+	    mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(0)).indent = true;
+	    mir.add(MInstr::PUSH, MOperand::reg(RBP)).indent = true;
+	    mir.add(MInstr::CALL, MOperand::label(mir.symbol("printf"))).indent = true;
+	    mir.add(MInstr::POP, MOperand::reg(RBP)).indent = true;
+	    break;
+	  }
+	// The first five go in registers, the rest are pushed again in
+	// reverse so the sixth ends up on top, as the ABI wants
+	mir.add(MInstr::MOV, MOperand::reg(R10), MOperand::reg(RSP)).indent = true;
+	for (int i = 0; i < 5; i++)
+	  mir.add(MInstr::MOV, MOperand::reg(argregs[i]), MOperand::mem(R10, (nparams - 1 - i) * 8)).indent = true;
+	for (int i = nparams - 1; i >= 5; i--)
+	  mir.add(MInstr::PUSH, MOperand::mem(R10, (nparams - 1 - i) * 8)).indent = true;
+	mir.add(MInstr::MOV, MOperand::reg(RAX), MOperand::imm(0)).indent = true;
+	mir.add(MInstr::CALL, MOperand::label(mir.symbol("printf"))).indent = true;
+	mir.add(MInstr::ADD, MOperand::reg(RSP), MOperand::imm((2 * nparams - 5) * 8)).indent = true;
 	break;
       case PARAM:
 	++varcnt;
-	//emit("# paramCount: " + std::to_string((long long)node->paramCount));
-	emit("mov rsi,qword[rbp+" + std::to_string(static_cast<long long>((node->paramCount + 2) * 8)) + "]");
-	emit("mov qword[rbp-" + std::to_string(static_cast<long long>(varcnt * 8)) + "],rsi");
+	mir.add(MInstr::MOV, MOperand::reg(RSI), MOperand::mem(RBP, (node->paramCount + 2) * 8));
+	mir.add(MInstr::MOV, MOperand::mem(RBP, -varcnt * 8), MOperand::reg(RSI));
 	break;
       default:
-	std::cerr << "In geninst: Unknown operation " << node->op << std::endl;
-	exit(1);      
+	throw CompileError("In geninst: Unknown operation " + itos(node->op));
       }
     }
 }
 
-void Parser::genasm(Parser::TreeNode* node)
+/*
+  A program exports main.  A module exports all of its functions and
+  imports the ones it calls without defining them, for the linker to
+  resolve against the other modules.
+*/
+void Parser::genheader()
 {
-  emit("\tglobal main");
+  if (!module)
+    emit("\tglobal main");
+  else
+    {
+      for (size_t i = 0; i < defined.size(); i++)
+	emit("\tglobal " + defined[i]);
+      std::vector<std::string> names = imports();
+      for (size_t i = 0; i < names.size(); i++)
+	emit("\textern " + names[i]);
+    }
+  if (specializePrintf)
+    emit("\textern mcrt_write, mcrt_putint");
   emit("\textern printf\n");
   emit("\tsection .text\n");
-  
-  geninst(node);
-  
-  std::cout << std::endl << " section .data" << std::endl;
-  for (int i=0; i < nfmts; ++i) {
-    std::cout << " fmt" << i+1 << ": db " << fmts[i] << ", 0" << std::endl;
+}
+
+// The functions called but not defined, in name order
+std::vector<std::string> Parser::imports()
+{
+  std::set<std::string> own(defined.begin(), defined.end());
+  std::vector<std::string> names;
+
+  for (std::set<std::string>::iterator it = called.begin(); it != called.end(); ++it)
+    if (!own.count(*it))
+      names.push_back(*it);
+  return names;
+}
+
+/*
+  Renders the buffered machine code as NASM text
+*/
+void Parser::flushCode()
+{
+  STAT_TIMER(OUTPUT);
+  STAT_COUNT(INSTRUCTIONS, mir.code.size());
+  mir.print(sink);
+  mir.clear();
+}
+
+void Parser::gendata()
+{
+  STAT_TIMER(OUTPUT);
+  flushCode();
+  sink.line("\n section .data");
+  for (int i=0; i < strings.size(); ++i) {
+    sink.put(" fmt", 4);
+    sink.put(static_cast<long long>(i+1));
+    sink.put(": db ", 5);
+    sink.put(strings.at(i));
+    sink.line(", 0");
   }
+  sink.flush();
+}
+
+void Parser::genasm(Parser::TreeNode* node)
+{
+  genheader();
+  geninst(node);
+  gendata();
 }
 
 void Parser::gensasm(Parser::TreeNode *node) {
@@ -779,80 +1117,79 @@ void Parser::gensasm(Parser::TreeNode *node) {
     case SEQ:
       break;
     case LOADV:
-      std::cout << ("LOADV " + node->val) << std::endl;
+      emit("LOADV " + node->val);
       break;
     case LOADL:
-      std::cout << ("LOADL " + node->val) << std::endl;
+      emit("LOADL " + node->val);
       break;
     case ADD:
-      std::cout << ("ADD") << std::endl;
+      emit("ADD");
       break;
     case SUB:
-      std::cout << ("SUB") << std::endl;
+      emit("SUB");
       break;
     case MULT:
-      std::cout << ("MULT") << std::endl;
+      emit("MULT");
       break;
     case DIV:
-      std::cout << ("DIV") << std::endl;
+      emit("DIV");
       break;
     case STORE:
-      std::cout << ("STORE " + node->val) << std::endl;
+      emit("STORE " + node->val);
       break;
     case AND:
-      std::cout << ("AND") << std::endl;
+      emit("AND");
       break;
     case OR:
-      std::cout << ("OR") << std::endl;
+      emit("OR");
       break;
     case LABEL:
-      std::cout << (node->val) << std::endl;
+      emit(node->val);
       break;
     case ISEQ:
-      std::cout << ("ISEQ") << std::endl;
+      emit("ISEQ");
       break;
     case ISNE:
-      std::cout << ("ISNE") << std::endl;
+      emit("ISNE");
       break;
     case ISLT:
-      std::cout << ("ISLT") << std::endl;
+      emit("ISLT");
       break;
     case ISLE:
-      std::cout << ("ISLE") << std::endl;
+      emit("ISLE");
       break;
     case ISGT:
-      std::cout << ("ISGT") << std::endl;
+      emit("ISGT");
       break;
     case ISGE:
-      std::cout << ("ISGE") << std::endl;
+      emit("ISGE");
       break;
     case JUMP:
-      std::cout << ("JUMP " + node->val) << std::endl;
+      emit("JUMP " + node->val);
       break;
     case JUMPF:
-      std::cout << ("JUMPF " + node->val) << std::endl;
+      emit("JUMPF " + node->val);
       break;
     case JUMPT:
-      std::cout << ("JUMPT " + node->val) << std::endl;
+      emit("JUMPT " + node->val);
       break;
     case CALL:
-      std::cout << ("CALL " + node->val) << std::endl;
+      emit("CALL " + node->val);
       break;
     case FUNC:
-      std::cout << ("FUNC " + node->val) << std::endl;      
+      emit("FUNC " + node->val);      
       break;
     case RET:
-      std::cout << ("RET ") << std::endl;
+      emit("RET ");
       break;
     case PRINTF:
-      std::cout << ("PRINTF '" + node->val + "'") << std::endl;
+      emit("PRINTF '" + itos(node->paramCount) + node->val + "'");
       break;
     case PARAM:
-      std::cout << ("PARAM " + node->val) << std::endl;      
+      emit("PARAM " + node->val);      
       break;
     default:
-      std::cerr << "In gensasm: Unknown operation " << node->op << std::endl;
-      exit(1);
+      throw CompileError("In gensasm: Unknown operation " + itos(node->op));
       break;      
     }
   }
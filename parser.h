@@ -4,15 +4,21 @@
 #include "token.h"
 #include "lexer.h"
 #include "SymbolTable.h"
+#include "outbuf.h"
+#include "mir.h"
+#include "constpool.h"
 
 #include <iostream>
 #include <string>
 #include <cstring>
 #include <stdlib.h>
+#include <set>
 #include <sstream>
+#include <vector>
 
 class Parser {
   
+public:
   enum Operation {
     ADD, SUB, MULT, DIV, // Arithmetic Operators
     ISEQ, ISNE, ISLT, ISLE, ISGT, ISGE, // Relational Operators
@@ -24,7 +30,6 @@ class Parser {
     FUNC, PARAM // new Operations
   };
   
-public:
   class TreeNode;
   
   TreeNode* funcall(std::string functionName);
@@ -46,17 +51,44 @@ public:
   TreeNode* parameterdefs();
   TreeNode* function();
   TreeNode* compilationunit();
+  bool atEnd();
+  bool failed();
+  void reportErrors();
 
-  void emit(std::string s);
+  void emit(const std::string& s);
   void printRelational(int value);  
   const std::string relationalInstruction(int value);
+  static int relationalCondition(int value);
+  
+  int labelCount();
+
+  int addFormat(std::string fmt);
+  int formatSymbol(const std::string& fmt);
+  int formatCount();
+  const std::string& format(int i);
+  bool genPrintfChunks(const std::string& fmt, const std::vector<MOperand>& args);
   
   void geninst(Parser::TreeNode* node);
+  void genheader();
+  std::vector<std::string> imports();
+  void gendata();
+  void flushCode();
   void genasm(Parser::TreeNode* node);
   void gensasm(Parser::TreeNode * node);
   
   Parser(Lexer& lexer, std::ostream& out);
+  Parser(Parser& parent);
   ~Parser();
+
+  void merge(Parser& shard);
+
+  MBuffer mir; // Machine code waiting to be printed
+  ConstantPool strings; // printf formats, in NASM backquote syntax
+  bool specializePrintf; // Lower printf to the mcrt runtime's primitives
+  std::vector<TreeNode*> functions; // Root of each function's tree, in source order
+  bool module; // Compiling one module of a program; see genheader()
+  std::vector<std::string> defined; // Names of the functions parsed, in source order
+  std::set<std::string> called; // Names of the functions called
   
   // Parser::TreeNode
   class TreeNode {
@@ -92,17 +124,48 @@ public:
       init(op, "", leftChild, rightChild);
     }
     
+    // The value of a LOADL, which the parser has checked fits in 64 bits
+    long long literal() const { return strtoll(val.c_str(), NULL, 10); }
+
     static std::string toString(TreeNode *node);
     static std::string toString0(TreeNode *node, int spaces);
+
+    // Register the node with the current NodePool, if any, and take it
+    // back out when a constructor argument throws
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+  };
+
+  // Owns every TreeNode allocated on a thread while it is that thread's
+  // current pool, including the copies the Unroller makes, and deletes
+  // them all when it is destroyed.
+  class NodePool {
+  public:
+    NodePool();
+    ~NodePool();
+
+    void add(TreeNode* node);
+    void remove(TreeNode* node);
+    size_t size();
+
+    static thread_local NodePool* current;
+
+  private:
+    std::vector<TreeNode*> m_nodes;
   };
   
 private:
+  std::ostream m_discard; // Output of a shard, which has none
   Lexer& lexer;
   Token* token;
   std::ostream& out;
+  OutputSink sink;
   int lindex;
   int tindex;
+  int varcnt; // PARAM slots assigned so far in the current function
+  bool m_shard;
   SymbolTable symTable;
+  std::vector<std::string> m_diagnostics; // Every error found, in source order
   
   std::string itos(int i) {
     std::stringstream ss;
@@ -111,8 +174,9 @@ private:
     return res;
   }
   
+  // Shards number their labels on their own; merge() renames them
   std::string makeLabel() {
-    std::string tmp = "L";
+    std::string tmp = m_shard ? "@L" : "L";
     std::stringstream ss;
     ss << ++lindex;
     std::string res = ss.str();
@@ -122,8 +186,13 @@ private:
 
   static const std::string ops[];
   
+  // Unwinds from a syntax error to statement() or function()
+  class SyntaxError {};
+
+  void report(std::string message);
   void error(std::string message);
   void check(int tokenType, std::string message);
+  void synchronize();
 };
 
 #endif
@@ -0,0 +1,320 @@
+#include "server.h"
+#include "compiler.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+// Writes all of data, or returns false
+static bool sendAll(int fd, const std::string& data)
+{
+  size_t done = 0;
+
+  while (done < data.size())
+    {
+      ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      done += n;
+    }
+  return true;
+}
+
+// A line of at most MAX_LINE bytes, without its newline
+static bool readLine(FILE* in, std::string& line)
+{
+  int c;
+
+  line.clear();
+  while ((c = getc(in)) != EOF && c != '\n')
+    {
+      if (line.size() == CompileServer::MAX_LINE)
+	return false;
+      line += static_cast<char>(c);
+    }
+  return c == '\n';
+}
+
+// Grows data as the bytes arrive, so a false length costs no memory
+static bool readBytes(FILE* in, size_t n, std::string& data)
+{
+  char buffer[65536];
+
+  data.clear();
+  while (data.size() < n)
+    {
+      size_t got = fread(buffer, 1, std::min(sizeof(buffer), n - data.size()), in);
+      if (got == 0)
+	return false;
+      data.append(buffer, got);
+    }
+  return true;
+}
+
+// A decimal length no greater than max
+static bool parseLength(const std::string& text, size_t max, size_t& n)
+{
+  if (text.empty() || text.size() > 20 || text.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  unsigned long long value = strtoull(text.c_str(), NULL, 10);
+  n = value;
+  return value <= max;
+}
+
+static bool socketAddress(const std::string& path, struct sockaddr_un& addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+  strcpy(addr.sun_path, path.c_str());
+  return true;
+}
+
+// True if path is a socket, as one left by a server that died
+static bool isSocket(const std::string& path)
+{
+  struct stat st;
+
+  return lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+CompileServer::CompileServer(const std::string& pathx) : path(pathx), m_listen(-1), m_stop(false)
+{
+
+}
+
+CompileServer::~CompileServer()
+{
+  for (std::map<std::string, IncrementalState*>::iterator it = m_files.begin(); it != m_files.end(); ++it)
+    delete it->second;
+}
+
+/*
+  Accepts connections until a shutdown request, serving each on its own
+  thread, at most MAX_CONNECTIONS at a time; 1 if the socket cannot be
+  set up.  Only a socket is replaced at the path, never another file.
+*/
+int CompileServer::run()
+{
+  struct sockaddr_un addr;
+
+  if (!socketAddress(path, addr))
+    {
+      std::cerr << "microc: socket path too long: " << path << std::endl;
+      return 1;
+    }
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0)
+    {
+      if (!S_ISSOCK(st.st_mode))
+	{
+	  std::cerr << "microc: " << path << " exists and is not a socket" << std::endl;
+	  return 1;
+	}
+      unlink(path.c_str());
+    }
+  m_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (m_listen < 0 || bind(m_listen, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(m_listen, 16) < 0)
+    {
+      std::cerr << "microc: cannot listen on " << path << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+
+  // Threads are detached; shutdown waits for their connections to end
+  std::unique_lock<std::mutex> lock(m_lock);
+  for (;;)
+    {
+      while (m_connections.size() >= MAX_CONNECTIONS && !m_stop)
+	m_idle.wait(lock);
+      if (m_stop)
+	break;
+      lock.unlock();
+      int fd = accept(m_listen, NULL, NULL);
+      lock.lock();
+
+      if (m_stop)
+	{
+	  if (fd >= 0)
+	    close(fd);
+	  break;
+	}
+      if (fd < 0)
+	continue;
+      m_connections.push_back(fd);
+      std::thread(&CompileServer::serve, this, fd).detach();
+    }
+
+  while (!m_connections.empty())
+    m_idle.wait(lock);
+  lock.unlock();
+  close(m_listen);
+  if (isSocket(path))
+    unlink(path.c_str());
+  return 0;
+}
+
+// Ends run() and every connection.  Called with m_lock held.
+void CompileServer::stop()
+{
+  m_stop = true;
+  m_idle.notify_all();
+  shutdown(m_listen, SHUT_RDWR);
+  for (size_t i = 0; i < m_connections.size(); i++)
+    shutdown(m_connections[i], SHUT_RDWR);
+}
+
+// Answers the requests on one connection until the client closes it
+void CompileServer::serve(int fd)
+{
+  FILE* in = fdopen(dup(fd), "r");
+  std::string command;
+  std::string name;
+
+  while (in && readLine(in, command))
+    {
+      if (command == "shutdown")
+	{
+	  std::lock_guard<std::mutex> guard(m_lock);
+	  stop();
+	  break;
+	}
+      if (!readLine(in, name))
+	break;
+      if (command == "close")
+	{
+	  std::lock_guard<std::mutex> guard(m_lock);
+	  std::map<std::string, IncrementalState*>::iterator it = m_files.lower_bound(name + "\n");
+	  while (it != m_files.end() && it->first.compare(0, name.size() + 1, name + "\n") == 0)
+	    {
+	      delete it->second;
+	      m_files.erase(it++);
+	    }
+	  continue;
+	}
+
+      // The request is read before taking the lock, so a slow client
+      // does not hold up the others
+      std::string options, length, source, output, diagnostics;
+      size_t bytes;
+      if (command != "compile" || !readLine(in, options) || !readLine(in, length) ||
+	  !parseLength(length, MAX_SOURCE, bytes) || !readBytes(in, bytes, source))
+	break;
+      int status;
+      {
+	std::lock_guard<std::mutex> guard(m_lock);
+	status = compile(name, options, source, output, diagnostics);
+      }
+
+      std::ostringstream header;
+      header << status << " " << output.size() << " " << diagnostics.size() << "\n";
+      if (!sendAll(fd, header.str() + output + diagnostics))
+	break;
+    }
+
+  if (in)
+    fclose(in);
+  std::lock_guard<std::mutex> guard(m_lock);
+  for (size_t i = 0; i < m_connections.size(); i++)
+    if (m_connections[i] == fd)
+      m_connections.erase(m_connections.begin() + i);
+  close(fd);
+  m_idle.notify_all();
+}
+
+/*
+  Compiles a file with the state kept for it under these options, made
+  on its first request.  Only assembly output is served.
+*/
+int CompileServer::compile(const std::string& name, const std::string& options, const std::string& source,
+			   std::string& output, std::string& diagnostics)
+{
+  CompileOptions opts;
+  std::istringstream words(options);
+  std::string word;
+
+  while (words >> word)
+    if (!opts.parse(word.c_str()))
+      {
+	diagnostics = "microc: unknown option " + word + "\n";
+	return 1;
+      }
+  if (opts.object || opts.run || opts.vm || opts.dumpBytecode || opts.emitC || opts.dumpIR ||
+      opts.licmReport || opts.stream || opts.module)
+    {
+      diagnostics = "microc: the compile server only makes assembly: " + options + "\n";
+      return 1;
+    }
+
+  IncrementalState*& state = m_files[name + "\n" + options];
+  if (!state)
+    state = new IncrementalState("", "");
+
+  std::istringstream in(source);
+  std::ostringstream out, err;
+  CompilationContext context(in, out, err, opts);
+  context.resident = state;
+  int status = context.compile();
+  output = out.str();
+  diagnostics = err.str();
+  return status;
+}
+
+/*
+  Sends one compile request to a server and writes the output and the
+  diagnostics it returns; the result is the compile's status, or 1 if
+  the server cannot be reached
+*/
+int CompileServer::request(const std::string& path, const std::string& name,
+			   const std::vector<std::string>& options, const std::string& source,
+			   std::ostream& out, std::ostream& err)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd < 0 || !socketAddress(path, addr) ||
+      connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+      err << "microc: cannot connect to " << path << std::endl;
+      if (fd >= 0)
+	close(fd);
+      return 1;
+    }
+
+  std::ostringstream req;
+  req << "compile\n" << name << "\n";
+  for (size_t i = 0; i < options.size(); i++)
+    req << (i ? " " : "") << options[i];
+  req << "\n" << source.size() << "\n" << source;
+
+  FILE* in = fdopen(dup(fd), "r");
+  std::string header, output, diagnostics;
+  int status = 1;
+  size_t outBytes = 0, errBytes = 0;
+
+  if (!sendAll(fd, req.str()) || !in || !readLine(in, header) ||
+      sscanf(header.c_str(), "%d %zu %zu", &status, &outBytes, &errBytes) != 3 ||
+      !readBytes(in, outBytes, output) || !readBytes(in, errBytes, diagnostics))
+    {
+      err << "microc: no answer from " << path << std::endl;
+      status = 1;
+    }
+  out << output;
+  err << diagnostics;
+
+  if (in)
+    fclose(in);
+  close(fd);
+  return status;
+}
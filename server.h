@@ -0,0 +1,59 @@
+#pragma once
+
+#include "incremental.h"
+
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Resident compile server for editors and file watchers.  It listens on
+// a Unix socket and keeps an IncrementalState for every file it has
+// compiled, so compiling a file again relexes and reparses only the
+// functions around the edit and relinks the others from memory.
+//
+// Each request on a connection is one of
+//
+//   compile\n<name>\n<options>\n<length>\n<source>
+//   close\n<name>\n
+//   shutdown\n
+//
+// where options are microc's, separated by spaces.  A compile is
+// answered with "<status> <output length> <diagnostics length>\n" and
+// both texts; the output is always assembly.  close forgets a file.  A
+// line longer than MAX_LINE, a source longer than MAX_SOURCE or a length
+// that is not a number ends the connection.  At most MAX_CONNECTIONS are
+// served at once; more wait to be accepted.
+class CompileServer
+{
+public:
+  CompileServer(const std::string& pathx);
+  ~CompileServer();
+
+  int run();
+
+  static int request(const std::string& path, const std::string& name,
+		     const std::vector<std::string>& options, const std::string& source,
+		     std::ostream& out, std::ostream& err);
+
+  std::string path;
+
+  static const size_t MAX_LINE = 4096;
+  static const size_t MAX_SOURCE = 64 << 20;
+  static const size_t MAX_CONNECTIONS = 64;
+
+private:
+  void serve(int fd);
+  int compile(const std::string& name, const std::string& options, const std::string& source,
+	      std::string& output, std::string& diagnostics);
+  void stop();
+
+  std::mutex m_lock;                                  // Held while a request is served
+  std::map<std::string, IncrementalState*> m_files;   // By name and options
+  std::vector<int> m_connections;
+  std::condition_variable m_idle;                     // Signalled as connections end
+  int m_listen;
+  bool m_stop;
+};
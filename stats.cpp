@@ -0,0 +1,165 @@
+#include "stats.h"
+
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdio>
+
+static const char* const PHASE_NAMES[] = { "read", "lex", "parse", "symbols", "optimize", "codegen", "output" };
+
+thread_local CompileStats* CompileStats::current = NULL;
+
+CompileStats::CompileStats() : total(0), m_phase(-1), m_since(0)
+{
+  for (int i = 0; i < COUNTERS; i++)
+    counters[i] = 0;
+  for (int i = 0; i < PHASES; i++)
+    nanos[i] = 0;
+}
+
+long long CompileStats::now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Charges the time since the last switch to the running phase
+void CompileStats::enter(int phase)
+{
+  long long t = now();
+
+  if (m_phase >= 0)
+    nanos[m_phase] += t - m_since;
+  m_phase = phase;
+  m_since = t;
+}
+
+void CompileStats::add(const CompileStats& other)
+{
+  for (int i = 0; i < COUNTERS; i++)
+    counters[i] += other.counters[i];
+  for (int i = 0; i < PHASES; i++)
+    nanos[i] += other.nanos[i];
+  total += other.total;
+}
+
+void CompileStats::print(std::ostream& os)
+{
+  char line[128];
+  long long timed = 0;
+
+  os << "phase          ms       %\n";
+  for (int i = 0; i < PHASES; i++)
+    {
+      snprintf(line, sizeof(line), "%-10s %9.3f %7.1f\n", PHASE_NAMES[i], nanos[i] / 1e6,
+	       total ? 100.0 * nanos[i] / total : 0.0);
+      os << line;
+      timed += nanos[i];
+    }
+  snprintf(line, sizeof(line), "%-10s %9.3f %7.1f\n%-10s %9.3f\n", "other",
+	   timed < total ? (total - timed) / 1e6 : 0.0, timed < total ? 100.0 * (total - timed) / total : 0.0,
+	   "total", total / 1e6);
+  os << line;
+
+  os << "tokens          " << counters[TOKENS] << "\n"
+     << "tree nodes      " << counters[NODES] << "\n"
+     << "symbol lookups  " << counters[LOOKUPS];
+  if (counters[LOOKUPS])
+    {
+      snprintf(line, sizeof(line), " (average scope depth %.2f)", 1.0 * counters[SCOPE_DEPTH] / counters[LOOKUPS]);
+      os << line;
+    }
+  os << "\n"
+     << "instructions    " << counters[INSTRUCTIONS] << "\n"
+     << "bytes written   " << counters[BYTES] << std::endl;
+}
+
+void CompileStats::printJSON(std::ostream& os)
+{
+  char ms[32];
+
+  os << "{\"phases_ms\": {";
+  for (int i = 0; i < PHASES; i++)
+    {
+      snprintf(ms, sizeof(ms), "%.3f", nanos[i] / 1e6);
+      os << (i ? ", " : "") << "\"" << PHASE_NAMES[i] << "\": " << ms;
+    }
+  snprintf(ms, sizeof(ms), "%.3f", total / 1e6);
+  os << "}, \"total_ms\": " << ms
+     << ", \"tokens\": " << counters[TOKENS]
+     << ", \"tree_nodes\": " << counters[NODES]
+     << ", \"symbol_lookups\": " << counters[LOOKUPS]
+     << ", \"scope_depth_sum\": " << counters[SCOPE_DEPTH]
+     << ", \"instructions\": " << counters[INSTRUCTIONS]
+     << ", \"bytes_written\": " << counters[BYTES] << "}" << std::endl;
+}
+
+CompileStats::Scope::Scope(CompileStats* stats) : m_previous(current)
+{
+  if (stats)
+    current = stats;
+}
+
+CompileStats::Scope::~Scope()
+{
+  current = m_previous;
+}
+
+static const char* const CATEGORY_NAMES[] = { "tokens", "ast", "symbols", "codegen", "output", "total" };
+
+bool MemoryStats::enabled = false;
+std::atomic<long long> MemoryStats::s_current[CATEGORIES + 1];
+std::atomic<long long> MemoryStats::s_peak[CATEGORIES + 1];
+std::atomic<long long> MemoryStats::s_count[CATEGORIES + 1];
+
+// Raises peak to at least value
+static void raise(std::atomic<long long>& peak, long long value)
+{
+  long long old = peak.load(std::memory_order_relaxed);
+  while (value > old && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+    ;
+}
+
+void MemoryStats::allocate(Category category, long long bytes)
+{
+  raise(s_peak[category], s_current[category].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  raise(s_peak[CATEGORIES], s_current[CATEGORIES].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+  s_count[category].fetch_add(1, std::memory_order_relaxed);
+  s_count[CATEGORIES].fetch_add(1, std::memory_order_relaxed);
+}
+
+void MemoryStats::release(Category category, long long bytes)
+{
+  s_current[category].fetch_sub(bytes, std::memory_order_relaxed);
+  s_current[CATEGORIES].fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// The process's peak resident set, in KiB
+static long maxResident()
+{
+  struct rusage usage;
+
+  return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+void MemoryStats::print(std::ostream& os)
+{
+  char line[128];
+
+  os << "memory           current          peak   allocations\n";
+  for (int i = 0; i <= CATEGORIES; i++)
+    {
+      snprintf(line, sizeof(line), "%-10s %13lld %13lld %13lld\n", CATEGORY_NAMES[i],
+	       s_current[i].load(), s_peak[i].load(), s_count[i].load());
+      os << line;
+    }
+  os << "peak RSS   " << maxResident() << " KiB" << std::endl;
+}
+
+void MemoryStats::printJSON(std::ostream& os)
+{
+  os << "{";
+  for (int i = 0; i <= CATEGORIES; i++)
+    os << (i ? ", " : "") << "\"" << CATEGORY_NAMES[i] << "\": {\"current\": " << s_current[i].load()
+       << ", \"peak\": " << s_peak[i].load() << ", \"allocations\": " << s_count[i].load() << "}";
+  os << ", \"peak_rss_kib\": " << maxResident() << "}" << std::endl;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+
+// Phase timers and counters for --stats.  A CompileStats is made current
+// on a thread the way a NodePool is, and the STAT_ macros in the lexer,
+// parser, symbol table and output code add to it; with none current they
+// cost a thread-local load and a branch.  Building with -DMICROC_NO_STATS
+// compiles the macros to nothing.
+//
+// Phase times are exclusive: a Timer pauses the phase it interrupts, so
+// the lexing the parser asks for counts as lexing only.  Workers of a
+// parallel compile keep stats of their own, which are added up, so the
+// phases can sum to more than the wall time.
+class CompileStats
+{
+public:
+  enum Phase { READ, LEX, PARSE, SYMBOLS, OPTIMIZE, CODEGEN, OUTPUT, PHASES };
+  enum Counter { TOKENS, NODES, LOOKUPS, SCOPE_DEPTH, INSTRUCTIONS, BYTES, COUNTERS };
+
+  CompileStats();
+
+  void add(const CompileStats& other);
+  void print(std::ostream& os);
+  void printJSON(std::ostream& os);
+
+  long long counters[COUNTERS];
+  long long nanos[PHASES];
+  long long total;          // Wall time of the compilations, in ns
+
+  static long long now();
+
+  static thread_local CompileStats* current;
+
+  // Charges the time until it is destroyed to a phase
+  class Timer
+  {
+  public:
+    Timer(Phase phase);
+    ~Timer();
+
+  private:
+    CompileStats* m_stats;
+    int m_previous;
+  };
+
+  // Makes stats current on this thread for its lifetime; with NULL the
+  // current one stays
+  class Scope
+  {
+  public:
+    Scope(CompileStats* stats);
+    ~Scope();
+
+  private:
+    CompileStats* m_previous;
+  };
+
+private:
+  void enter(int phase);
+
+  int m_phase;              // Being timed, or -1
+  long long m_since;        // When it was entered
+};
+
+// Inline, so that with no stats current a timer costs no call.  A
+// timer inside the phase it times, as in a recursive call, does nothing.
+inline CompileStats::Timer::Timer(Phase phase) : m_stats(current), m_previous(-1)
+{
+  if (m_stats && m_stats->m_phase == phase)
+    m_stats = NULL;
+  if (m_stats)
+    {
+      m_previous = m_stats->m_phase;
+      m_stats->enter(phase);
+    }
+}
+
+inline CompileStats::Timer::~Timer()
+{
+  if (m_stats)
+    m_stats->enter(m_previous);
+}
+
+// Heap use for --mem-stats, by category: the bytes live now, their peak
+// and the number of allocations.  The counts are process wide, since a
+// shard's buffers are filled on one thread and freed on another, and are
+// only kept once enabled is set, before anything is compiled.  Objects
+// count their own size; the text of a string too long for its inline
+// buffer is only counted for codegen text.
+class MemoryStats
+{
+public:
+  enum Category { TOKENS, AST, SYMBOLS, CODEGEN, OUTPUT, CATEGORIES };
+
+  static void allocate(Category category, long long bytes);
+  static void release(Category category, long long bytes);
+  static void print(std::ostream& os);
+  static void printJSON(std::ostream& os);
+
+  static bool enabled;
+
+private:
+  static std::atomic<long long> s_current[CATEGORIES + 1];   // The last is the total
+  static std::atomic<long long> s_peak[CATEGORIES + 1];
+  static std::atomic<long long> s_count[CATEGORIES + 1];
+};
+
+// Charges what a standard container allocates to a category
+template <class T, MemoryStats::Category C>
+class AccountedAllocator
+{
+public:
+  typedef T value_type;
+
+  AccountedAllocator() {}
+  template <class U> AccountedAllocator(const AccountedAllocator<U, C>&) {}
+  template <class U> struct rebind { typedef AccountedAllocator<U, C> other; };
+
+  T* allocate(size_t n)
+  {
+#ifndef MICROC_NO_STATS
+    if (MemoryStats::enabled)
+      MemoryStats::allocate(C, n * sizeof(T));
+#endif
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+#ifndef MICROC_NO_STATS
+    if (MemoryStats::enabled)
+      MemoryStats::release(C, n * sizeof(T));
+#endif
+    ::operator delete(p);
+  }
+
+  template <class U> bool operator==(const AccountedAllocator<U, C>&) const { return true; }
+  template <class U> bool operator!=(const AccountedAllocator<U, C>&) const { return false; }
+};
+
+#ifndef MICROC_NO_STATS
+#define STAT_COUNT(counter, n)						\
+  do {									\
+    if (CompileStats::current)						\
+      CompileStats::current->counters[CompileStats::counter] += (n);	\
+  } while (0)
+#define STAT_TIMER(phase) CompileStats::Timer statTimer(CompileStats::phase)
+#define MEM_ALLOC(category, bytes)					\
+  do {									\
+    if (MemoryStats::enabled)						\
+      MemoryStats::allocate(MemoryStats::category, (bytes));		\
+  } while (0)
+#define MEM_FREE(category, bytes)					\
+  do {									\
+    if (MemoryStats::enabled)						\
+      MemoryStats::release(MemoryStats::category, (bytes));		\
+  } while (0)
+#else
+#define STAT_COUNT(counter, n) do {} while (0)
+#define STAT_TIMER(phase) do {} while (0)
+#define MEM_ALLOC(category, bytes) do {} while (0)
+#define MEM_FREE(category, bytes) do {} while (0)
+#endif
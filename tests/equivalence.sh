@@ -0,0 +1,49 @@
+#!/bin/bash
+# Ways of compiling the same program that must give the same bytes: a
+# parallel compile against a serial one, and an incremental rebuild after
+# an edit against a whole-program compile.  The programs come from
+# bench/mcgen random.  Run from the repository root after make microc
+# bench/mcgen.
+#
+#   tests/equivalence.sh [seeds] [jobs]
+
+seeds=${1:-30}
+jobs=${2:-4}
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+failures=0
+
+# Fails the test unless two outputs are identical
+same() {
+  if ! cmp -s $1 $2; then
+    echo "FAIL seed $seed: $3"
+    failures=$((failures + 1))
+  fi
+}
+
+for ((seed = 1; seed <= seeds; seed++)); do
+  bench/mcgen random 400 $seed > $tmp/p.mc
+  for o in -O0 -O1; do
+    ./microc $o -o $tmp/serial.asm $tmp/p.mc
+    ./microc $o -j $jobs -o $tmp/parallel.asm $tmp/p.mc
+    same $tmp/serial.asm $tmp/parallel.asm "$o -j $jobs .asm"
+    ./microc $o -c -o $tmp/serial.o $tmp/p.mc
+    ./microc $o -c -j $jobs -o $tmp/parallel.o $tmp/p.mc
+    same $tmp/serial.o $tmp/parallel.o "$o -j $jobs .o"
+
+    # Build, edit the first function, and rebuild from the sidecar
+    rm -f $tmp/p.mci
+    ./microc $o --incremental -o $tmp/incremental.asm $tmp/p.mc
+    sed -i '0,/x = a;/s//x = a + 1;/' $tmp/p.mc
+    ./microc $o --incremental -o $tmp/incremental.asm $tmp/p.mc
+    ./microc $o -o $tmp/whole.asm $tmp/p.mc
+    same $tmp/whole.asm $tmp/incremental.asm "$o --incremental"
+    bench/mcgen random 400 $seed > $tmp/p.mc
+  done
+done
+
+if [ $failures -gt 0 ]; then
+  echo "$failures failures"
+  exit 1
+fi
+echo "$seeds programs: parallel and incremental output identical"
@@ -0,0 +1,210 @@
+#include "threadpool.h"
+
+// Index of the pool worker running on this thread, -1 elsewhere
+static thread_local int t_worker = -1;
+static thread_local ThreadPool* t_pool = NULL;
+
+ThreadPool::Group::Group() : pending(0)
+{
+
+}
+
+ThreadPool::ThreadPool(int nthreads) : steals(0), m_queued(0), m_pending(0), m_stop(false), m_next(0)
+{
+  if (nthreads < 1)
+    nthreads = 1;
+
+  for (int i = 0; i < nthreads; i++)
+    m_queues.push_back(new Queue);
+  for (int i = 0; i < nthreads; i++)
+    m_threads.push_back(std::thread(&ThreadPool::worker, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (m_pending > 0)
+      m_idle.wait(guard);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+
+  for (size_t i = 0; i < m_threads.size(); i++)
+    m_threads[i].join();
+  for (size_t i = 0; i < m_queues.size(); i++)
+    delete m_queues[i];
+}
+
+int ThreadPool::size()
+{
+  return m_queues.size();
+}
+
+int ThreadPool::defaultThreads()
+{
+  int n = std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+void ThreadPool::submit(const Task& task, Group* group)
+{
+  size_t q;
+
+  if (group)
+    {
+      group->pending++;
+      Task inner = task;
+      return submit([inner, group, this]() {
+	  std::exception_ptr error;
+	  try
+	    {
+	      inner();
+	    }
+	  catch (...)
+	    {
+	      error = std::current_exception();
+	    }
+	  std::lock_guard<std::mutex> guard(m_lock);
+	  if (error && !group->error)
+	    group->error = error;
+	  group->pending--;
+	  m_idle.notify_all();
+	});
+    }
+
+  if (t_pool == this)
+    q = t_worker;
+  else
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      q = m_next++ % m_queues.size();
+    }
+
+  {
+    std::lock_guard<std::mutex> guard(m_queues[q]->lock);
+    m_queues[q]->tasks.push_back(task);
+    std::lock_guard<std::mutex> counts(m_lock);
+    m_queued++;
+    m_pending++;
+  }
+  m_wake.notify_one();
+  m_idle.notify_all();   // A worker waiting for a group may run it
+}
+
+/*
+  Pops the newest task of worker id's own deque, or steals the oldest
+  task of another worker, starting with its right-hand neighbour.  The
+  deque and m_queued change together, so a worker that finds nothing
+  goes back to waiting on m_queued instead of spinning on a task that
+  someone else has already taken.
+*/
+bool ThreadPool::take(int id, Task& task)
+{
+  int n = m_queues.size();
+
+  for (int k = 0; k < n; k++)
+    {
+      Queue* q = m_queues[(id + k) % n];
+      std::lock_guard<std::mutex> guard(q->lock);
+
+      if (q->tasks.empty())
+	continue;
+      if (k == 0)
+	{
+	  task = q->tasks.back();
+	  q->tasks.pop_back();
+	}
+      else
+	{
+	  task = q->tasks.front();
+	  q->tasks.pop_front();
+	  steals++;
+	}
+      std::lock_guard<std::mutex> counts(m_lock);
+      m_queued--;
+      return true;
+    }
+
+  return false;
+}
+
+void ThreadPool::worker(int id)
+{
+  t_worker = id;
+  t_pool = this;
+
+  for (;;)
+    {
+      {
+	std::unique_lock<std::mutex> guard(m_lock);
+	while (m_queued == 0 && !m_stop)
+	  m_wake.wait(guard);
+	if (m_queued == 0)
+	  return;
+      }
+
+      Task task;
+      if (take(id, task))
+	execute(task);
+    }
+}
+
+// Runs a task that take() returned and does the bookkeeping
+void ThreadPool::execute(Task& task)
+{
+  std::exception_ptr error;
+  try
+    {
+      task();
+    }
+  catch (...)
+    {
+      error = std::current_exception();
+    }
+
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (error && !m_error)
+    m_error = error;
+  if (--m_pending == 0)
+    m_idle.notify_all();
+}
+
+void ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> guard(m_lock);
+  while (m_pending > 0)
+    m_idle.wait(guard);
+
+  std::exception_ptr error = m_error;
+  m_error = std::exception_ptr();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+/*
+  On a worker of this pool, helps with queued tasks (its own deque first)
+  until the group is done; elsewhere just blocks
+*/
+void ThreadPool::wait(Group& group)
+{
+  while (group.pending > 0)
+    {
+      Task task;
+      if (t_pool == this && take(t_worker, task))
+	{
+	  execute(task);
+	  continue;
+	}
+
+      std::unique_lock<std::mutex> guard(m_lock);
+      while (group.pending > 0 && (t_pool != this || m_queued == 0))
+	m_idle.wait(guard);
+    }
+
+  std::lock_guard<std::mutex> guard(m_lock);
+  std::exception_ptr error = group.error;
+  group.error = std::exception_ptr();
+  if (error)
+    std::rethrow_exception(error);
+}
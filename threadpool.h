@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task deque each.  A worker runs
+// tasks from the back of its own deque and, when that is empty, steals
+// from the front of the others'.  Tasks submitted from outside the pool
+// are dealt out round robin; a task submitted by a running task goes to
+// its own worker's deque.
+//
+// A Group tracks a subset of the tasks.  A worker that waits for a group
+// keeps running queued tasks meanwhile, so a task can fan out into more
+// tasks and wait for them without tying up its thread.
+//
+// A task that throws still counts as finished; the first exception of a
+// group is rethrown by wait(group), that of any other task by wait().
+class ThreadPool
+{
+public:
+  typedef std::function<void()> Task;
+
+  class Group
+  {
+  public:
+    Group();
+    std::atomic<int> pending;
+    std::exception_ptr error;    // The first task's exception, under m_lock
+  };
+
+  ThreadPool(int nthreads);
+  ~ThreadPool();
+
+  void submit(const Task& task, Group* group = NULL);
+  void wait();                // Until every submitted task has finished
+  void wait(Group& group);    // Until the group's tasks have finished
+  int size();
+
+  static int defaultThreads();
+
+  std::atomic<int> steals;   // Tasks taken from another worker's deque
+
+private:
+  class Queue
+  {
+  public:
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  void worker(int id);
+  bool take(int id, Task& task);
+  void execute(Task& task);
+
+  std::vector<Queue*> m_queues;
+  std::vector<std::thread> m_threads;
+  std::mutex m_lock;             // Guards the counts below and m_stop
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+  int m_queued;                  // In a deque; changes with the deque's lock held
+  int m_pending;                 // Submitted, not yet finished
+  bool m_stop;
+  std::exception_ptr m_error;    // Thrown by a task outside a group
+  size_t m_next;                 // Round robin position for outside submits
+};
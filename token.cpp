@@ -1,4 +1,5 @@
 #include "token.h"
+#include "stats.h"
 
 Token::Token()
 {
@@ -37,3 +38,15 @@ int Token::pos()
 {
   return m_pos;
 }
+
+void* Token::operator new(size_t size)
+{
+  MEM_ALLOC(TOKENS, size);
+  return ::operator new(size);
+}
+
+void Token::operator delete(void* p)
+{
+  MEM_FREE(TOKENS, sizeof(Token));
+  ::operator delete(p);
+}
@@ -46,6 +46,10 @@ public:
   static const int ENDOFFILE = 29;
   static const int ERROR = 30;
   static const int PRINTF = 31;
+
+  // Counted for --mem-stats
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
   
 private:
   int m_ttype;
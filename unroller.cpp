@@ -0,0 +1,479 @@
+#include "unroller.h"
+#include "stats.h"
+
+// Upper bound on the number of tree nodes a single unrolled loop may grow to
+static const int MAXUNROLLNODES = 4096;
+// Loops that do not terminate within this many iterations are left alone
+static const long long MAXTRIPS = 1 << 20;
+
+Unroller::Unroller(int factor, int fullTrips) : m_factor(factor), m_fullTrips(fullTrips),
+						 m_lindex(0), m_full(0), m_partial(0)
+{
+
+}
+
+Unroller::~Unroller()
+{
+
+}
+
+int Unroller::fullyUnrolled()
+{
+  return m_full;
+}
+
+int Unroller::partiallyUnrolled()
+{
+  return m_partial;
+}
+
+std::string Unroller::makeLabel()
+{
+  return "U" + std::to_string(static_cast<long long>(++m_lindex));
+}
+
+/*
+  Evaluate a binary operation the way the generated code would at run
+  time: wrapping arithmetic and signed division truncating toward zero,
+  as idiv does after cqo.  Division by zero and the one quotient that
+  overflows are left to trap at run time.
+*/
+bool Unroller::foldBinary(int op, long long a, long long b, long long& result)
+{
+  unsigned long long ua = a, ub = b;
+
+  switch (op)
+    {
+    case Parser::ADD: result = (long long)(ua + ub); return true;
+    case Parser::SUB: result = (long long)(ua - ub); return true;
+    case Parser::MULT: result = (long long)(ua * ub); return true;
+    case Parser::DIV:
+      if (b == 0 || (b == -1 && a == (long long)(1ULL << 63)))
+	return false;
+      result = a / b;
+      return true;
+    case Parser::ISEQ: result = a == b; return true;
+    case Parser::ISNE: result = a != b; return true;
+    case Parser::ISLT: result = a < b; return true;
+    case Parser::ISLE: result = a <= b; return true;
+    case Parser::ISGT: result = a > b; return true;
+    case Parser::ISGE: result = a >= b; return true;
+    case Parser::AND: result = a & b; return true;
+    case Parser::OR: result = a | b; return true;
+    default:
+      return false;
+    }
+}
+
+void Unroller::run(Parser::TreeNode* node)
+{
+  STAT_TIMER(OPTIMIZE);
+  visit(node);
+}
+
+/*
+  Post-order walk so inner loops are unrolled before the loops around them
+*/
+void Unroller::visit(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return;
+
+  visit(node->leftChild);
+  visit(node->rightChild);
+
+  Loop loop;
+  if (node->op != Parser::SEQ || !matchWhile(node->rightChild, loop))
+    return;
+
+  if (!matchInit(node->leftChild, loop) || !matchCondition(loop) ||
+      !matchStep(loop) || !tripCount(loop))
+    return;
+
+  int bodySize = size(loop.body);
+
+  if (loop.trips <= m_fullTrips && loop.trips * bodySize <= MAXUNROLLNODES)
+    {
+      node->rightChild = fullUnroll(loop, loop.trips, true);
+      m_full++;
+    }
+
+  else if (m_factor > 1 && loop.trips >= m_factor && m_factor * bodySize <= MAXUNROLLNODES)
+    {
+      // Peel the remainder so the unrolled loop keeps a single exit test
+      Parser::TreeNode* peeled = fullUnroll(loop, loop.trips % m_factor, true);
+      Parser::TreeNode* whileNode = node->rightChild;
+      Parser::TreeNode* bodySeq = whileNode->leftChild->leftChild;
+      Parser::TreeNode* copies = loop.body;
+
+      for (int i = 1; i < m_factor; i++)
+	{
+	  Parser::TreeNode* copy = clone(loop.body);
+	  relabel(copy);
+	  copies = seq(copies, copy);
+	}
+
+      bodySeq->rightChild = copies;
+      node->rightChild = seq(peeled, whileNode);
+      m_partial++;
+    }
+}
+
+/*
+  whileStatement() builds
+    SEQ(SEQ(SEQ(SEQ(SEQ(LABEL a:, cond), JUMPF b), body), JUMP a), LABEL b:)
+*/
+bool Unroller::matchWhile(Parser::TreeNode* node, Loop& loop)
+{
+  if (node == NULL || node->op != Parser::SEQ)
+    return false;
+
+  Parser::TreeNode* exitLabel = node->rightChild;
+  Parser::TreeNode* a = node->leftChild;
+  if (exitLabel == NULL || exitLabel->op != Parser::LABEL || a == NULL || a->op != Parser::SEQ)
+    return false;
+
+  Parser::TreeNode* backJump = a->rightChild;
+  Parser::TreeNode* b = a->leftChild;
+  if (backJump == NULL || backJump->op != Parser::JUMP || b == NULL || b->op != Parser::SEQ)
+    return false;
+
+  Parser::TreeNode* c = b->leftChild;
+  if (c == NULL || c->op != Parser::SEQ || c->rightChild == NULL || c->rightChild->op != Parser::JUMPF)
+    return false;
+
+  Parser::TreeNode* d = c->leftChild;
+  if (d == NULL || d->op != Parser::SEQ || d->leftChild == NULL || d->leftChild->op != Parser::LABEL)
+    return false;
+
+  if (d->leftChild->val != backJump->val + ":" || exitLabel->val != c->rightChild->val + ":")
+    return false;
+
+  loop.cond = d->rightChild;
+  loop.body = b->rightChild;
+  return loop.cond != NULL && loop.body != NULL;
+}
+
+/*
+  The statement before the loop must be "v = constant;"
+*/
+bool Unroller::matchInit(Parser::TreeNode* prev, Loop& loop)
+{
+  if (prev == NULL || prev->op != Parser::SEQ)
+    return false;
+
+  Parser::TreeNode* init = prev;
+  if (init->rightChild == NULL || init->rightChild->op != Parser::STORE)
+    init = prev->rightChild;
+
+  if (init == NULL || init->op != Parser::SEQ || init->leftChild == NULL || init->rightChild == NULL ||
+      init->leftChild->op != Parser::LOADL || init->rightChild->op != Parser::STORE)
+    return false;
+
+  loop.var = init->rightChild->val;
+  loop.start = init->leftChild->literal();
+  return true;
+}
+
+/*
+  The condition must compare the induction variable with a constant
+*/
+bool Unroller::matchCondition(Loop& loop)
+{
+  Parser::TreeNode* cond = loop.cond;
+  if (cond->op < Parser::ISEQ || cond->op > Parser::ISGE)
+    return false;
+
+  Parser::TreeNode* l = cond->leftChild;
+  Parser::TreeNode* r = cond->rightChild;
+
+  if (l->op == Parser::LOADV && l->val == loop.var && r->op == Parser::LOADL)
+    {
+      loop.rel = cond->op;
+      loop.bound = r->literal();
+      return true;
+    }
+
+  if (r->op == Parser::LOADV && r->val == loop.var && l->op == Parser::LOADL)
+    {
+      switch (cond->op)
+	{
+	case Parser::ISLT: loop.rel = Parser::ISGT; break;
+	case Parser::ISLE: loop.rel = Parser::ISGE; break;
+	case Parser::ISGT: loop.rel = Parser::ISLT; break;
+	case Parser::ISGE: loop.rel = Parser::ISLE; break;
+	default: loop.rel = cond->op; break;
+	}
+      loop.bound = l->literal();
+      return true;
+    }
+
+  return false;
+}
+
+/*
+  The body must contain exactly one "v = v + constant;" (or "v - constant")
+  that runs on every iteration, i.e. is not inside any jump/label range
+*/
+bool Unroller::matchStep(Loop& loop)
+{
+  std::vector<Parser::TreeNode*> code;
+  linearize(loop.body, code);
+
+  int store = -1;
+  for (size_t i = 0; i < code.size(); i++)
+    {
+      if (code[i]->op == Parser::STORE && code[i]->val == loop.var)
+	{
+	  if (store >= 0)
+	    return false;
+	  store = i;
+	}
+    }
+
+  if (store < 0)
+    return false;
+
+  for (size_t i = 0; i < code.size(); i++)
+    {
+      int op = code[i]->op;
+      if (op != Parser::JUMP && op != Parser::JUMPF && op != Parser::JUMPT)
+	continue;
+
+      int target = -1;
+      for (size_t j = 0; j < code.size(); j++)
+	if (code[j]->op == Parser::LABEL && code[j]->val == code[i]->val + ":")
+	  target = j;
+
+      if (target < 0)
+	return false;
+
+      int lo = std::min((int)i, target);
+      int hi = std::max((int)i, target);
+      if (lo < store && store < hi)
+	return false;
+    }
+
+  Parser::TreeNode* assign = parentOf(loop.body, code[store]);
+  if (assign == NULL || assign->rightChild != code[store])
+    return false;
+
+  Parser::TreeNode* e = assign->leftChild;
+  if (e == NULL || (e->op != Parser::ADD && e->op != Parser::SUB))
+    return false;
+
+  Parser::TreeNode* l = e->leftChild;
+  Parser::TreeNode* r = e->rightChild;
+
+  if (l->op == Parser::LOADV && l->val == loop.var && r->op == Parser::LOADL)
+    loop.step = (e->op == Parser::ADD) ? r->literal() : (long long)(0ULL - r->literal());
+  else if (e->op == Parser::ADD && r->op == Parser::LOADV && r->val == loop.var && l->op == Parser::LOADL)
+    loop.step = l->literal();
+  else
+    return false;
+
+  return loop.step != 0;
+}
+
+/*
+  Runs the loop's condition and step at compile time.  The variable wraps
+  past the ends of its range as it would at run time; MAXTRIPS bounds the
+  count either way.
+*/
+bool Unroller::tripCount(Loop& loop)
+{
+  long long value = loop.start;
+  long long holds;
+
+  loop.trips = 0;
+  while (foldBinary(loop.rel, value, loop.bound, holds) && holds)
+    {
+      if (++loop.trips > MAXTRIPS)
+	return false;
+      foldBinary(Parser::ADD, value, loop.step, value);
+    }
+
+  return true;
+}
+
+/*
+  Straight-line copies of the body, each with the induction variable folded
+  in.  Only the last copy keeps its store so the variable has the right value
+  after the loop.
+*/
+Parser::TreeNode* Unroller::fullUnroll(Loop& loop, long long copies, bool keepLastStore)
+{
+  Parser::TreeNode* node = NULL;
+
+  for (long long i = 0; i < copies; i++)
+    {
+      long long value;
+      foldBinary(Parser::MULT, i, loop.step, value);
+      foldBinary(Parser::ADD, loop.start, value, value);
+      Parser::TreeNode* copy = foldedCopy(loop, value, keepLastStore && i == copies - 1);
+      node = seq(node, copy);
+    }
+
+  if (node == NULL)
+    node = new Parser::TreeNode(Parser::SEQ);
+
+  return node;
+}
+
+Parser::TreeNode* Unroller::foldedCopy(Loop& loop, long long value, bool keepStore)
+{
+  Parser::TreeNode* copy = clone(loop.body);
+  relabel(copy);
+  propagate(copy, loop, value, keepStore);
+  fold(copy);
+  return copy;
+}
+
+Parser::TreeNode* Unroller::clone(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return NULL;
+
+  Parser::TreeNode* copy = new Parser::TreeNode(*node);
+  copy->leftChild = clone(node->leftChild);
+  copy->rightChild = clone(node->rightChild);
+  return copy;
+}
+
+/*
+  Give every label defined in a copied body a fresh name
+*/
+void Unroller::relabel(Parser::TreeNode* node)
+{
+  std::vector<Parser::TreeNode*> code;
+  std::map<std::string, std::string> names;
+  linearize(node, code);
+
+  for (size_t i = 0; i < code.size(); i++)
+    {
+      if (code[i]->op == Parser::LABEL)
+	{
+	  std::string name = code[i]->val.substr(0, code[i]->val.size() - 1);
+	  names[name] = makeLabel();
+	  code[i]->val = names[name] + ":";
+	}
+    }
+
+  for (size_t i = 0; i < code.size(); i++)
+    {
+      int op = code[i]->op;
+      if ((op == Parser::JUMP || op == Parser::JUMPF || op == Parser::JUMPT) && names.count(code[i]->val))
+	code[i]->val = names[code[i]->val];
+    }
+}
+
+/*
+  Replace loads of the induction variable with its value, which changes once
+  the step statement has executed
+*/
+void Unroller::propagate(Parser::TreeNode* node, Loop& loop, long long& value, bool keepStore)
+{
+  if (node == NULL)
+    return;
+
+  Parser::TreeNode* r = node->rightChild;
+  if (node->op == Parser::SEQ && r != NULL && r->op == Parser::STORE && r->val == loop.var)
+    {
+      propagate(node->leftChild, loop, value, keepStore);
+      foldBinary(Parser::ADD, value, loop.step, value);
+
+      if (keepStore)
+	{
+	  node->leftChild = new Parser::TreeNode(Parser::LOADL, std::to_string(value));
+	}
+      else
+	{
+	  node->leftChild = NULL;
+	  node->rightChild = NULL;
+	}
+      return;
+    }
+
+  propagate(node->leftChild, loop, value, keepStore);
+  propagate(node->rightChild, loop, value, keepStore);
+
+  if (node->op == Parser::LOADV && node->val == loop.var)
+    {
+      node->op = Parser::LOADL;
+      node->val = std::to_string(value);
+    }
+}
+
+/*
+  Constant folding, plus conditional branches whose condition became constant
+*/
+void Unroller::fold(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return;
+
+  fold(node->leftChild);
+  fold(node->rightChild);
+
+  Parser::TreeNode* l = node->leftChild;
+  Parser::TreeNode* r = node->rightChild;
+  if (l == NULL || r == NULL || l->op != Parser::LOADL)
+    return;
+
+  long long result;
+  if (node->op == Parser::SEQ && r->op == Parser::JUMPF)
+    {
+      if (l->literal() == 0)
+	node->init(Parser::JUMP, r->val, NULL, NULL);
+      else
+	node->init(Parser::SEQ, "", NULL, NULL);
+    }
+
+  else if (r->op == Parser::LOADL && node->op != Parser::SEQ &&
+	   foldBinary(node->op, l->literal(), r->literal(), result))
+    {
+      node->init(Parser::LOADL, std::to_string(result), NULL, NULL);
+    }
+}
+
+/*
+  The instruction order geninst emits: every non-SEQ node in post-order
+*/
+void Unroller::linearize(Parser::TreeNode* node, std::vector<Parser::TreeNode*>& out)
+{
+  if (node == NULL)
+    return;
+
+  linearize(node->leftChild, out);
+  linearize(node->rightChild, out);
+  if (node->op != Parser::SEQ)
+    out.push_back(node);
+}
+
+Parser::TreeNode* Unroller::parentOf(Parser::TreeNode* root, Parser::TreeNode* child)
+{
+  if (root == NULL)
+    return NULL;
+
+  if (root->leftChild == child || root->rightChild == child)
+    return root;
+
+  Parser::TreeNode* parent = parentOf(root->leftChild, child);
+  return parent ? parent : parentOf(root->rightChild, child);
+}
+
+Parser::TreeNode* Unroller::seq(Parser::TreeNode* left, Parser::TreeNode* right)
+{
+  if (left == NULL)
+    return right;
+
+  return new Parser::TreeNode(Parser::SEQ, left, right);
+}
+
+int Unroller::size(Parser::TreeNode* node)
+{
+  if (node == NULL)
+    return 0;
+
+  return 1 + size(node->leftChild) + size(node->rightChild);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "parser.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Unrolls whileStatement() trees whose induction variable has a constant
+// start value, a constant bound and a constant step.  Small trip counts are
+// unrolled completely and the induction variable is folded into each copy,
+// larger ones are unrolled by a fixed factor after peeling the remainder.
+class Unroller
+{
+public:
+  Unroller(int factor, int fullTrips);
+  ~Unroller();
+
+  void run(Parser::TreeNode* node);
+
+  int fullyUnrolled();
+  int partiallyUnrolled();
+
+  static bool foldBinary(int op, long long a, long long b, long long& result);
+
+private:
+  struct Loop {
+    Parser::TreeNode* cond;
+    Parser::TreeNode* body;
+    std::string var;
+    int rel;
+    long long start;
+    long long bound;
+    long long step;
+    long long trips;
+  };
+
+  void visit(Parser::TreeNode* node);
+  bool matchWhile(Parser::TreeNode* node, Loop& loop);
+  bool matchInit(Parser::TreeNode* prev, Loop& loop);
+  bool matchCondition(Loop& loop);
+  bool matchStep(Loop& loop);
+  bool tripCount(Loop& loop);
+
+  Parser::TreeNode* fullUnroll(Loop& loop, long long copies, bool keepLastStore);
+  Parser::TreeNode* foldedCopy(Loop& loop, long long value, bool keepStore);
+  Parser::TreeNode* clone(Parser::TreeNode* node);
+  void relabel(Parser::TreeNode* node);
+  void propagate(Parser::TreeNode* node, Loop& loop, long long& value, bool keepStore);
+  void fold(Parser::TreeNode* node);
+
+  static void linearize(Parser::TreeNode* node, std::vector<Parser::TreeNode*>& out);
+  static Parser::TreeNode* parentOf(Parser::TreeNode* root, Parser::TreeNode* child);
+  static Parser::TreeNode* seq(Parser::TreeNode* left, Parser::TreeNode* right);
+  static int size(Parser::TreeNode* node);
+
+  std::string makeLabel();
+
+  int m_factor;
+  int m_fullTrips;
+  int m_lindex;
+  int m_full;
+  int m_partial;
+};
@@ -0,0 +1,288 @@
+#include "vm.h"
+#include "compileerror.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+// Handlers.  The first block matches Bytecode::Op; JCMP and JCMPVL are
+// replaced by one handler per relation.
+enum {
+  I_HALT, I_ENTER, I_PARAM, I_LOADV, I_LOADL, I_STORE,
+  I_ADD, I_SUB, I_MULT, I_DIV, I_AND, I_OR,
+  I_ISEQ, I_ISNE, I_ISLT, I_ISLE, I_ISGT, I_ISGE,
+  I_JUMP, I_JUMPF, I_JUMPT, I_CALL, I_RET, I_PRINTF,
+  I_LOADVV, I_ADDVL, I_ADDVLS, I_STOREL, I_MOVV,
+  I_JCMPEQ, I_JCMPNE, I_JCMPLT, I_JCMPLE, I_JCMPGT, I_JCMPGE,
+  I_JCMPVLEQ, I_JCMPVLNE, I_JCMPVLLT, I_JCMPVLLE, I_JCMPVLGT, I_JCMPVLGE,
+  I_COUNT
+};
+
+// Words kept free below a new frame for its expression temporaries
+static const long STACKMARGIN = 4096;
+
+static void fatal(const char* message)
+{
+  fflush(stdout);
+  throw CompileError(std::string("vm: ") + message);
+}
+
+VM::VM(Bytecode& bcx, size_t stackWords) : bc(bcx), m_stack(stackWords)
+{
+
+}
+
+VM::~VM()
+{
+
+}
+
+/*
+  Decodes the byte stream into cells.  Targets become cell indices; the
+  relation operand of JCMP and JCMPVL is folded into the handler.
+*/
+void VM::load(const void* const* handlers)
+{
+  const unsigned char* start = bc.code.data();
+  const unsigned char* p = start;
+  const unsigned char* end = p + bc.code.size();
+  std::vector<int> cellOf(bc.code.size() + 1, -1);
+  std::vector<size_t> targets;
+  Cell cell;
+
+  m_code.clear();
+  while (p < end)
+    {
+      int op = *p++;
+      const char* kinds = Bytecode::operands(op);
+      int k = 0;
+      int iop = op;
+
+      cellOf[p - 1 - start] = m_code.size();
+      if (op == Bytecode::JCMP || op == Bytecode::JCMPVL)
+	{
+	  iop = (op == Bytecode::JCMP ? I_JCMPEQ : I_JCMPVLEQ) + Bytecode::readVarint(p);
+	  k = 1;
+	}
+
+      if (handlers)
+	cell.handler = handlers[iop];
+      else
+	cell.value = iop;
+      m_code.push_back(cell);
+
+      for (; kinds[k]; k++)
+	{
+	  if (kinds[k] == 'v')
+	    cell.value = Bytecode::readVarint(p);
+	  else
+	    {
+	      targets.push_back(m_code.size());
+	      cell.value = Bytecode::readTarget(p);
+	    }
+	  m_code.push_back(cell);
+	}
+    }
+
+  for (size_t i = 0; i < targets.size(); i++)
+    m_code[targets[i]].value = cellOf[m_code[targets[i]].value];
+}
+
+#if VM_THREADED
+#define CASE(op) op_##op
+#define DISPATCH() goto *(ip++)->handler
+#else
+#define CASE(op) case I_##op
+#define DISPATCH() continue
+#endif
+
+// Addition, subtraction and multiplication wrap as in native code; signed
+// overflow would be undefined in C++
+#define WRAP(a, op, b) ((long long)((unsigned long long)(a) op (unsigned long long)(b)))
+
+#define BINARY(op, expr)				\
+  CASE(op): { long long b = *sp++; *sp = (expr); } DISPATCH()
+
+#define JCMP(rel, cmp)						\
+  CASE(JCMP##rel): {						\
+    long long b = *sp++;					\
+    long long a = *sp++;					\
+    ip = (a cmp b) ? ip + 1 : code + ip->value;			\
+  } DISPATCH();							\
+  CASE(JCMPVL##rel):						\
+  ip = (fp[-ip[0].value] cmp ip[1].value) ? ip + 3 : code + ip[2].value; \
+  DISPATCH()
+
+/*
+  Calls main through the stub at offset 0 and returns its result.  The
+  stack grows down; sp points at the top value and fp at the saved fp of
+  the current frame, with the return address, argument byte count and
+  arguments above it and the locals below.
+*/
+long long VM::run()
+{
+#if VM_THREADED
+  static const void* const handlers[I_COUNT] = {
+    &&op_HALT, &&op_ENTER, &&op_PARAM, &&op_LOADV, &&op_LOADL, &&op_STORE,
+    &&op_ADD, &&op_SUB, &&op_MULT, &&op_DIV, &&op_AND, &&op_OR,
+    &&op_ISEQ, &&op_ISNE, &&op_ISLT, &&op_ISLE, &&op_ISGT, &&op_ISGE,
+    &&op_JUMP, &&op_JUMPF, &&op_JUMPT, &&op_CALL, &&op_RET, &&op_PRINTF,
+    &&op_LOADVV, &&op_ADDVL, &&op_ADDVLS, &&op_STOREL, &&op_MOVV,
+    &&op_JCMPEQ, &&op_JCMPNE, &&op_JCMPLT, &&op_JCMPLE, &&op_JCMPGT, &&op_JCMPGE,
+    &&op_JCMPVLEQ, &&op_JCMPVLNE, &&op_JCMPVLLT, &&op_JCMPVLLE, &&op_JCMPVLGT, &&op_JCMPVLGE
+  };
+  if (m_code.empty())
+    load(handlers);
+#else
+  if (m_code.empty())
+    load(NULL);
+#endif
+
+  Cell* code = m_code.data();
+  Cell* ip = code;
+  long long* stack = m_stack.data();
+  long long* sp = stack + m_stack.size();
+  long long* fp = sp;
+
+#if VM_THREADED
+  DISPATCH();
+#else
+  for (;;)
+    switch ((ip++)->value)
+      {
+#endif
+
+  CASE(HALT):
+    fflush(stdout);
+    return *sp;
+
+  CASE(ENTER):
+    *--sp = fp - stack;
+    fp = sp;
+    sp -= ip->value;
+    if (sp - stack < STACKMARGIN)
+      fatal("stack overflow");
+    ip++;
+    DISPATCH();
+
+  CASE(PARAM):
+    fp[-ip[1].value] = fp[ip[0].value];
+    ip += 2;
+    DISPATCH();
+
+  CASE(LOADV):
+    *--sp = fp[-(ip++)->value];
+    DISPATCH();
+
+  CASE(LOADL):
+    *--sp = (ip++)->value;
+    DISPATCH();
+
+  CASE(STORE):
+    fp[-(ip++)->value] = *sp++;
+    DISPATCH();
+
+  BINARY(ADD, WRAP(*sp, +, b));
+  BINARY(SUB, WRAP(*sp, -, b));
+  BINARY(MULT, WRAP(*sp, *, b));
+  BINARY(AND, *sp & b);
+  BINARY(OR, *sp | b);
+  BINARY(ISEQ, *sp == b);
+  BINARY(ISNE, *sp != b);
+  BINARY(ISLT, *sp < b);
+  BINARY(ISLE, *sp <= b);
+  BINARY(ISGT, *sp > b);
+  BINARY(ISGE, *sp >= b);
+
+  CASE(DIV):
+    if (*sp == 0)
+      fatal("division by zero");
+    sp[1] /= sp[0];
+    sp++;
+    DISPATCH();
+
+  CASE(JUMP):
+    ip = code + ip->value;
+    DISPATCH();
+
+  CASE(JUMPF):
+    ip = *sp++ == 0 ? code + ip->value : ip + 1;
+    DISPATCH();
+
+  CASE(JUMPT):
+    ip = *sp++ != 0 ? code + ip->value : ip + 1;
+    DISPATCH();
+
+  CASE(CALL):
+    *--sp = ip + 1 - code;
+    ip = code + ip->value;
+    DISPATCH();
+
+  CASE(RET):
+    {
+      long long result = *sp;
+      sp = fp;
+      fp = stack + *sp++;
+      ip = code + *sp++;
+      sp += *sp / 8 + 1;
+      *--sp = result;
+    }
+    DISPATCH();
+
+  CASE(PRINTF):
+    {
+      long long a[Bytecode::MAXPRINTFARGS] = { 0 };
+      for (long long i = ip[1].value; i > 0; i--)
+	a[i - 1] = *sp++;
+      printf(bc.strings[ip[0].value].c_str(), a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+	     a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+      ip += 2;
+    }
+    DISPATCH();
+
+  CASE(LOADVV):
+    sp -= 2;
+    sp[1] = fp[-ip[0].value];
+    sp[0] = fp[-ip[1].value];
+    ip += 2;
+    DISPATCH();
+
+  CASE(ADDVL):
+    *--sp = WRAP(fp[-ip[0].value], +, ip[1].value);
+    ip += 2;
+    DISPATCH();
+
+  CASE(ADDVLS):
+    fp[-ip[2].value] = WRAP(fp[-ip[0].value], +, ip[1].value);
+    ip += 3;
+    DISPATCH();
+
+  CASE(STOREL):
+    fp[-ip[1].value] = ip[0].value;
+    ip += 2;
+    DISPATCH();
+
+  CASE(MOVV):
+    fp[-ip[1].value] = fp[-ip[0].value];
+    ip += 2;
+    DISPATCH();
+
+  JCMP(EQ, ==);
+  JCMP(NE, !=);
+  JCMP(LT, <);
+  JCMP(LE, <=);
+  JCMP(GT, >);
+  JCMP(GE, >=);
+
+#if !VM_THREADED
+      default:
+	fatal("bad opcode");
+      }
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "bytecode.h"
+
+#include <vector>
+
+// Interpreter for Bytecode.  Before the first run the byte stream is
+// decoded into threaded code, one cell per opcode or operand, so dispatch
+// is a single indirect jump through the handler address stored in the cell
+// (computed goto).  Compilers without labels-as-values fall back to a
+// switch.  JCMP and JCMPVL are specialised per relation while loading.
+// The operand stack is allocated once, up front.
+class VM
+{
+public:
+  VM(Bytecode& bcx, size_t stackWords = 1 << 20);
+  ~VM();
+
+  long long run();
+
+private:
+  union Cell
+  {
+    const void* handler;
+    long long value;
+  };
+
+  void load(const void* const* handlers);
+
+  Bytecode& bc;
+  std::vector<Cell> m_code;
+  std::vector<long long> m_stack;
+};
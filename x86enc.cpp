@@ -0,0 +1,447 @@
+#include "x86enc.h"
+#include "compileerror.h"
+
+#include <cstdlib>
+#include <iostream>
+
+// Hardware condition codes for MInstr::Cond
+static const int CONDCODES[] = { 0x4, 0x5, 0xC, 0xD, 0xE, 0xF };
+
+static bool fits8(long long v)
+{
+  return v >= -128 && v <= 127;
+}
+
+static bool fits32(long long v)
+{
+  return v >= -2147483647LL - 1 && v <= 2147483647LL;
+}
+
+static bool isReg(const MOperand& o)
+{
+  return o.kind == MOperand::REG;
+}
+
+static bool isRM(const MOperand& o)
+{
+  return o.kind == MOperand::REG || o.kind == MOperand::MEM;
+}
+
+static void unsupported(MInstr& instr)
+{
+  throw CompileError("x86 encoder: unsupported operand combination for opcode "
+		     + std::to_string(static_cast<long long>(instr.op)));
+}
+
+X86Encoder::X86Encoder(MBuffer& mirx) : passes(0), mir(mirx), m_out(NULL)
+{
+
+}
+
+X86Encoder::~X86Encoder()
+{
+
+}
+
+void X86Encoder::imm8(long long v)
+{
+  m_out->push_back(static_cast<unsigned char>(v & 0xff));
+}
+
+void X86Encoder::imm32(long long v)
+{
+  for (int i = 0; i < 4; i++)
+    m_out->push_back(static_cast<unsigned char>((v >> (8 * i)) & 0xff));
+}
+
+long long X86Encoder::target(const MOperand& label)
+{
+  std::map<int, size_t>::iterator it = labels.find(label.value);
+  return it == labels.end() ? -1 : static_cast<long long>(it->second);
+}
+
+/*
+  A 32-bit pc-relative field.  Symbols defined in the buffer are resolved
+  here; anything else becomes a relocation.
+*/
+void X86Encoder::rel32(const MOperand& label, size_t pc, int type, bool final)
+{
+  if (!final)
+    {
+      imm32(0);
+      return;
+    }
+
+  long long t = target(label);
+  size_t field = m_out->size();
+
+  if (t >= 0)
+    imm32(t - static_cast<long long>(field + 4));
+  else
+    {
+      Reloc r;
+      r.offset = field;
+      r.symbol = label.value;
+      r.type = type;
+      r.addend = -4;
+      relocs.push_back(r);
+      imm32(0);
+    }
+}
+
+/*
+  REX prefix, opcode, ModRM, SIB and displacement.  reg is either a
+  register or the opcode extension digit.
+*/
+void X86Encoder::emitModRM(int w, const unsigned char* opcode, int oplen, int reg,
+			   const MOperand& rm, bool byteRegs)
+{
+  int rex = 0x40 | (w ? 8 : 0) | (((reg >> 3) & 1) << 2);
+  bool force = false;
+
+  if (rm.kind == MOperand::REG || rm.kind == MOperand::REG8)
+    {
+      rex |= (rm.base >> 3) & 1;
+      // spl, bpl, sil and dil only exist with a REX prefix
+      force = byteRegs && rm.kind == MOperand::REG8 && rm.base >= RSP && rm.base <= RDI;
+    }
+  else
+    {
+      if (rm.index != NOREG)
+	rex |= ((rm.index >> 3) & 1) << 1;
+      rex |= (rm.base >> 3) & 1;
+    }
+
+  if (rex != 0x40 || force)
+    m_out->push_back(rex);
+  for (int i = 0; i < oplen; i++)
+    m_out->push_back(opcode[i]);
+
+  if (rm.kind == MOperand::REG || rm.kind == MOperand::REG8)
+    {
+      m_out->push_back(0xC0 | ((reg & 7) << 3) | (rm.base & 7));
+      return;
+    }
+
+  int b = rm.base;
+  long long d = rm.value;
+  int mod = (d == 0 && (b & 7) != RBP) ? 0 : fits8(d) ? 1 : 2;
+
+  if (rm.index != NOREG || (b & 7) == RSP)
+    {
+      int idx = rm.index == NOREG ? RSP : rm.index;
+      int ss = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+      m_out->push_back((mod << 6) | ((reg & 7) << 3) | 4);
+      m_out->push_back((ss << 6) | ((idx & 7) << 3) | (b & 7));
+    }
+  else
+    m_out->push_back((mod << 6) | ((reg & 7) << 3) | (b & 7));
+
+  if (mod == 1)
+    imm8(d);
+  else if (mod == 2)
+    imm32(d);
+}
+
+void X86Encoder::encodeInstr(MInstr& instr, size_t pc, bool wide, bool final)
+{
+  MOperand& a = instr.ops[0];
+  MOperand& b = instr.ops[1];
+  unsigned char op[2];
+  int digit = 0;
+
+  switch (instr.op)
+    {
+    case MInstr::LABEL:
+    case MInstr::BLANK:
+    case MInstr::TEXT:
+      break;
+
+    case MInstr::MOV:
+      if (isReg(a) && isReg(b))
+	{
+	  op[0] = 0x89;
+	  emitModRM(1, op, 1, b.base, a, false);
+	}
+      else if (isReg(a) && b.kind == MOperand::IMM)
+	{
+	  if (b.value >= 0 && b.value <= 0xffffffffLL)
+	    {
+	      // mov r32,imm32 zero-extends into the full register
+	      if (a.base >= R8)
+		m_out->push_back(0x41);
+	      m_out->push_back(0xB8 + (a.base & 7));
+	      imm32(b.value);
+	    }
+	  else if (fits32(b.value))
+	    {
+	      op[0] = 0xC7;
+	      emitModRM(1, op, 1, 0, a, false);
+	      imm32(b.value);
+	    }
+	  else
+	    {
+	      m_out->push_back(0x48 | ((a.base >> 3) & 1));
+	      m_out->push_back(0xB8 + (a.base & 7));
+	      imm32(b.value);
+	      imm32(b.value >> 32);
+	    }
+	}
+      else if (isReg(a) && b.kind == MOperand::MEM)
+	{
+	  op[0] = 0x8B;
+	  emitModRM(1, op, 1, a.base, b, false);
+	}
+      else if (a.kind == MOperand::MEM && isReg(b))
+	{
+	  op[0] = 0x89;
+	  emitModRM(1, op, 1, b.base, a, false);
+	}
+      else if (a.kind == MOperand::MEM && b.kind == MOperand::IMM && fits32(b.value))
+	{
+	  op[0] = 0xC7;
+	  emitModRM(1, op, 1, 0, a, false);
+	  imm32(b.value);
+	}
+      else if (isReg(a) && b.kind == MOperand::LABEL)
+	{
+	  // Address of a symbol: lea reg,[rip+symbol]
+	  m_out->push_back(0x48 | (((a.base >> 3) & 1) << 2));
+	  m_out->push_back(0x8D);
+	  m_out->push_back(((a.base & 7) << 3) | 5);
+	  rel32(b, pc, PC32, final);
+	}
+      else
+	unsupported(instr);
+      break;
+
+    case MInstr::MOVZX:
+      op[0] = 0x0F;
+      op[1] = 0xB6;
+      emitModRM(1, op, 2, a.base, b, true);
+      break;
+
+    case MInstr::LEA:
+      op[0] = 0x8D;
+      emitModRM(1, op, 1, a.base, b, false);
+      break;
+
+    case MInstr::PUSH:
+      if (isReg(a))
+	{
+	  if (a.base >= R8)
+	    m_out->push_back(0x41);
+	  m_out->push_back(0x50 + (a.base & 7));
+	}
+      else if (a.kind == MOperand::IMM && fits8(a.value))
+	{
+	  m_out->push_back(0x6A);
+	  imm8(a.value);
+	}
+      else if (a.kind == MOperand::IMM && fits32(a.value))
+	{
+	  m_out->push_back(0x68);
+	  imm32(a.value);
+	}
+      else if (a.kind == MOperand::MEM)
+	{
+	  op[0] = 0xFF;
+	  emitModRM(0, op, 1, 6, a, false);
+	}
+      else
+	unsupported(instr);
+      break;
+
+    case MInstr::POP:
+      if (isReg(a))
+	{
+	  if (a.base >= R8)
+	    m_out->push_back(0x41);
+	  m_out->push_back(0x58 + (a.base & 7));
+	}
+      else if (a.kind == MOperand::MEM)
+	{
+	  op[0] = 0x8F;
+	  emitModRM(0, op, 1, 0, a, false);
+	}
+      else
+	unsupported(instr);
+      break;
+
+    case MInstr::ADD:
+    case MInstr::OR:
+    case MInstr::AND:
+    case MInstr::SUB:
+    case MInstr::CMP:
+      digit = instr.op == MInstr::ADD ? 0 : instr.op == MInstr::OR ? 1 :
+	instr.op == MInstr::AND ? 4 : instr.op == MInstr::SUB ? 5 : 7;
+      if (isRM(a) && isReg(b))
+	{
+	  op[0] = digit * 8 + 1;
+	  emitModRM(1, op, 1, b.base, a, false);
+	}
+      else if (isReg(a) && b.kind == MOperand::MEM)
+	{
+	  op[0] = digit * 8 + 3;
+	  emitModRM(1, op, 1, a.base, b, false);
+	}
+      else if (isRM(a) && b.kind == MOperand::IMM && fits8(b.value))
+	{
+	  op[0] = 0x83;
+	  emitModRM(1, op, 1, digit, a, false);
+	  imm8(b.value);
+	}
+      else if (isRM(a) && b.kind == MOperand::IMM && fits32(b.value))
+	{
+	  op[0] = 0x81;
+	  emitModRM(1, op, 1, digit, a, false);
+	  imm32(b.value);
+	}
+      else
+	unsupported(instr);
+      break;
+
+    case MInstr::IMUL:
+      if (instr.nops == 1)
+	{
+	  op[0] = 0xF7;
+	  emitModRM(1, op, 1, 5, a, false);
+	}
+      else if (instr.nops == 2 && isReg(a) && isRM(b))
+	{
+	  op[0] = 0x0F;
+	  op[1] = 0xAF;
+	  emitModRM(1, op, 2, a.base, b, false);
+	}
+      else if (instr.nops == 3 && isReg(a) && isRM(b) && fits32(instr.ops[2].value))
+	{
+	  bool small = fits8(instr.ops[2].value);
+	  op[0] = small ? 0x6B : 0x69;
+	  emitModRM(1, op, 1, a.base, b, false);
+	  if (small)
+	    imm8(instr.ops[2].value);
+	  else
+	    imm32(instr.ops[2].value);
+	}
+      else
+	unsupported(instr);
+      break;
+
+    case MInstr::IDIV:
+      op[0] = 0xF7;
+      emitModRM(1, op, 1, 7, a, false);
+      break;
+
+    case MInstr::CQO:
+      m_out->push_back(0x48);
+      m_out->push_back(0x99);
+      break;
+
+    case MInstr::INC:
+    case MInstr::DEC:
+      op[0] = 0xFF;
+      emitModRM(1, op, 1, instr.op == MInstr::INC ? 0 : 1, a, false);
+      break;
+
+    case MInstr::SHL:
+      op[0] = 0xC1;
+      emitModRM(1, op, 1, 4, a, false);
+      imm8(b.value);
+      break;
+
+    case MInstr::TEST:
+      op[0] = 0x85;
+      emitModRM(1, op, 1, b.base, a, false);
+      break;
+
+    case MInstr::SETCC:
+      op[0] = 0x0F;
+      op[1] = 0x90 + CONDCODES[instr.cc];
+      emitModRM(0, op, 2, 0, a, true);
+      break;
+
+    case MInstr::JMP:
+    case MInstr::JCC:
+      if (!wide)
+	{
+	  m_out->push_back(instr.op == MInstr::JMP ? 0xEB : 0x70 + CONDCODES[instr.cc]);
+	  imm8(final ? target(a) - static_cast<long long>(m_out->size() + 1) : 0);
+	}
+      else
+	{
+	  if (instr.op == MInstr::JMP)
+	    m_out->push_back(0xE9);
+	  else
+	    {
+	      m_out->push_back(0x0F);
+	      m_out->push_back(0x80 + CONDCODES[instr.cc]);
+	    }
+	  rel32(a, pc, PC32, final);
+	}
+      break;
+
+    case MInstr::CALL:
+      m_out->push_back(0xE8);
+      rel32(a, pc, PLT32, final);
+      break;
+
+    case MInstr::RET:
+      m_out->push_back(0xC3);
+      break;
+    }
+}
+
+/*
+  Lays the code out with every jump short, widens the ones whose target is
+  out of range and repeats until nothing changes.  Widening only ever
+  lengthens the code, so this terminates.
+*/
+void X86Encoder::encode()
+{
+  std::vector<MInstr>& code = mir.code;
+  std::vector<bool> wide(code.size(), false);
+  std::vector<size_t> offset(code.size());
+  std::vector<unsigned char> scratch;
+  bool changed = true;
+
+  passes = 0;
+  m_out = &scratch;
+
+  while (changed)
+    {
+      size_t pc = 0;
+
+      changed = false;
+      passes++;
+      labels.clear();
+
+      for (size_t i = 0; i < code.size(); i++)
+	{
+	  offset[i] = pc;
+	  if (code[i].op == MInstr::LABEL)
+	    labels[code[i].ops[0].value] = pc;
+	  scratch.clear();
+	  encodeInstr(code[i], pc, wide[i], false);
+	  pc += scratch.size();
+	}
+
+      for (size_t i = 0; i < code.size(); i++)
+	{
+	  if ((code[i].op != MInstr::JMP && code[i].op != MInstr::JCC) || wide[i])
+	    continue;
+
+	  long long t = target(code[i].ops[0]);
+	  if (t < 0 || !fits8(t - static_cast<long long>(offset[i] + 2)))
+	    {
+	      wide[i] = true;
+	      changed = true;
+	    }
+	}
+    }
+
+  text.clear();
+  relocs.clear();
+  m_out = &text;
+  for (size_t i = 0; i < code.size(); i++)
+    encodeInstr(code[i], offset[i], wide[i], true);
+}
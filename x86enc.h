@@ -0,0 +1,47 @@
+#pragma once
+
+#include "mir.h"
+
+#include <map>
+#include <vector>
+
+// Encodes an MBuffer into x86-64 machine code.  Jumps start in their short
+// form and are widened until every displacement fits (branch relaxation).
+// References to symbols that are not defined in the buffer, such as printf
+// and the fmt strings, are left as relocations for the object writer.
+class X86Encoder
+{
+public:
+  enum RelocType { PC32 = 2, PLT32 = 4 };   // ELF R_X86_64 numbering
+
+  class Reloc
+  {
+  public:
+    size_t offset;      // Position of the 32-bit field in text
+    int symbol;         // MBuffer symbol id
+    int type;
+    long long addend;
+  };
+
+  X86Encoder(MBuffer& mirx);
+  ~X86Encoder();
+
+  void encode();
+
+  std::vector<unsigned char> text;
+  std::vector<Reloc> relocs;
+  std::map<int, size_t> labels;   // Symbol id -> offset of its definition
+  int passes;
+
+private:
+  void encodeInstr(MInstr& instr, size_t pc, bool wide, bool final);
+  void emitModRM(int w, const unsigned char* opcode, int oplen, int reg,
+		 const MOperand& rm, bool byteRegs);
+  void imm8(long long v);
+  void imm32(long long v);
+  void rel32(const MOperand& target, size_t pc, int type, bool final);
+  long long target(const MOperand& label);
+
+  MBuffer& mir;
+  std::vector<unsigned char>* m_out;
+};